@@ -6,12 +6,20 @@
 #include <kern/pcireg.h> 
 #include <kern/pmap.h>
 #include <kern/picirq.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/tasklet.h>
+#include <kern/trace.h>
+#include <kern/kmem.h>
 #include <inc/x86.h>
 #include <inc/ns.h>
 
 // Global E100 driver structure
 e100_driver_t e100_driver;
 
+// Does the interrupt work that can wait, see e100_handle_int()
+static struct Tasklet e100_tasklet;
+
 // Delay routine. 'n' specifies the number of microseconds
 static void
 delay (int n)
@@ -23,6 +31,27 @@ delay (int n)
     }
 }
 
+//
+// Wake up the env that is waiting on the driver, if any. It has been
+// polling us, so it is still runnable. Ask the scheduler to run it soon,
+// instead of whenever its turn in the run queue comes.
+//
+static void
+e100_wakeup (envid_t *waiter, int latency)
+{
+    struct Env *e;
+
+    if (*waiter == 0) {
+	return;
+    }
+
+    if (envid2env(*waiter, &e, 0) == 0 && e->env_status == ENV_RUNNABLE) {
+	sched_wakeup_hint(e, latency);
+    }
+
+    *waiter = 0;
+}
+
 // Handle TX interrupts
 void
 e100_handle_tx_int (void)
@@ -39,38 +68,93 @@ e100_handle_tx_int (void)
 	e100_driver.tx[q_head].status & E100_CBL_STATUS_C) {
 	/* Reset the CB parameters */
 	e100_driver.tx[q_head].command = 0;
-	memset(&e100_driver.tx[q_head].tcb_data, 0x00, E100_MAX_PACKET_SIZE);
+	kmem_zero_nt(&e100_driver.tx[q_head].tcb_data, E100_MAX_PACKET_SIZE);
 	e100_driver.tx_head = (e100_driver.tx_head + 1) % MAX_E100_TX_SLOTS;
+
+	// There is room in the ring now
+	e100_wakeup(&e100_driver.tx_waiter, E100_TX_WAKE_LATENCY);
     }
 }
 
-// Handle RX interrupts
-void
-e100_handle_rx_int (void)
+// Hand the RFD at the head of the RX ring back to the device
+static void
+e100_rx_recycle (void)
 {
-    uint32_t q_head;
-    struct jif_pkt *p;
+    uint32_t q_head = e100_driver.rx_head;
+    e100_dma_rx_t *rx = &e100_driver.rx[q_head];
 
-    q_head = e100_driver.rx_head;
+    rx->status = 0;
+    rx->command = 0;
+    rx->size = E100_MAX_PACKET_SIZE;
+    e100_driver.rx_class[q_head] = E100_RX_CLASS_NONE;
 
-    // Get the actual number of bytes received from the RFD
-    e100_driver.rx[q_head].actual_count = 
-	e100_driver.rx[q_head].actual_count & RFD_ACTUAL_COUNT_MASK;
+    e100_driver.rx_head = (q_head + 1) % MAX_E100_RX_SLOTS;
+}
 
-    // Anything else needs to be done here??
+//
+// Get the next received frame someone wants, or NULL if there is none.
+// Each frame is run through the RX filter once, in place, as soon as we
+// see it. Frames it drops are recycled right here, so they are never
+// copied and nobody is woken up for them.
+//
+static e100_dma_rx_t *
+e100_rx_next (void)
+{
+    uint32_t q_head, verdict;
+    e100_dma_rx_t *rx;
+
+    for (;;) {
+	q_head = e100_driver.rx_head;
+	rx = &e100_driver.rx[q_head];
+
+	if (!(rx->status & E100_RFD_STATUS_OK) ||
+	    !(rx->status & E100_RFD_STATUS_C)) {
+	    return NULL;
+	}
+
+	if (e100_driver.rx_class[q_head] != E100_RX_CLASS_NONE) {
+	    return rx;
+	}
+
+	// Mask out the F and EOF bits
+	rx->actual_count = rx->actual_count & RFD_ACTUAL_COUNT_MASK;
+
+	verdict = pfilter_run(&e100_driver.rx_filter, rx->data,
+			      rx->actual_count);
+	if (verdict != PFILTER_DROP) {
+	    e100_driver.rx_class[q_head] = verdict;
+	    return rx;
+	}
+
+	e100_driver.rx_dropped++;
+	TRACE(TRACE_CAT_NET, TRACE_E100_RX_DROP, q_head, rx->actual_count, 0);
+	e100_rx_recycle();
+    }
 }
 
-// Generic handler for the E100 interrupts
+// Handle RX interrupts
 void
-e100_handle_int (void)
+e100_handle_rx_int (void)
 {
-    int status;
+    // Let the receiver know right away, if the frame is for it
+    if (e100_rx_next() != NULL) {
+	e100_wakeup(&e100_driver.rx_waiter, SCHED_WAKE_NOW);
+    }
+}
 
-    // Check what was the type of interrupt raised
-    status = inb(e100_driver.io_base + E100_SCB_STATUS_WORD);
+//
+// Handle the interrupts the device raised since the tasklet last ran. This
+// runs with interrupts enabled. The only thing it shares with
+// e100_handle_int() is int_status, which both update atomically.
+//
+static void
+e100_handle_int_deferred (uint32_t arg)
+{
+    uint32_t status;
 
-    // Write back the acknowledgement
-    outb(e100_driver.io_base + E100_SCB_STATUS_WORD, status);
+    asm volatile("xchgl %0, %1" :
+		 "+m" (e100_driver.int_status), "=r" (status) :
+		 "1" (0));
 
     // TX interrupts
     if (status & (E100_SCB_STATUS_CXTNO | E100_SCB_STATUS_CNA)) {
@@ -81,6 +165,28 @@ e100_handle_int (void)
     if (status & E100_SCB_STATUS_FR) {
 	e100_handle_rx_int();
     }
+}
+
+//
+// Generic handler for the E100 interrupts. Only acknowledges them here,
+// the rest is left to e100_tasklet so that other devices are not kept
+// waiting meanwhile.
+//
+void
+e100_handle_int (void)
+{
+    int status;
+
+    // Check what was the type of interrupt raised
+    status = inb(e100_driver.io_base + E100_SCB_STATUS_WORD);
+
+    // Write back the acknowledgement
+    outb(e100_driver.io_base + E100_SCB_STATUS_WORD, status);
+
+    // Note what happened, for the tasklet
+    asm volatile("lock; orl %1, %0" :
+		 "+m" (e100_driver.int_status) : "r" (status) : "cc");
+    tasklet_schedule(&e100_tasklet);
 
     // Notify the device that the interrupt was handled
     irq_eoi();
@@ -100,7 +206,10 @@ e100_transmit_packet (void *pkt, uint32_t pkt_size)
 
     // Ensure that we have enough space for the packet
     if (((q_tail + 1) % MAX_E100_TX_SLOTS) == q_head) {
-	cprintf("e100_transmit_packet: tx buffer full\n");
+	TRACE(TRACE_CAT_NET, TRACE_E100_TX_FULL, q_head, q_tail, 0);
+	if (curenv) {
+	    e100_driver.tx_waiter = curenv->env_id;
+	}
 	return -E_NO_MEM;
     }
 
@@ -112,8 +221,8 @@ e100_transmit_packet (void *pkt, uint32_t pkt_size)
     tx->command = E100_CBL_COMMAND_TX | E100_CBL_COMMAND_I | E100_CBL_COMMAND_S;
     tx->tcb_byte_count = pkt_size;
 
-    // Copy the packet data to CB
-    memmove(&tx->tcb_data, pkt_data, pkt_size);
+    // Copy the packet data to CB. Only the device reads it from here on.
+    kmem_copy_nt(&tx->tcb_data, pkt_data, pkt_size);
 
     // Update the tail pointer
     e100_driver.tx_tail = (e100_driver.tx_tail + 1) % MAX_E100_TX_SLOTS;
@@ -147,45 +256,67 @@ e100_transmit_packet (void *pkt, uint32_t pkt_size)
 int
 e100_receive_packet (void *pkt_buf)
 {
-    uint32_t q_head;
+    return e100_receive_packet_class(pkt_buf, NULL);
+}
+
+//
+// Receive a packet, and the class the RX filter steered it to. This is
+// PFILTER_ACCEPT unless the filter says otherwise.
+//
+int
+e100_receive_packet_class (void *pkt_buf, uint32_t *class_store)
+{
     e100_dma_rx_t *rx;
     struct jif_pkt *pkt = (struct jif_pkt *)pkt_buf;
 
-    // Get the RX head
-    q_head = e100_driver.rx_head;
-
-    // Get the pointer to the current RFD
-    rx = &e100_driver.rx[q_head]; 
-
     // See if we have a packet to send back
-    if ((rx->status & E100_RFD_STATUS_OK) && 
-	(rx->status & E100_RFD_STATUS_C)) {
-
-	// Mask out the F and EOF bits
-	rx->actual_count = rx->actual_count & RFD_ACTUAL_COUNT_MASK;
+    if ((rx = e100_rx_next()) != NULL) {
 
 	// Copy over the contents to the buffer passed by the caller
  	pkt->jp_len = rx->actual_count;
-	memmove(pkt->jp_data, rx->data, pkt->jp_len);
+	kmem_copy(pkt->jp_data, rx->data, pkt->jp_len);
 
-	// Reset the RFD
-	rx->status = 0;
-	rx->command = 0;
-	rx->size = E100_MAX_PACKET_SIZE;
+	if (class_store) {
+	    *class_store = e100_driver.rx_class[e100_driver.rx_head];
+	}
 
-	// Update the head pointer
-	e100_driver.rx_head = (e100_driver.rx_head + 1) % MAX_E100_RX_SLOTS; 
+	// Reset the RFD and update the head pointer
+	e100_rx_recycle();
 
 	return 0;
 
     } else {
-	// No luck. Ask the caller to retry.
+	// No luck. Ask the caller to retry, and wake it up when one arrives.
+	if (curenv) {
+	    e100_driver.rx_waiter = curenv->env_id;
+	}
 	return -E_NO_PKT;
     }
    
     return 0;
 }
 
+//
+// Attach a filter program to the RX path, replacing the one there was.
+// A zero length program detaches the filter. Frames already received but
+// not picked up yet are run through the new filter.
+//
+int
+e100_set_filter (const struct Pf_insn *insns, uint32_t len)
+{
+    int i, r;
+
+    if ((r = pfilter_load(&e100_driver.rx_filter, insns, len)) < 0) {
+	return r;
+    }
+
+    for (i = 0; i < MAX_E100_RX_SLOTS; i++) {
+	e100_driver.rx_class[i] = E100_RX_CLASS_NONE;
+    }
+
+    return 0;
+}
+
 //
 // E100 Attach function
 //
@@ -202,6 +333,8 @@ e100_attach (struct pci_func *pcif)
     // Initialize the driver structure
     e100_driver.mem_base = pcif->reg_base[0];
     e100_driver.io_base = pcif->reg_base[1];
+    e100_driver.int_status = 0;
+    tasklet_init(&e100_tasklet, e100_handle_int_deferred, 0);
 
     // Reset the device
     outl(e100_driver.io_base + E100_PORT, 0);
@@ -217,7 +350,7 @@ e100_attach (struct pci_func *pcif)
 	next = (i + 1) % MAX_E100_TX_SLOTS;
 
 	// Zero out the CB block
-	memset(&e100_driver.tx[i], 0, sizeof(e100_dma_tx_t));
+	kmem_zero(&e100_driver.tx[i], sizeof(e100_dma_tx_t));
 
 	// Initialize the contents
 	e100_driver.tx[i].link = PADDR(&e100_driver.tx[next]);
@@ -241,7 +374,7 @@ e100_attach (struct pci_func *pcif)
 	next = (i + 1) % MAX_E100_RX_SLOTS;
 
 	// Zero out the RFD block
-	memset(&e100_driver.rx[i], 0, sizeof(e100_dma_rx_t));
+	kmem_zero(&e100_driver.rx[i], sizeof(e100_dma_rx_t));
 
 	// Initialize the contents
 	e100_driver.rx[i].status = 0;
@@ -1,7 +1,9 @@
 #ifndef JOS_KERN_E100_H
 #define JOS_KERN_E100_H
 
+#include <inc/env.h>
 #include <kern/pci.h>
+#include <kern/pfilter.h>
 
 /* Defines */
 
@@ -61,6 +63,12 @@
 /* Maximum packet size is same as that of the maximum ethernet packet size */
 #define E100_MAX_PACKET_SIZE		1518
 
+/* Ticks an env waiting for TX slots can wait once they are freed */
+#define E100_TX_WAKE_LATENCY		1
+
+/* Class of a received frame the RX filter has not looked at yet */
+#define E100_RX_CLASS_NONE		PFILTER_DROP
+
 /* Data Structures */
 
 typedef struct e100_dma_rx_ {
@@ -97,11 +105,19 @@ typedef struct e100_driver_ {
     uint32_t	    tx_tail;
     uint32_t	    rx_head;
     uint32_t	    rx_tail;
+    envid_t	    rx_waiter;	/* Env that found the RX ring empty */
+    envid_t	    tx_waiter;	/* Env that found the TX ring full */
+    struct Pfilter  rx_filter;	/* Run on every frame before it is copied */
+    uint32_t	    rx_class[MAX_E100_RX_SLOTS]; /* Verdict for each RFD */
+    uint32_t	    rx_dropped;	/* Frames the filter dropped */
+    volatile uint32_t int_status; /* SCB status the tasklet has yet to see */
 } e100_driver_t;
 
 void e100_handle_int (void);
 int e100_transmit_packet (void *pkt_data, uint32_t pkt_size);
 int e100_receive_packet (void *pkt_buf);
+int e100_receive_packet_class (void *pkt_buf, uint32_t *class_store);
+int e100_set_filter (const struct Pf_insn *insns, uint32_t len);
 int e100_attach (struct pci_func *pcif);
 
 #endif	// JOS_KERN_E100_H
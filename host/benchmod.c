@@ -0,0 +1,100 @@
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <kern/module.h>
+#include <kern/ksym.h>
+
+//
+// Module for the loader benchmarks in modbench. It does nothing useful;
+// it is there to be relocated. Every one of its BENCH_FUNCS functions
+// calls the next one and a kernel function, and is in a table of
+// function pointers, which makes for a few hundred relocations of both
+// kinds against local and kernel symbols, about what a driver has.
+//
+
+// Defines
+
+#define BENCH_FUNCS	64
+
+#define BENCH_FN(n)						\
+static int							\
+bench_fn##n (int x)						\
+{								\
+    return bench_next(n, x) + (int)strlen(bench_names[n % 8]);	\
+}
+
+#define BENCH_FN8(n)						\
+    BENCH_FN(n##0) BENCH_FN(n##1) BENCH_FN(n##2) BENCH_FN(n##3)	\
+    BENCH_FN(n##4) BENCH_FN(n##5) BENCH_FN(n##6) BENCH_FN(n##7)
+
+#define BENCH_REF8(n)						\
+    bench_fn##n##0, bench_fn##n##1, bench_fn##n##2, bench_fn##n##3, \
+    bench_fn##n##4, bench_fn##n##5, bench_fn##n##6, bench_fn##n##7,
+
+// Global Variables
+
+static const char *bench_names[8] = {
+    "cprintf", "memset", "memmove", "strlen",
+    "ksym_lookup", "module_register", "module_invoke_hooks", "strcmp"
+};
+
+static int (*bench_table[BENCH_FUNCS])(int);
+
+static char bench_buf[256];
+
+// Function Prototypes
+
+static int bench_next (int n, int x);
+
+BENCH_FN8(0) BENCH_FN8(1) BENCH_FN8(2) BENCH_FN8(3)
+BENCH_FN8(4) BENCH_FN8(5) BENCH_FN8(6) BENCH_FN8(7)
+
+static int (*bench_table[BENCH_FUNCS])(int) = {
+    BENCH_REF8(0) BENCH_REF8(1) BENCH_REF8(2) BENCH_REF8(3)
+    BENCH_REF8(4) BENCH_REF8(5) BENCH_REF8(6) BENCH_REF8(7)
+};
+
+// Each function calls the one after it, once
+static int
+bench_next (int n, int x)
+{
+    if (x <= 0 || n + 1 >= BENCH_FUNCS) {
+	return 0;
+    }
+
+    memset(bench_buf, n, sizeof(bench_buf));
+    return bench_table[n + 1](x - 1) + bench_buf[0];
+}
+
+static int
+bench_test_api (void)
+{
+    int i, sum = 0;
+
+    for (i = 0; i < 8; i++) {
+	if (ksym_lookup(bench_names[i]) == 0) {
+	    cprintf("benchmod: %s is not in the symbol table\n",
+		    bench_names[i]);
+	}
+    }
+
+    for (i = 0; i < BENCH_FUNCS; i++) {
+	sum += bench_table[i](1);
+    }
+
+    return sum;
+}
+
+int
+init_module (uint32_t mod_index)
+{
+    module_register(mod_index, MODULE_TEST_API, bench_test_api);
+    return 0;
+}
+
+int
+cleanup_module (uint32_t mod_index)
+{
+    return 0;
+}
+
+// End of File
@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/env.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kdebug.h>
+#include <kern/monitor.h>
+#include <kern/symboltable.h>
+#include <kern/tasklet.h>
+#include <kern/tsc.h>
+
+#include "host.h"
+
+//
+// Kernel services for the hosted harness. The kernel files are compiled
+// unchanged against the stand-in headers in host/inc and host/kern, and
+// these routines stand in for the rest of the kernel.
+//
+// "Physical" memory is a memfd of HOST_NPAGES pages, mapped at KERNBASE.
+// A page mapped elsewhere with page_insert() is the same part of the memfd
+// mapped again, with the permissions of its page table entry, so writes
+// through either address show up in both, and a page that is not mapped
+// any more faults when it is touched, as it would in the kernel. Only the
+// MODULE_DATA window can be mapped into; it is reserved at startup.
+//
+
+// Page descriptors and the free list
+static struct Page host_pages[HOST_NPAGES];
+struct Page *pages = host_pages;
+size_t npage = HOST_NPAGES;
+static struct Page *page_free_list;
+
+// One page table for the low 4GB. boot_pgdir is only ever passed back.
+static pte_t host_pgtable[1 << 20];
+static pde_t host_pgdir[NPTENTRIES];
+pde_t *boot_pgdir = host_pgdir;
+
+static int host_ramfd = -1;
+
+// The envs, and the idle env in envs[0]
+static struct Env host_envs[NENV];
+struct Env *envs = host_envs;
+struct Env *curenv;
+
+jmp_buf host_trap;
+
+// TSC cycles per microsecond, measured at startup
+static uint64_t host_tsc_per_us;
+
+static const char * const error_string[MAXERROR] = {
+	[E_UNSPECIFIED]	= "unspecified error",
+	[E_BAD_ENV]	= "bad environment",
+	[E_INVAL]	= "invalid parameter",
+	[E_NO_MEM]	= "out of memory",
+	[E_NO_FREE_ENV]	= "out of environments",
+	[E_FAULT]	= "segmentation fault",
+	[E_IPC_NOT_RECV]= "env is not recving",
+	[E_EOF]		= "unexpected end of file",
+	[E_NO_DISK]	= "no free space on disk",
+	[E_MAX_OPEN]	= "too many files are open",
+	[E_NOT_FOUND]	= "file or block not found",
+	[E_BAD_PATH]	= "invalid path",
+	[E_FILE_EXISTS]	= "file already exists",
+	[E_NOT_EXEC]	= "file is not a valid executable",
+};
+
+//
+// Console. The kernel's format verbs are those of the C library, except
+// for %e, which prints an error code, and 'l', which means 32 bits as it
+// does on i386. Each conversion is handed to the C library on its own.
+//
+int
+vcprintf(const char *fmt, va_list ap)
+{
+	char spec[16];
+	const char *s;
+	int len, lflag, err, cnt = 0;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			putchar(*fmt);
+			cnt++;
+			continue;
+		}
+
+		len = 0;
+		spec[len++] = *fmt++;
+		while (*fmt && strchr("-+ #0123456789.", *fmt) && len < 8)
+			spec[len++] = *fmt++;
+		for (lflag = 0; *fmt == 'l'; fmt++)
+			lflag++;
+		if (*fmt == '\0')
+			break;
+
+		if (lflag >= 2 && strchr("duxXo", *fmt)) {
+			spec[len++] = 'l';
+			spec[len++] = 'l';
+		}
+		spec[len++] = *fmt;
+		spec[len] = '\0';
+
+		switch (*fmt) {
+		case 'd':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			if (lflag >= 2)
+				cnt += printf(spec, va_arg(ap, long long));
+			else
+				cnt += printf(spec, va_arg(ap, int));
+			break;
+		case 'c':
+			cnt += printf(spec, va_arg(ap, int));
+			break;
+		case 's':
+			if ((s = va_arg(ap, const char *)) == NULL)
+				s = "(null)";
+			cnt += printf(spec, s);
+			break;
+		case 'p':
+			cnt += printf("0x%08lx", (unsigned long) va_arg(ap, void *));
+			break;
+		case '%':
+			putchar('%');
+			cnt++;
+			break;
+		case 'e':
+			err = va_arg(ap, int);
+			if (err < 0)
+				err = -err;
+			if (err >= MAXERROR || error_string[err] == NULL)
+				cnt += printf("error %d", err);
+			else
+				cnt += printf("%s", error_string[err]);
+			break;
+		default:
+			cnt += printf("%s", spec);
+			break;
+		}
+	}
+
+	return cnt;
+}
+
+int
+cprintf(const char *fmt, ...)
+{
+	va_list ap;
+	int cnt;
+
+	va_start(ap, fmt);
+	cnt = vcprintf(fmt, ap);
+	va_end(ap);
+
+	return cnt;
+}
+
+void
+_panic(const char *file, int line, const char *fmt, ...)
+{
+	va_list ap;
+
+	fflush(stdout);
+	cprintf("kernel panic at %s:%d: ", file, line);
+	va_start(ap, fmt);
+	vcprintf(fmt, ap);
+	va_end(ap);
+	cprintf("\n");
+	fflush(stdout);
+
+	abort();
+}
+
+void
+_warn(const char *file, int line, const char *fmt, ...)
+{
+	va_list ap;
+
+	cprintf("kernel warning at %s:%d: ", file, line);
+	va_start(ap, fmt);
+	vcprintf(fmt, ap);
+	va_end(ap);
+	cprintf("\n");
+}
+
+// There is nobody to type commands. Reaching it is a bug in the driver.
+void
+monitor(struct Trapframe *tf)
+{
+	panic("monitor: no console in the hosted build");
+}
+
+//
+// Physical page allocation, as in kern/pmap.c
+//
+int
+page_alloc(struct Page **pp_store)
+{
+	struct Page *pp;
+
+	if ((pp = page_free_list) == NULL)
+		return -E_NO_MEM;
+
+	page_free_list = pp->pp_link;
+	pp->pp_link = NULL;
+	pp->pp_ref = 0;
+	*pp_store = pp;
+	return 0;
+}
+
+void
+page_free(struct Page *pp)
+{
+	if (pp->pp_ref)
+		panic("page_free: page %d is still referenced", page2ppn(pp));
+
+	pp->pp_link = page_free_list;
+	page_free_list = pp;
+}
+
+void
+page_decref(struct Page *pp)
+{
+	if (--pp->pp_ref == 0)
+		page_free(pp);
+}
+
+pte_t *
+pgdir_walk(pde_t *pgdir, const void *va, int create)
+{
+	if ((uint64_t) (uintptr_t) va >> 32)
+		return NULL;
+	return &host_pgtable[PGNUM(va)];
+}
+
+//
+// Make the host's mapping of 'va' what its page table entry says. In the
+// kernel this only has to flush the TLB.
+//
+void
+tlb_invalidate(pde_t *pgdir, void *va)
+{
+	pte_t pte = host_pgtable[PGNUM(va)];
+	int prot = PROT_READ | PROT_EXEC;
+	void *r;
+
+	if ((uintptr_t) va < MODULE_DATA ||
+	    (uintptr_t) va >= MODULE_DATA + PTSIZE)
+		panic("tlb_invalidate: %p is outside the module window", va);
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (pte & PTE_P) {
+		if (pte & PTE_W)
+			prot |= PROT_WRITE;
+		r = mmap(va, PGSIZE, prot, MAP_SHARED | MAP_FIXED, host_ramfd,
+			 PTE_ADDR(pte));
+	} else {
+		r = mmap(va, PGSIZE, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+			 -1, 0);
+	}
+
+	if (r == MAP_FAILED)
+		panic("tlb_invalidate: can't map %p", va);
+}
+
+struct Page *
+page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
+{
+	pte_t *pte = pgdir_walk(pgdir, va, 0);
+
+	if (pte_store)
+		*pte_store = pte;
+	if (pte == NULL || !(*pte & PTE_P))
+		return NULL;
+	return pa2page(PTE_ADDR(*pte));
+}
+
+void
+page_remove(pde_t *pgdir, void *va)
+{
+	struct Page *pp;
+	pte_t *pte;
+
+	if ((pp = page_lookup(pgdir, va, &pte)) == NULL)
+		return;
+
+	*pte = 0;
+	tlb_invalidate(pgdir, va);
+	page_decref(pp);
+}
+
+int
+page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
+{
+	pte_t *pte;
+
+	if ((pte = pgdir_walk(pgdir, va, 1)) == NULL)
+		return -E_NO_MEM;
+
+	pp->pp_ref++;
+	if (*pte & PTE_P)
+		page_remove(pgdir, va);
+
+	*pte = page2pa(pp) | perm | PTE_P;
+	tlb_invalidate(pgdir, va);
+	return 0;
+}
+
+//
+// Environments. There is no address space or trap frame to set up, only
+// the fields the scheduler looks at.
+//
+int
+envid2env(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+
+	if (envid == 0) {
+		*env_store = curenv;
+		return 0;
+	}
+
+	e = &envs[ENVX(envid)];
+	if (e->env_status == ENV_FREE || e->env_id != envid) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+
+	if (checkperm && e != curenv && e->env_parent_id != curenv->env_id) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+
+	*env_store = e;
+	return 0;
+}
+
+// Take a free env slot, as env_alloc() does. The env is runnable.
+struct Env *
+host_env_alloc(int prio)
+{
+	struct Env *e;
+	int32_t generation;
+	int i;
+
+	for (i = 1; i < NENV; i++)
+		if (envs[i].env_status == ENV_FREE)
+			break;
+	if (i == NENV)
+		return NULL;
+
+	e = &envs[i];
+	generation = (e->env_id + (1 << LOG2NENV)) & ~(NENV - 1);
+	if (generation <= 0)
+		generation = 1 << LOG2NENV;
+
+	memset(&e->env_tf, 0, sizeof(e->env_tf));
+	e->env_id = generation | i;
+	e->env_parent_id = curenv ? curenv->env_id : 0;
+	e->env_status = ENV_RUNNABLE;
+	e->env_runs = 0;
+	e->priority = prio;
+	e->env_ipc_recving = 0;
+	return e;
+}
+
+// Free an env, as env_destroy() does. The caller then calls sched_yield().
+void
+host_env_free(struct Env *e)
+{
+	e->env_status = ENV_FREE;
+	if (e == curenv)
+		curenv = NULL;
+}
+
+void
+env_run(struct Env *e)
+{
+	curenv = e;
+	e->env_runs++;
+	longjmp(host_trap, 1);
+}
+
+void
+env_create(uint8_t *binary, size_t size)
+{
+	panic("env_create: no user programs in the hosted build");
+}
+
+//
+// The kernel's symbol table. The harness is linked with -rdynamic, so its
+// own symbols are all there. Addresses have to fit in 32 bits; on a 64 bit
+// host the modules' code is never run, so any non zero value will do.
+//
+uint32_t
+get_symbol_addr(char *symbol_name)
+{
+	uintptr_t addr = (uintptr_t) dlsym(RTLD_DEFAULT, symbol_name);
+
+	if (addr != (uint32_t) addr)
+		addr = (uint32_t) addr ? (uint32_t) addr : 1;
+	return addr;
+}
+
+#if !defined(__i386__)
+//
+// The kernel links libgcc, so modules may use its 64 bit division. An
+// i386 build gets these from libgcc as well; elsewhere they are only here
+// to be found.
+//
+uint64_t
+__udivdi3(uint64_t a, uint64_t b)
+{
+	return a / b;
+}
+
+uint64_t
+__umoddi3(uint64_t a, uint64_t b)
+{
+	return a % b;
+}
+#endif
+
+// No stabs to look in
+int
+debuginfo_eip(uintptr_t eip, struct Eipdebuginfo *info)
+{
+	return -1;
+}
+
+//
+// Deferred work and the TSC. The drivers take no interrupts, so there is
+// never a tasklet to run.
+//
+void
+tasklet_run(void)
+{
+}
+
+int
+tasklet_active(void)
+{
+	return 0;
+}
+
+void
+tsc_tick(void)
+{
+}
+
+uint64_t
+tsc_cycles2ns(uint64_t cycles)
+{
+	return cycles * 1000 / host_tsc_per_us;
+}
+
+uint64_t
+host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+host_init(void)
+{
+	uint64_t tsc, ns;
+	int i;
+
+	// Physical memory
+	if ((host_ramfd = memfd_create("jos-ram", 0)) < 0 ||
+	    ftruncate(host_ramfd, (off_t) HOST_NPAGES * PGSIZE) < 0 ||
+	    mmap((void *) KERNBASE, HOST_NPAGES * PGSIZE,
+		 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+		 host_ramfd, 0) != (void *) KERNBASE)
+		panic("host_init: can't set up memory at %08x", KERNBASE);
+
+	for (i = HOST_NPAGES - 1; i >= 0; i--) {
+		pages[i].pp_link = page_free_list;
+		page_free_list = &pages[i];
+	}
+
+	// The module window, with nothing mapped in it yet
+	if (mmap((void *) MODULE_DATA, PTSIZE, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE |
+		 MAP_NORESERVE, -1, 0) != (void *) MODULE_DATA)
+		panic("host_init: can't reserve %08x", MODULE_DATA);
+
+	// The idle env
+	envs[0].env_id = 1 << LOG2NENV;
+	envs[0].env_status = ENV_RUNNABLE;
+
+	// Calibrate the TSC against the host's clock
+	tsc = read_tsc();
+	ns = host_ns();
+	while (host_ns() - ns < 10000000)
+		;
+	host_tsc_per_us = (read_tsc() - tsc) * 1000 / (host_ns() - ns);
+	if (host_tsc_per_us == 0)
+		host_tsc_per_us = 1;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+}
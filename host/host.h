@@ -0,0 +1,31 @@
+#ifndef JOS_HOST_HOST_H
+#define JOS_HOST_HOST_H
+
+//
+// What the hosted harness adds to the kernel's interfaces. host/host.c
+// provides the kernel services module.c and sched.c need, as a Linux
+// process: memory, a page table for the module window, the envs, the
+// console and the kernel's symbol table.
+//
+
+#include <setjmp.h>
+
+#include <inc/types.h>
+
+struct Env;
+
+//
+// env_run() does not return in the kernel either. Here it jumps back to
+// host_trap, which the drivers set up where trap() would be, just before
+// they call sched_yield() and friends.
+//
+extern jmp_buf host_trap;
+
+// Function Prototypes
+
+void host_init (void);
+struct Env *host_env_alloc (int prio);
+void host_env_free (struct Env *e);
+uint64_t host_ns (void);
+
+#endif // !JOS_HOST_HOST_H
@@ -0,0 +1,96 @@
+#ifndef JOS_INC_ELF_H
+#define JOS_INC_ELF_H
+
+//
+// Hosted stand-in for inc/elf.h. The structures are those of 32 bit ELF
+// files whatever the host is, since module images are i386 objects.
+//
+
+#include <inc/types.h>
+
+#define ELF_MAGIC 0x464C457FU	/* "\x7FELF" in little endian */
+
+struct Elf {
+	uint32_t e_magic;	// must equal ELF_MAGIC
+	uint8_t e_elf[12];
+	uint16_t e_type;
+	uint16_t e_machine;
+	uint32_t e_version;
+	uint32_t e_entry;
+	uint32_t e_phoff;
+	uint32_t e_shoff;
+	uint32_t e_flags;
+	uint16_t e_ehsize;
+	uint16_t e_phentsize;
+	uint16_t e_phnum;
+	uint16_t e_shentsize;
+	uint16_t e_shnum;
+	uint16_t e_shstrndx;
+};
+
+struct Secthdr {
+	uint32_t sh_name;
+	uint32_t sh_type;
+	uint32_t sh_flags;
+	uint32_t sh_addr;
+	uint32_t sh_offset;
+	uint32_t sh_size;
+	uint32_t sh_link;
+	uint32_t sh_info;
+	uint32_t sh_addralign;
+	uint32_t sh_entsize;
+};
+
+struct Symbol {
+	uint32_t sym_name;
+	uint32_t sym_value;
+	uint32_t sym_size;
+	uint8_t sym_info;
+	uint8_t sym_other;
+	uint16_t sym_shndx;
+};
+
+struct Rel {
+	uint32_t rel_offset;
+	uint32_t rel_info;
+};
+
+// Values for Secthdr::sh_type
+#define ELF_SHT_NULL		0
+#define ELF_SHT_PROGBITS	1
+#define ELF_SHT_SYMTAB		2
+#define ELF_SHT_STRTAB		3
+#define ELF_SHT_RELA		4
+#define ELF_SHT_NOBITS		8
+#define ELF_SHT_REL		9
+
+// Values for Secthdr::sh_flags
+#define SHF_WRITE		0x1
+#define SHF_ALLOC		0x2
+#define SHF_EXECINSTR		0x4
+
+// Special section indexes
+#define ELF_SHN_UNDEF		0
+#define ELF_SHN_ABS		0xfff1
+#define ELF_SHN_COMMON		0xfff2
+#define SHN_ABS			ELF_SHN_ABS
+#define SHN_COMMON		ELF_SHN_COMMON
+
+// Symbol binding and type
+#define ELF32_ST_BIND(i)	((i) >> 4)
+#define ELF32_ST_TYPE(i)	((i) & 0xf)
+#define STB_LOCAL		0
+#define STB_GLOBAL		1
+#define STB_WEAK		2
+#define STT_NOTYPE		0
+#define STT_OBJECT		1
+#define STT_FUNC		2
+
+// Relocation entries
+#define ELF32_R_SYM(i)		((i) >> 8)
+#define ELF32_R_TYPE(i)		((unsigned char) (i))
+#define R_386_NONE		0
+#define R_386_32		1
+#define R_386_PC32		2
+
+#endif /* !JOS_INC_ELF_H */
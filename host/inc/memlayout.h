@@ -0,0 +1,53 @@
+#ifndef JOS_INC_MEMLAYOUT_H
+#define JOS_INC_MEMLAYOUT_H
+
+//
+// Hosted stand-in for inc/memlayout.h. The harness runs as a user process,
+// so the kernel's windows move to addresses the host leaves free, below
+// 2GB so that they stay clear of the sanitizers' shadow memory and fit in
+// the 32 bit addresses the kernel code keeps.
+//
+// KERNBASE is where host/host.c maps the memory page_alloc() hands out,
+// the stand-in for physical memory. It is HOST_NPAGES pages long.
+// Modules are mapped, page by page, into MODULE_DATA.
+//
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+#define KERNBASE	0x60000000
+#define HOST_NPAGES	16384
+
+#define MODULE_DATA	0x50000000
+
+// Not used by the harness, but the kernel headers refer to them
+#define KSTACKTOP	KERNBASE
+#define KSTKSIZE	(8*PGSIZE)
+#define KSTKGAP		(8*PGSIZE)
+#define ULIM		0x40000000
+#define UVPT		(ULIM - PTSIZE)
+#define UPAGES		(UVPT - PTSIZE)
+#define UENVS		(UPAGES - PTSIZE)
+#define UTOP		UENVS
+
+#ifndef __ASSEMBLER__
+
+/*
+ * Page descriptor structures, mapped at UPAGES.
+ * Read/write to the kernel, read-only to user programs.
+ *
+ * Each Page describes one physical page.
+ * You can map a Page * to the corresponding physical address
+ * with page2pa() in kern/pmap.h.
+ */
+struct Page {
+	// Next page on the free list.
+	struct Page *pp_link;
+
+	// pp_ref is the count of pointers (usually in page table entries)
+	// to this page, for pages allocated using page_alloc.
+	uint16_t pp_ref;
+};
+
+#endif /* !__ASSEMBLER__ */
+#endif /* !JOS_INC_MEMLAYOUT_H */
@@ -0,0 +1,36 @@
+#ifndef JOS_INC_MMU_H
+#define JOS_INC_MMU_H
+
+//
+// Hosted stand-in for inc/mmu.h: the page size and the page table entry
+// bits the kernel code uses. host/host.c keeps page tables of this format
+// for the window modules are mapped into, and applies them with mprotect().
+//
+
+#include <inc/types.h>
+
+// page number field of address
+#define PGNUM(la)	(((uintptr_t) (la)) >> PTXSHIFT)
+
+#define NPTENTRIES	1024		// page table entries per page table
+
+#define PGSIZE		4096		// bytes mapped by a page
+#define PGSHIFT		12		// log2(PGSIZE)
+
+#define PTSIZE		(PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
+#define PTSHIFT		22		// log2(PTSIZE)
+
+#define PTXSHIFT	12		// offset of PTX in a linear address
+
+// Page table/directory entry flags.
+#define PTE_P		0x001	// Present
+#define PTE_W		0x002	// Writeable
+#define PTE_U		0x004	// User
+
+// Address in page table or page directory entry
+#define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
+
+typedef uint32_t pte_t;
+typedef uint32_t pde_t;
+
+#endif /* !JOS_INC_MMU_H */
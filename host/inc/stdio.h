@@ -0,0 +1,16 @@
+#ifndef JOS_INC_STDIO_H
+#define JOS_INC_STDIO_H
+
+// Hosted stand-in for inc/stdio.h. cprintf() goes to the host's stdout.
+
+#include <inc/types.h>
+
+#ifndef NULL
+#define NULL	((void *) 0)
+#endif /* !NULL */
+
+// host/host.c
+int	cprintf(const char *fmt, ...);
+int	vcprintf(const char *fmt, __builtin_va_list);
+
+#endif /* !JOS_INC_STDIO_H */
@@ -0,0 +1,23 @@
+#ifndef JOS_INC_STRING_H
+#define JOS_INC_STRING_H
+
+//
+// Hosted stand-in for inc/string.h. These are the C library's routines,
+// so the prototypes are the C library's too.
+//
+
+#include <inc/types.h>
+
+size_t	strlen(const char *s);
+char *	strcpy(char *dst, const char *src);
+char *	strncpy(char *dst, const char *src, size_t size);
+int	strcmp(const char *s1, const char *s2);
+int	strncmp(const char *s1, const char *s2, size_t size);
+char *	strchr(const char *s, int c);
+
+void *	memset(void *dst, int c, size_t len);
+void *	memcpy(void *dst, const void *src, size_t len);
+void *	memmove(void *dst, const void *src, size_t len);
+int	memcmp(const void *s1, const void *s2, size_t len);
+
+#endif /* not JOS_INC_STRING_H */
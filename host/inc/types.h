@@ -0,0 +1,73 @@
+#ifndef JOS_INC_TYPES_H
+#define JOS_INC_TYPES_H
+
+//
+// Hosted stand-in for inc/types.h. The fixed width types come from the
+// compiler, so that they agree with the C library the harness links with,
+// on i386 as well as on x86_64.
+//
+
+#ifndef NULL
+#define NULL ((void*) 0)
+#endif
+
+// Represents true-or-false values
+typedef int bool;
+
+// Explicitly-sized versions of integer types
+typedef __INT8_TYPE__ int8_t;
+typedef __UINT8_TYPE__ uint8_t;
+typedef __INT16_TYPE__ int16_t;
+typedef __UINT16_TYPE__ uint16_t;
+typedef __INT32_TYPE__ int32_t;
+typedef __UINT32_TYPE__ uint32_t;
+typedef __INT64_TYPE__ int64_t;
+typedef __UINT64_TYPE__ uint64_t;
+
+// Pointers and addresses are as wide as the host's
+typedef __INTPTR_TYPE__ intptr_t;
+typedef __UINTPTR_TYPE__ uintptr_t;
+typedef uintptr_t physaddr_t;
+
+// Page numbers are 32 bits long.
+typedef uint32_t ppn_t;
+
+// size_t is used for memory object sizes.
+typedef __SIZE_TYPE__ size_t;
+
+// ssize_t and off_t are left to the C library, nothing here uses them.
+
+// Efficient min and max operations
+#define MIN(_a, _b)						\
+({								\
+	typeof(_a) __a = (_a);					\
+	typeof(_b) __b = (_b);					\
+	__a <= __b ? __a : __b;					\
+})
+#define MAX(_a, _b)						\
+({								\
+	typeof(_a) __a = (_a);					\
+	typeof(_b) __b = (_b);					\
+	__a >= __b ? __a : __b;					\
+})
+
+// Rounding operations (efficient when n is a power of 2)
+// Round down to the nearest multiple of n
+#define ROUNDDOWN(a, n)						\
+({								\
+	uintptr_t __a = (uintptr_t) (a);			\
+	(typeof(a)) (__a - __a % (n));				\
+})
+// Round up to the nearest multiple of n
+#define ROUNDUP(a, n)						\
+({								\
+	uintptr_t __n = (uintptr_t) (n);			\
+	(typeof(a)) (ROUNDDOWN((uintptr_t) (a) + __n - 1, __n));	\
+})
+
+// Return the offset of 'member' relative to the beginning of a struct type
+#ifndef offsetof
+#define offsetof(type, member)  __builtin_offsetof(type, member)
+#endif
+
+#endif /* !JOS_INC_TYPES_H */
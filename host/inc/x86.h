@@ -0,0 +1,53 @@
+#ifndef JOS_INC_X86_H
+#define JOS_INC_X86_H
+
+//
+// Hosted stand-in for inc/x86.h. Only what a user process may do is real;
+// port I/O does nothing, and reads from a port give 0.
+//
+
+#include <inc/types.h>
+
+static __inline uint8_t inb(int port) __attribute__((always_inline));
+static __inline void outb(int port, uint8_t data) __attribute__((always_inline));
+static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
+static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+
+static __inline uint8_t
+inb(int port)
+{
+	return 0;
+}
+
+static __inline void
+outb(int port, uint8_t data)
+{
+}
+
+static __inline void
+cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp,
+      uint32_t *ecxp, uint32_t *edxp)
+{
+	uint32_t eax, ebx, ecx, edx;
+	__asm __volatile("cpuid"
+		: "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+		: "a" (info), "c" (0));
+	if (eaxp)
+		*eaxp = eax;
+	if (ebxp)
+		*ebxp = ebx;
+	if (ecxp)
+		*ecxp = ecx;
+	if (edxp)
+		*edxp = edx;
+}
+
+static __inline uint64_t
+read_tsc(void)
+{
+	uint32_t lo, hi;
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+#endif /* !JOS_INC_X86_H */
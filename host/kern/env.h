@@ -0,0 +1,23 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_ENV_H
+#define JOS_KERN_ENV_H
+
+//
+// Hosted stand-in for kern/env.h. The envs live in host/host.c, and the
+// drivers set them up as they need. There are no user programs to create.
+//
+
+#include <inc/env.h>
+
+extern struct Env *envs;		// All environments
+extern struct Env *curenv;	        // Current environment
+
+int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+void	env_create(uint8_t *binary, size_t size);
+// The following function does not return
+void	env_run(struct Env *e) __attribute__((noreturn));
+
+#define ENV_CREATE(x)		env_create(NULL, 0)
+
+#endif // !JOS_KERN_ENV_H
@@ -0,0 +1,18 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KCLOCK_H
+#define JOS_KERN_KCLOCK_H
+
+// Hosted stand-in for kern/kclock.h. The PIT is not there; see inc/x86.h.
+
+#define	IO_TIMER1	0x040		/* 8253 Timer #1 */
+#define	TIMER_FREQ	1193182
+#define TIMER_DIV(x)	((TIMER_FREQ+(x)/2)/(x))
+
+#define	TIMER_MODE	(IO_TIMER1 + 3)	/* timer mode port */
+#define		TIMER_SEL0	0x00	/* select counter 0 */
+#define		TIMER_INTTC	0x00	/* mode 0, intr on terminal cnt */
+#define		TIMER_RATEGEN	0x04	/* mode 2, rate generator */
+#define		TIMER_16BIT	0x30	/* r/w counter 16 bits, LSB first */
+
+#endif	// !JOS_KERN_KCLOCK_H
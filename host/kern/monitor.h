@@ -0,0 +1,11 @@
+#ifndef JOS_KERN_MONITOR_H
+#define JOS_KERN_MONITOR_H
+
+// Hosted stand-in for kern/monitor.h. There is no console to read from;
+// monitor() ends the harness.
+
+struct Trapframe;
+
+void monitor(struct Trapframe *tf);
+
+#endif	// !JOS_KERN_MONITOR_H
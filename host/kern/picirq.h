@@ -0,0 +1,10 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PICIRQ_H
+#define JOS_KERN_PICIRQ_H
+
+// Hosted stand-in for kern/picirq.h. There are no interrupts to mask.
+
+#define IRQ_OFFSET	32	// IRQ 0 corresponds to int IRQ_OFFSET
+
+#endif // !JOS_KERN_PICIRQ_H
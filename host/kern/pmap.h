@@ -0,0 +1,74 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PMAP_H
+#define JOS_KERN_PMAP_H
+
+//
+// Hosted stand-in for kern/pmap.h. "Physical" memory is HOST_NPAGES pages
+// that host/host.c maps at KERNBASE, so the conversions are those of the
+// kernel. page_insert() maps a page elsewhere by mapping the same memory
+// again; there is one page table, for all of the low 4GB.
+//
+
+#include <inc/memlayout.h>
+#include <inc/assert.h>
+
+extern struct Page *pages;
+extern size_t npage;
+extern pde_t *boot_pgdir;
+
+#define PADDR(kva)						\
+({								\
+	physaddr_t __m_kva = (physaddr_t) (kva);		\
+	if (__m_kva < KERNBASE)					\
+		panic("PADDR called with invalid kva %08lx", (unsigned long) __m_kva);\
+	__m_kva - KERNBASE;					\
+})
+
+#define KADDR(pa)						\
+({								\
+	physaddr_t __m_pa = (pa);				\
+	if (PPN(__m_pa) >= npage)				\
+		panic("KADDR called with invalid pa %08lx", (unsigned long) __m_pa);\
+	(void*) (__m_pa + KERNBASE);				\
+})
+
+#define PPN(pa)		((pa) >> PGSHIFT)
+
+int	page_alloc(struct Page **pp_store);
+void	page_free(struct Page *pp);
+int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
+void	page_remove(pde_t *pgdir, void *va);
+struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void	page_decref(struct Page *pp);
+pte_t	*pgdir_walk(pde_t *pgdir, const void *va, int create);
+
+void	tlb_invalidate(pde_t *pgdir, void *va);
+
+static inline ppn_t
+page2ppn(struct Page *pp)
+{
+	return pp - pages;
+}
+
+static inline physaddr_t
+page2pa(struct Page *pp)
+{
+	return (physaddr_t) page2ppn(pp) << PGSHIFT;
+}
+
+static inline struct Page*
+pa2page(physaddr_t pa)
+{
+	if (PPN(pa) >= npage)
+		panic("pa2page called with invalid pa");
+	return &pages[PPN(pa)];
+}
+
+static inline void*
+page2kva(struct Page *pp)
+{
+	return KADDR(page2pa(pp));
+}
+
+#endif /* !JOS_KERN_PMAP_H */
@@ -0,0 +1,13 @@
+#ifndef JOS_KERN_SYMBOLTABLE_H
+#define JOS_KERN_SYMBOLTABLE_H
+
+//
+// Hosted stand-in for kern/symboltable.h. get_symbol_addr() in host/host.c
+// knows the kernel routines modules are linked against in the harness.
+//
+
+#include <inc/types.h>
+
+uint32_t get_symbol_addr (char *symbol_name);
+
+#endif // !JOS_KERN_SYMBOLTABLE_H
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <inc/types.h>
+#include <kern/module.h>
+#include <kern/kmem.h>
+
+#include "host.h"
+
+//
+// Module loader benchmark. Loads each of the i386 relocatable objects
+// named on the command line through module_init() once, to see that it
+// loads, then has module_bench() time cold and cached loads of it, which
+// print MODULEBENCH lines in cycles. The wall clock time of the lot gives
+// the load throughput.
+//
+// usage: modbench [-l] [-n runs] module.o ...
+//	-l	bind imports lazily, through stubs
+//	-n	loads of each kind per module, 100 by default
+//
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: modbench [-l] [-n runs] module.o ...\n");
+	exit(2);
+}
+
+// The whole of a file, in memory that stays put
+static void *
+read_file(const char *path, uint32_t *size)
+{
+	FILE *f;
+	long len;
+	void *buf;
+
+	if ((f = fopen(path, "rb")) == NULL || fseek(f, 0, SEEK_END) < 0 ||
+	    (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	if ((buf = malloc(len)) == NULL || fread(buf, 1, len, f) != len) {
+		fprintf(stderr, "%s: can't read\n", path);
+		exit(1);
+	}
+
+	fclose(f);
+	*size = len;
+	return buf;
+}
+
+// Module name for a file: its base name without the extension
+static void
+module_name(const char *path, char *name)
+{
+	const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	size_t len = strcspn(base, ".");
+
+	if (len > MAX_MODULE_NAMELEN - 1)
+		len = MAX_MODULE_NAMELEN - 1;
+	memcpy(name, base, len);
+	name[len] = '\0';
+}
+
+int
+main(int argc, char **argv)
+{
+	char name[MAX_MODULE_NAMELEN];
+	uint64_t start, ns;
+	uint32_t size;
+	void *image;
+	int c, i, r, runs = 100, failed = 0;
+
+	while ((c = getopt(argc, argv, "ln:")) != -1) {
+		switch (c) {
+		case 'l':
+			module_set_lazy_binding(1);
+			break;
+		case 'n':
+			if ((runs = atoi(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	host_init();
+	kmem_init();
+
+	for (i = optind; i < argc; i++) {
+		image = read_file(argv[i], &size);
+		module_name(argv[i], name);
+
+		if ((r = module_init(name, image, size)) < 0) {
+			printf("MODULEBENCH host name=%s error=%d\n", name, r);
+			failed++;
+			free(image);
+			continue;
+		}
+		module_cleanup(name);
+
+		start = host_ns();
+		r = module_bench(name, image, size, runs);
+		ns = host_ns() - start;
+
+		if (r < 0) {
+			printf("MODULEBENCH host name=%s error=%d\n", name, r);
+			failed++;
+		} else {
+			printf("MODULEBENCH host name=%s loads=%d wall_ns=%llu "
+			       "ns_per_load=%llu loads_per_sec=%llu\n", name,
+			       2 * runs, (unsigned long long) ns,
+			       (unsigned long long) ns / (2 * runs),
+			       (unsigned long long) (2 * runs * 1000000000ULL /
+						     (ns ? ns : 1)));
+		}
+
+		free(image);
+	}
+
+	return failed ? 1 : 0;
+}
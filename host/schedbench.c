@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <inc/types.h>
+#include <inc/x86.h>
+#include <inc/assert.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+
+#include "host.h"
+
+//
+// Scheduler benchmark. Runs simulated workloads through sched_yield(),
+// sched_tick() and the IPC hooks, one scheduling decision per step, for
+// every policy, and reports how many decisions a second the scheduler
+// makes. Nothing runs in between the decisions, so this is the cost of
+// the scheduler and of nothing else.
+//
+// A step is what the current env does until it enters the kernel again:
+//
+//	yield	every env calls sys_yield()
+//	tick	every env computes until the timer preempts it
+//	ipc	clients send requests to a quarter as many servers and wait
+//		for the reply. Clients have higher priorities than servers,
+//		so blocked clients lend theirs to the servers.
+//	mix	half the envs as in ipc, half as in tick
+//
+// env_run() jumps back to host_trap, so each step starts afresh there.
+// Every decision is checked: the env picked has to be runnable and
+// claimed by this CPU.
+//
+// usage: schedbench [-n decisions] [-p policy] [-w workload] [-e envs]
+//
+
+// Defines
+
+#define BENCH_DECISIONS		200000
+
+// What an env in the ipc workload does when it runs next
+#define IPC_SEND		0
+#define IPC_RECV		1
+
+// Data Structures
+
+struct Bench_env {
+	int		be_ipc;		// Takes part in the ipc workload
+	int		be_state;	// IPC_SEND or IPC_RECV
+	struct Env	*be_server;	// Servers have none
+};
+
+struct Workload {
+	const char	*w_name;
+	int		w_ipc_share;	// Percent of envs doing IPC
+	int		w_tick;		// The others compute, or else yield
+};
+
+// Global Variables
+
+static struct Workload workloads[] = {
+	{ "yield",	0,	0 },
+	{ "tick",	0,	1 },
+	{ "ipc",	100,	0 },
+	{ "mix",	50,	1 },
+};
+
+static const char *policies[] = { "rr", "prio" };
+
+static int env_counts[] = { 2, 16, 128, NENV - 1 };
+
+static struct Bench_env bench_envs[NENV];
+static struct Workload *workload;
+
+// Kept outside the stack frames longjmp() abandons
+static uint32_t switches;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: schedbench [-n decisions] [-p policy] "
+		"[-w workload] [-e envs]\n");
+	exit(2);
+}
+
+// Put the envs of a run in place. Clients come first, then servers.
+static void
+bench_setup(int nenvs)
+{
+	struct Bench_env *be;
+	struct Env *e, *made[NENV];
+	int i, nipc, nservers;
+
+	nipc = nenvs * workload->w_ipc_share / 100;
+	nservers = (nipc + 4) / 5;
+	if (nipc < 2)
+		nipc = nservers = 0;
+
+	for (i = 0; i < nenvs; i++) {
+		// Servers get the lowest priority, clients one of three
+		if (i >= nipc)
+			e = host_env_alloc(4);
+		else if (i >= nipc - nservers)
+			e = host_env_alloc(5);
+		else
+			e = host_env_alloc(1 + i % 3);
+		if (e == NULL)
+			panic("bench_setup: out of envs at %d", i);
+
+		be = &bench_envs[ENVX(e->env_id)];
+		memset(be, 0, sizeof(*be));
+		be->be_ipc = i < nipc;
+		be->be_state = i < nipc - nservers ? IPC_SEND : IPC_RECV;
+		made[i] = e;
+	}
+
+	// Every server has four clients
+	for (i = 0; i < nipc - nservers; i++)
+		bench_envs[ENVX(made[i]->env_id)].be_server =
+			made[nipc - nservers + i % nservers];
+
+	for (i = 0; i < nenvs; i++)
+		sched_wakeup(made[i]);
+}
+
+// Destroy all the envs. The next decision finds the current one gone.
+static void
+bench_teardown(void)
+{
+	int i;
+
+	for (i = 1; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE)
+			host_env_free(&envs[i]);
+}
+
+//
+// The current env sends to 'to', as sys_ipc_try_send() and the retry loop
+// in ipc_send() do. If 'to' is not receiving, we try again the next time
+// we run. Returns once the message is delivered, unless the receiver is
+// run right away, in which case we wait for our answer the next time.
+//
+static void
+bench_send(struct Bench_env *be, struct Env *to)
+{
+	if (!to->env_ipc_recving) {
+		sched_ipc_block(curenv, to->env_id);
+		sched_yield();
+	}
+
+	sched_ipc_unblock(curenv);
+	to->env_ipc_recving = 0;
+	to->env_ipc_from = curenv->env_id;
+	to->env_status = ENV_RUNNABLE;
+
+	be->be_state = IPC_RECV;
+	sched_ipc_handoff(to);
+}
+
+// Run the current env until it enters the scheduler, or keeps the CPU
+static void
+bench_step(void)
+{
+	struct Bench_env *be = &bench_envs[ENVX(curenv->env_id)];
+	struct Env *to;
+
+	if (!be->be_ipc) {
+		if (!workload->w_tick)
+			sched_yield();
+		if (sched_tick())
+			sched_yield();
+		return;
+	}
+
+	if (be->be_state == IPC_SEND) {
+		// A client sends a request, a server the reply
+		if (be->be_server)
+			to = be->be_server;
+		else if (envid2env(curenv->env_ipc_from, &to, 0) < 0)
+			panic("bench_step: client %08x is gone",
+			      curenv->env_ipc_from);
+
+		bench_send(be, to);
+	}
+
+	be->be_state = IPC_SEND;
+	curenv->env_ipc_recving = 1;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
+// Make 'decisions' scheduling decisions. Returns the TSC cycles it took.
+static uint64_t
+bench_run(int decisions)
+{
+	static int i;
+	uint64_t start;
+	int cur;
+
+	switches = 0;
+	start = read_tsc();
+
+	for (i = 0; i < decisions; i++) {
+		if (setjmp(host_trap) == 0) {
+			if (curenv == NULL)
+				sched_yield();
+			bench_step();
+			continue;
+		}
+
+		switches++;
+		cur = ENVX(curenv->env_id);
+		assert(curenv->env_status == ENV_RUNNABLE);
+		assert(sched_envs[cur].se_running);
+		assert(sched_cpus[0].cpu_env == curenv);
+	}
+
+	return read_tsc() - start;
+}
+
+static void
+bench(const char *policy, int nenvs, int decisions)
+{
+	uint64_t cycles, ns;
+	uint32_t runs, min_runs = ~0U, max_runs = 0;
+	int i;
+
+	if (sched_set_policy((char *) policy) < 0)
+		exit(1);
+
+	bench_setup(nenvs);
+
+	ns = host_ns();
+	cycles = bench_run(decisions);
+	ns = host_ns() - ns;
+
+	// The class on its own, with the run queue the workload left
+	sched_bench_decide(decisions);
+
+	// How evenly the envs that never block were picked
+	for (i = 1; i < NENV; i++) {
+		if (envs[i].env_status == ENV_FREE || bench_envs[i].be_ipc)
+			continue;
+		runs = sched_envs[i].se_stats.ss_nr_sched;
+		min_runs = MIN(min_runs, runs);
+		max_runs = MAX(max_runs, runs);
+	}
+	if (max_runs == 0)
+		min_runs = 0;
+
+	printf("SCHEDBENCH host policy=%s workload=%s envs=%d decisions=%d "
+	       "switches=%u cycles_per_decision=%llu ns_per_decision=%llu "
+	       "decisions_per_sec=%llu min_runs=%u max_runs=%u\n",
+	       policy, workload->w_name, nenvs, decisions, switches,
+	       (unsigned long long) cycles / decisions,
+	       (unsigned long long) ns / decisions,
+	       (unsigned long long) decisions * 1000000000ULL / (ns ? ns : 1),
+	       min_runs, max_runs);
+
+	bench_teardown();
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *policy = NULL, *wname = NULL;
+	int *counts = env_counts, ncounts = sizeof(env_counts) / sizeof(int);
+	int c, p, w, n, nenvs = 0, decisions = BENCH_DECISIONS;
+
+	while ((c = getopt(argc, argv, "n:p:w:e:")) != -1) {
+		switch (c) {
+		case 'n':
+			decisions = atoi(optarg);
+			break;
+		case 'p':
+			policy = optarg;
+			break;
+		case 'w':
+			wname = optarg;
+			break;
+		case 'e':
+			nenvs = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (decisions <= 0 || nenvs < 0 || nenvs >= NENV)
+		usage();
+	if (nenvs) {
+		counts = &nenvs;
+		ncounts = 1;
+	}
+
+	host_init();
+
+	for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+		if (policy && strcmp(policy, policies[p]) != 0)
+			continue;
+		for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+			workload = &workloads[w];
+			if (wname && strcmp(wname, workload->w_name) != 0)
+				continue;
+			for (n = 0; n < ncounts; n++)
+				bench(policies[p], counts[n], decisions);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,254 @@
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <kern/kmem.h>
+
+//
+// Bulk copy and zero for the kernel's hot data paths: packets going in
+// and out of the e100 rings, and module images. The byte at a time
+// memmove() and memset() are fine for small structures, but these move
+// whole frames and pages.
+//
+// kmem_copy() and kmem_zero() use rep movsl and rep stosl, which every
+// CPU we run on does well. The _nt variants are for buffers the CPU is
+// not going to read again soon, e.g. a TX buffer the device reads by DMA
+// or a cached module image: they store with movnti, which goes around
+// the cache, and fence at the end so that the stores are visible before
+// we tell the device about them. movnti takes a general register, so the
+// FPU and SSE state of the env we interrupted is left alone. kmem_init()
+// checks CPUID for it at boot; without it the _nt variants are the plain
+// ones.
+//
+// Copies between buffers that overlap go to memmove(), so kmem_copy()
+// can be used anywhere memmove() is.
+//
+
+// Times each routine is run for each size in kmem_bench()
+#define KMEM_BENCH_RUNS		1000
+
+// Set by kmem_init() if we can use movnti
+int kmem_nt;
+
+static uint8_t kmem_bench_src[PGSIZE];
+static uint8_t kmem_bench_dst[PGSIZE];
+
+static inline int
+kmem_overlap (const void *dst, const void *src, size_t len)
+{
+    return (uintptr_t)dst - (uintptr_t)src < len ||
+	   (uintptr_t)src - (uintptr_t)dst < len;
+}
+
+// Copy with rep movsl, and rep movsb for the last few bytes
+static inline void
+kmem_copy_rep (void *dst, const void *src, size_t len)
+{
+    size_t n = len / 4;
+
+    asm volatile("cld; rep movsl\n\t"
+		 "movl %3, %%ecx\n\t"
+		 "rep movsb" :
+		 "+D" (dst), "+S" (src), "+c" (n) :
+		 "r" ((uint32_t)(len & 3)) :
+		 "memory", "cc");
+}
+
+// Zero with rep stosl, and rep stosb for the last few bytes
+static inline void
+kmem_zero_rep (void *dst, size_t len)
+{
+    size_t n = len / 4;
+
+    asm volatile("cld; rep stosl\n\t"
+		 "movl %2, %%ecx\n\t"
+		 "rep stosb" :
+		 "+D" (dst), "+c" (n) :
+		 "r" ((uint32_t)(len & 3)), "a" (0) :
+		 "memory", "cc");
+}
+
+//
+// Copy 16 bytes at a time with movnti. The destination is brought to a
+// 4 byte boundary first, the source may be anywhere.
+//
+static void
+kmem_copy_movnti (void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    uint32_t n;
+
+    for (; ((uintptr_t)d & 3) && len > 0; len--) {
+	*d++ = *s++;
+    }
+
+    for (n = len / 16; n > 0; n--, d += 16, s += 16) {
+	asm volatile("movl 0(%1), %%eax\n\t"
+		     "movl 4(%1), %%edx\n\t"
+		     "movnti %%eax, 0(%0)\n\t"
+		     "movnti %%edx, 4(%0)\n\t"
+		     "movl 8(%1), %%eax\n\t"
+		     "movl 12(%1), %%edx\n\t"
+		     "movnti %%eax, 8(%0)\n\t"
+		     "movnti %%edx, 12(%0)" : :
+		     "r" (d), "r" (s) :
+		     "eax", "edx", "memory");
+    }
+
+    kmem_copy_rep(d, s, len & 15);
+    asm volatile("sfence" : : : "memory");
+}
+
+// Zero 16 bytes at a time with movnti
+static void
+kmem_zero_movnti (void *dst, size_t len)
+{
+    uint8_t *d = dst;
+    uint32_t n;
+
+    for (; ((uintptr_t)d & 3) && len > 0; len--) {
+	*d++ = 0;
+    }
+
+    for (n = len / 16; n > 0; n--, d += 16) {
+	asm volatile("movnti %1, 0(%0)\n\t"
+		     "movnti %1, 4(%0)\n\t"
+		     "movnti %1, 8(%0)\n\t"
+		     "movnti %1, 12(%0)" : :
+		     "r" (d), "r" (0) :
+		     "memory");
+    }
+
+    kmem_zero_rep(d, len & 15);
+    asm volatile("sfence" : : : "memory");
+}
+
+// See what the CPU can do. Called once at boot.
+void
+kmem_init (void)
+{
+    uint32_t edx;
+
+    cpuid(1, NULL, NULL, NULL, &edx);
+    kmem_nt = (edx & KMEM_CPUID_SSE2) != 0;
+
+    cprintf("kmem: %s stores for bulk copies\n",
+	    kmem_nt ? "non-temporal" : "plain");
+}
+
+// Copy 'len' bytes, like memmove()
+void *
+kmem_copy (void *dst, const void *src, size_t len)
+{
+    if (kmem_overlap(dst, src, len)) {
+	return memmove(dst, src, len);
+    }
+
+    kmem_copy_rep(dst, src, len);
+    return dst;
+}
+
+// Copy 'len' bytes, like memmove(), without bringing 'dst' into the cache
+void *
+kmem_copy_nt (void *dst, const void *src, size_t len)
+{
+    if (kmem_overlap(dst, src, len)) {
+	return memmove(dst, src, len);
+    }
+
+    if (kmem_nt && len >= KMEM_NT_MIN) {
+	kmem_copy_movnti(dst, src, len);
+    } else {
+	kmem_copy_rep(dst, src, len);
+    }
+    return dst;
+}
+
+void *
+kmem_zero (void *dst, size_t len)
+{
+    kmem_zero_rep(dst, len);
+    return dst;
+}
+
+// Zero 'len' bytes without bringing them into the cache
+void *
+kmem_zero_nt (void *dst, size_t len)
+{
+    if (kmem_nt && len >= KMEM_NT_MIN) {
+	kmem_zero_movnti(dst, len);
+    } else {
+	kmem_zero_rep(dst, len);
+    }
+    return dst;
+}
+
+//
+// Benchmark. Everything in kmem_bench() is called through a pointer of
+// this type, so that they all pay the same for the call.
+//
+
+static void *
+kmem_bench_memset (void *dst, const void *src, size_t len)
+{
+    return memset(dst, 0, len);
+}
+
+static void *
+kmem_bench_zero (void *dst, const void *src, size_t len)
+{
+    return kmem_zero(dst, len);
+}
+
+static void *
+kmem_bench_zero_nt (void *dst, const void *src, size_t len)
+{
+    return kmem_zero_nt(dst, len);
+}
+
+//
+// Time the copy and zero routines against memmove() and memset() for
+// packet and page sizes. Prints a line per size starting with KMEMBENCH,
+// in the same key=value format as the scheduler benchmarks, with the
+// average number of TSC cycles each routine took.
+//
+int
+kmem_bench (void)
+{
+    static const uint32_t sizes[] = { 64, 128, 256, 512, 1024, 1518, 4096 };
+    static const struct {
+	const char  *kb_name;
+	void	    *(*kb_func)(void *dst, const void *src, size_t len);
+    } funcs[] = {
+	{ "memmove",	memmove },
+	{ "copy",	kmem_copy },
+	{ "copy_nt",	kmem_copy_nt },
+	{ "memset",	kmem_bench_memset },
+	{ "zero",	kmem_bench_zero },
+	{ "zero_nt",	kmem_bench_zero_nt },
+    };
+    uint64_t start;
+    uint32_t i, f, run;
+
+    memset(kmem_bench_src, 0x5a, sizeof(kmem_bench_src));
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	cprintf("KMEMBENCH size=%u nt=%d", sizes[i], kmem_nt);
+
+	for (f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+	    start = read_tsc();
+	    for (run = 0; run < KMEM_BENCH_RUNS; run++) {
+		funcs[f].kb_func(kmem_bench_dst, kmem_bench_src, sizes[i]);
+	    }
+	    cprintf(" %s=%llu", funcs[f].kb_name,
+		    (read_tsc() - start) / KMEM_BENCH_RUNS);
+	}
+
+	cprintf("\n");
+    }
+
+    return 0;
+}
+
+// End of File
@@ -0,0 +1,29 @@
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+
+#include <inc/types.h>
+
+// Defines
+
+// CPUID leaf 1, EDX: SSE2, which brings movnti
+#define KMEM_CPUID_SSE2		(1 << 26)
+
+//
+// Copies and fills shorter than this use plain stores even when asked
+// for non-temporal ones. Below it, the fence costs more than the cache
+// lines we would keep clean.
+//
+#define KMEM_NT_MIN		256
+
+extern int kmem_nt;
+
+// Function Prototypes
+
+void kmem_init (void);
+void *kmem_copy (void *dst, const void *src, size_t len);
+void *kmem_copy_nt (void *dst, const void *src, size_t len);
+void *kmem_zero (void *dst, size_t len);
+void *kmem_zero_nt (void *dst, size_t len);
+int kmem_bench (void);
+
+#endif // !JOS_KERN_KMEM_H
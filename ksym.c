@@ -0,0 +1,407 @@
+#include <inc/stdio.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <kern/ksym.h>
+#include <kern/symboltable.h>
+
+//
+// Kernel symbol table used by the module loader. This is an open
+// addressing hash table with linear probing, keyed by the FNV-1a hash of
+// the symbol name. The hash is computed once per name by the caller and
+// kept in the slot, so a probe only compares names when the hashes match.
+//
+// The slots live in pages from page_alloc(), found through a directory
+// page, so the table does not need contiguous memory and can grow until
+// the directory is full. It doubles whenever it gets more than half full,
+// counting removed slots.
+//
+// Symbols of the kernel image come from the static table behind
+// get_symbol_addr(). They are looked up there the first time a module
+// needs them and cached here, with their name copied into a name pool.
+// Module exports are added and removed here in bulk.
+//
+
+#define KSYM_TOMBSTONE		((const char *)1)
+// Slots are masked with the table size, which has to be a power of two
+#define KSYM_PER_PAGE		(sizeof(struct Ksym) <= 16 ? PGSIZE / 16 : \
+				 PGSIZE / 32)
+#define KSYM_MAX_PAGES		(PGSIZE / sizeof(struct Ksym *))
+#define KSYM_MIN_SLOTS		KSYM_PER_PAGE
+
+#define FNV_OFFSET_BASIS	2166136261U
+#define FNV_PRIME		16777619U
+
+// To keep the compiler happy!
+extern uint32_t get_symbol_addr (char *symbol_name);
+
+// The slot directory, and the table size
+static struct Ksym **ksym_dir;
+static uint32_t ksym_slots;
+static uint32_t ksym_used;	// Live symbols
+static uint32_t ksym_dead;	// Tombstones
+
+//
+// Bumped whenever a symbol is added or removed, so that anything that
+// remembers addresses it looked up can tell they may be stale. Caching a
+// symbol of the kernel image does not count, it changes no address.
+//
+static uint32_t ksym_gen;
+
+// Pool the names of cached kernel symbols are copied into
+static char *ksym_pool;
+static uint32_t ksym_pool_free;
+
+// Allocate a zeroed page, returning its kernel virtual address
+static void *
+ksym_page_alloc (void)
+{
+    struct Page *pp;
+
+    if (page_alloc(&pp) < 0) {
+	return NULL;
+    }
+
+    pp->pp_ref++;
+    memset(page2kva(pp), 0, PGSIZE);
+
+    return page2kva(pp);
+}
+
+static void
+ksym_page_free (void *va)
+{
+    struct Page *pp = pa2page(PADDR(va));
+
+    pp->pp_ref--;
+    page_free(pp);
+}
+
+static inline struct Ksym *
+ksym_slot (struct Ksym **dir, uint32_t i)
+{
+    return &dir[i / KSYM_PER_PAGE][i % KSYM_PER_PAGE];
+}
+
+// FNV-1a hash of a symbol name
+uint32_t
+ksym_hash (const char *name)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    while (*name) {
+	hash ^= (uint8_t)*name++;
+	hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+//
+// Find the slot of a symbol. If it is not there, return the slot it
+// should be inserted in instead: the first tombstone we passed, or the
+// empty slot that ended the probe.
+//
+static struct Ksym *
+ksym_find (const char *name, uint32_t hash)
+{
+    struct Ksym *ks, *tomb = NULL;
+    uint32_t i, n;
+
+    for (i = hash & (ksym_slots - 1), n = 0; n < ksym_slots;
+	 i = (i + 1) & (ksym_slots - 1), n++) {
+	ks = ksym_slot(ksym_dir, i);
+
+	if (ks->ks_name == NULL) {
+	    return tomb ? tomb : ks;
+	}
+
+	if (ks->ks_name == KSYM_TOMBSTONE) {
+	    if (!tomb) {
+		tomb = ks;
+	    }
+	} else if (ks->ks_hash == hash && strcmp(ks->ks_name, name) == 0) {
+	    return ks;
+	}
+    }
+
+    return tomb;
+}
+
+//
+// Make sure the table can take 'count' more symbols while staying at most
+// half full. Rehashing into the new table drops the tombstones.
+//
+static int
+ksym_reserve (uint32_t count)
+{
+    struct Ksym **old_dir = ksym_dir, *ks;
+    uint32_t old_slots = ksym_slots, slots, i;
+
+    slots = ksym_slots ? ksym_slots : KSYM_MIN_SLOTS;
+    while ((ksym_used + count) * 2 > slots) {
+	slots *= 2;
+    }
+
+    if (slots == ksym_slots && (ksym_used + ksym_dead + count) * 2 <= slots) {
+	return 0;
+    }
+
+    if (slots / KSYM_PER_PAGE > KSYM_MAX_PAGES) {
+	cprintf("ksym_reserve: symbol table is full\n");
+	return -E_NO_MEM;
+    }
+
+    // Allocate the new table
+    if ((ksym_dir = ksym_page_alloc()) == NULL) {
+	goto fail;
+    }
+
+    for (i = 0; i < slots / KSYM_PER_PAGE; i++) {
+	if ((ksym_dir[i] = ksym_page_alloc()) == NULL) {
+	    goto fail;
+	}
+    }
+
+    // Move the live symbols over
+    ksym_slots = slots;
+    ksym_dead = 0;
+
+    for (i = 0; i < old_slots; i++) {
+	ks = ksym_slot(old_dir, i);
+	if (ks->ks_name != NULL && ks->ks_name != KSYM_TOMBSTONE) {
+	    *ksym_find(ks->ks_name, ks->ks_hash) = *ks;
+	}
+    }
+
+    // Release the old table
+    if (old_dir) {
+	for (i = 0; i < old_slots / KSYM_PER_PAGE; i++) {
+	    ksym_page_free(old_dir[i]);
+	}
+	ksym_page_free(old_dir);
+    }
+
+    return 0;
+
+fail:
+    if (ksym_dir) {
+	for (i = 0; i < slots / KSYM_PER_PAGE && ksym_dir[i]; i++) {
+	    ksym_page_free(ksym_dir[i]);
+	}
+	ksym_page_free(ksym_dir);
+    }
+    ksym_dir = old_dir;
+    ksym_slots = old_slots;
+
+    cprintf("ksym_reserve: out of memory\n");
+    return -E_NO_MEM;
+}
+
+//
+// Add a symbol to a table that has room for it. Kernel symbols are only
+// cached here once looked up, so a module symbol is also checked against
+// the kernel's own table; it would shadow the kernel symbol otherwise.
+//
+static int
+ksym_add (const char *name, uint32_t hash, uint32_t addr, int owner)
+{
+    struct Ksym *ks = ksym_find(name, hash);
+
+    if ((ks->ks_name != NULL && ks->ks_name != KSYM_TOMBSTONE) ||
+	(owner != KSYM_OWNER_KERNEL && get_symbol_addr((char *)name) != 0)) {
+	cprintf("ksym_add: symbol %s is already defined\n", name);
+	return -E_FILE_EXISTS;
+    }
+
+    if (ks->ks_name == KSYM_TOMBSTONE) {
+	ksym_dead--;
+    }
+
+    ks->ks_hash = hash;
+    ks->ks_name = name;
+    ks->ks_addr = addr;
+    ks->ks_owner = owner;
+    ksym_used++;
+
+    if (owner != KSYM_OWNER_KERNEL) {
+	ksym_gen++;
+    }
+
+    return 0;
+}
+
+// Copy the name of a kernel symbol into the name pool
+static const char *
+ksym_pool_copy (const char *name)
+{
+    uint32_t len = strlen(name) + 1;
+    char *copy;
+
+    if (len > PGSIZE) {
+	return NULL;
+    }
+
+    if (len > ksym_pool_free) {
+	if ((ksym_pool = ksym_page_alloc()) == NULL) {
+	    ksym_pool_free = 0;
+	    return NULL;
+	}
+	ksym_pool_free = PGSIZE;
+    }
+
+    copy = ksym_pool;
+    memmove(copy, name, len);
+    ksym_pool += len;
+    ksym_pool_free -= len;
+
+    return copy;
+}
+
+//
+// Get the address of a symbol, given its precomputed hash. Returns 0 if
+// there is no such symbol.
+//
+uint32_t
+ksym_lookup_hash (const char *name, uint32_t hash)
+{
+    struct Ksym *ks;
+    const char *copy;
+    uint32_t addr;
+
+    if (ksym_slots) {
+	ks = ksym_find(name, hash);
+	if (ks && ks->ks_name != NULL && ks->ks_name != KSYM_TOMBSTONE) {
+	    return ks->ks_addr;
+	}
+    }
+
+    // Not seen yet. Ask the kernel's own symbol table, and remember.
+    addr = get_symbol_addr((char *)name);
+
+    if (addr != 0 && ksym_reserve(1) == 0 &&
+	(copy = ksym_pool_copy(name)) != NULL) {
+	ksym_add(copy, hash, addr, KSYM_OWNER_KERNEL);
+    }
+
+    return addr;
+}
+
+uint32_t
+ksym_lookup (const char *name)
+{
+    return ksym_lookup_hash(name, ksym_hash(name));
+}
+
+// Add a single symbol
+int
+ksym_insert (const char *name, uint32_t addr, int owner)
+{
+    int r;
+
+    if ((r = ksym_reserve(1)) < 0) {
+	return r;
+    }
+
+    return ksym_add(name, ksym_hash(name), addr, owner);
+}
+
+//
+// Add all the symbols a module exports. The table grows at most once.
+// Symbols that clash with existing ones, kernel symbols that were never
+// looked up included, are skipped. Returns the number of symbols that
+// could not be added.
+//
+int
+ksym_insert_bulk (struct Ksym_def *defs, int count, int owner)
+{
+    int i, failed = 0, r;
+
+    if ((r = ksym_reserve(count)) < 0) {
+	return r;
+    }
+
+    for (i = 0; i < count; i++) {
+	if (ksym_add(defs[i].kd_name, defs[i].kd_hash,
+		     defs[i].kd_addr, owner) < 0) {
+	    failed++;
+	}
+    }
+
+    return failed;
+}
+
+// Remove the symbols a module exported
+void
+ksym_remove_bulk (struct Ksym_def *defs, int count, int owner)
+{
+    struct Ksym *ks;
+    int i;
+
+    if (ksym_slots == 0) {
+	return;
+    }
+
+    for (i = 0; i < count; i++) {
+	ks = ksym_find(defs[i].kd_name, defs[i].kd_hash);
+	if (ks && ks->ks_name != NULL && ks->ks_name != KSYM_TOMBSTONE &&
+	    ks->ks_owner == owner) {
+	    ks->ks_name = KSYM_TOMBSTONE;
+	    ksym_used--;
+	    ksym_dead++;
+	    ksym_gen++;
+	}
+    }
+}
+
+//
+// Find the module export an address belongs to, i.e. the one closest to
+// it at or below it. Returns its name and stores its address in
+// 'sym_addr', or returns NULL if there is none. This walks the whole
+// table, so it is for reports rather than hot paths.
+//
+const char *
+ksym_addr_name (uint32_t addr, uint32_t *sym_addr)
+{
+    struct Ksym *ks, *best = NULL;
+    uint32_t i;
+
+    for (i = 0; i < ksym_slots; i++) {
+	ks = ksym_slot(ksym_dir, i);
+	if (ks->ks_name == NULL || ks->ks_name == KSYM_TOMBSTONE ||
+	    ks->ks_owner == KSYM_OWNER_KERNEL || ks->ks_addr > addr) {
+	    continue;
+	}
+
+	if (best == NULL || ks->ks_addr > best->ks_addr) {
+	    best = ks;
+	}
+    }
+
+    if (best == NULL) {
+	return NULL;
+    }
+
+    if (sym_addr) {
+	*sym_addr = best->ks_addr;
+    }
+    return best->ks_name;
+}
+
+// Number of symbols in the table
+int
+ksym_count (void)
+{
+    return ksym_used;
+}
+
+// Generation of the symbol table, see ksym_gen
+uint32_t
+ksym_generation (void)
+{
+    return ksym_gen;
+}
+
+// End of File
@@ -0,0 +1,45 @@
+#ifndef JOS_KERN_KSYM_H
+#define JOS_KERN_KSYM_H
+
+#include <inc/types.h>
+
+// Defines
+
+// Owner of the symbols that come from the kernel image itself
+#define KSYM_OWNER_KERNEL	-1
+
+// Data Structures
+
+//
+// A slot in the kernel symbol hash table. ks_name is NULL for a slot that
+// was never used and KSYM_TOMBSTONE for one whose symbol was removed.
+// ks_name is not copied, so it has to stay valid while the symbol is in
+// the table.
+//
+struct Ksym {
+    uint32_t	    ks_hash;
+    const char	    *ks_name;
+    uint32_t	    ks_addr;
+    int		    ks_owner;	// Module index, or KSYM_OWNER_KERNEL
+};
+
+// A symbol added or removed with the bulk routines
+struct Ksym_def {
+    const char	    *kd_name;
+    uint32_t	    kd_hash;	// ksym_hash(kd_name)
+    uint32_t	    kd_addr;
+};
+
+// Function Prototypes
+
+uint32_t ksym_hash (const char *name);
+uint32_t ksym_lookup (const char *name);
+uint32_t ksym_lookup_hash (const char *name, uint32_t hash);
+int ksym_insert (const char *name, uint32_t addr, int owner);
+int ksym_insert_bulk (struct Ksym_def *defs, int count, int owner);
+void ksym_remove_bulk (struct Ksym_def *defs, int count, int owner);
+int ksym_count (void);
+uint32_t ksym_generation (void);
+const char *ksym_addr_name (uint32_t addr, uint32_t *sym_addr);
+
+#endif // !JOS_KERN_KSYM_H
@@ -0,0 +1,61 @@
+#include <inc/types.h>
+#include <kern/loghist.h>
+
+// Count 'val' in its bucket, and keep track of the largest value in 'max'
+void
+loghist_record (uint32_t *hist, int nbuckets, int shift, uint64_t *max,
+		uint64_t val)
+{
+    int bucket = 0;
+    uint32_t v = val >> shift;
+
+    if ((val >> shift) >> 32) {
+	bucket = nbuckets - 1;
+    } else if (v) {
+	bucket = 31 - __builtin_clz(v);
+	if (bucket >= nbuckets) {
+	    bucket = nbuckets - 1;
+	}
+    }
+
+    hist[bucket]++;
+    if (val > *max) {
+	*max = val;
+    }
+}
+
+//
+// Upper bound of the values 'pct' percent of the recorded ones fit in.
+// Values in the last bucket have no upper bound but 'max'. Returns 0 for
+// an empty histogram.
+//
+uint64_t
+loghist_percentile (const uint32_t *hist, int nbuckets, int shift,
+		    uint64_t max, int pct)
+{
+    uint32_t total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < nbuckets; b++) {
+	total += hist[b];
+    }
+
+    if (total == 0) {
+	return 0;
+    }
+
+    for (b = 0; b < nbuckets - 1; b++) {
+	seen += hist[b];
+	if ((uint64_t)seen * 100 >= (uint64_t)total * pct) {
+	    break;
+	}
+    }
+
+    if (b == nbuckets - 1) {
+	return max;
+    }
+
+    return (uint64_t)1 << (b + shift + 1);
+}
+
+// End of File
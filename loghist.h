@@ -0,0 +1,20 @@
+#ifndef JOS_KERN_LOGHIST_H
+#define JOS_KERN_LOGHIST_H
+
+#include <inc/types.h>
+
+//
+// Log2 histograms, as the scheduler keeps of wait times and the module
+// code of call costs. With 'shift' s, bucket b counts values of 2^(b + s)
+// or more, bucket 0 everything shorter than that too, and the last bucket
+// everything beyond it.
+//
+
+// Function Prototypes
+
+void loghist_record (uint32_t *hist, int nbuckets, int shift, uint64_t *max,
+		     uint64_t val);
+uint64_t loghist_percentile (const uint32_t *hist, int nbuckets, int shift,
+			     uint64_t max, int pct);
+
+#endif // !JOS_KERN_LOGHIST_H
@@ -10,171 +10,1384 @@
 #include <kern/sched.h>
 #include <kern/env.h>
 #include <kern/module.h>
-#include <kern/symboltable.h>
+#include <kern/ksym.h>
+#include <kern/trace.h>
+#include <kern/kmem.h>
+#include <kern/loghist.h>
+
+// ELF definitions the relocation code needs, if inc/elf.h lacks them
+#ifndef ELF32_ST_BIND
+#define ELF32_ST_BIND(i)	((i) >> 4)
+#endif
+#ifndef STB_GLOBAL
+#define STB_LOCAL		0
+#define STB_GLOBAL		1
+#define STB_WEAK		2
+#endif
+#ifndef ELF_SHN_UNDEF
+#define ELF_SHN_UNDEF		0
+#endif
+#ifndef ELF_SHN_ABS
+#define ELF_SHN_ABS		0xfff1
+#endif
+#ifndef ELF_SHT_RELA
+#define ELF_SHT_RELA		4
+#endif
+#ifndef R_386_NONE
+#define R_386_NONE		0
+#endif
+
+//
+// Section index the loader gives an imported symbol once it has been
+// looked up. It is in the processor specific range, which i386 does not
+// use, and never appears in a module file.
+//
+#define MODULE_SHN_IMPORT	0xff00
+
+// Section index of an imported function that calls go through a stub for
+#define MODULE_SHN_LAZY		0xff01
+
+// Size of a lazy binding stub, and of the code they all share
+#define MODULE_PLT_ENTRY	16
+
+// Relocated images of this many modules are kept for reloading
+#define MODULE_CACHE_MAX	8
+
+// Bytes of the image module_image_hash() reads at a time, on the stack
+#define MODULE_HASH_CHUNK	512
+
+#define MODULE_FNV_OFFSET	14695981039346656037ULL
+#define MODULE_FNV_PRIME	1099511628211ULL
+
+// A word in module code, which relocations and stubs put at any offset
+typedef uint32_t module_word_t __attribute__ ((aligned (1)));
+
+// List of the modules currently loaded
+struct Module *modules;
+uint32_t module_count;
+
+// Pointer to the actual module data
+void *module_data;
+
+// Index the next module gets. Indices are never reused.
+static uint32_t module_next_index;
+
+// Hooks registered by the modules, indexed by API type
+struct Module_hook *module_hooks[MODULE_HOOK_TYPES];
+
+//
+// Modules that were unloaded or replaced while a CPU may still be walking
+// their hooks. They are freed by module_reap() once every CPU in their
+// module_walkers mask has been seen outside a walk.
+//
+static struct Module *module_retired;
+
+//
+// Hook walks going on on each CPU, nested ones included. A walker counts
+// itself in before it reads the first hook pointer and out after the
+// last, so a CPU seen at zero holds no pointer into a module that was
+// taken off the chains before.
+//
+static volatile uint32_t module_walk_depth[SCHED_NCPU];
+
+//
+// A module image as it was right after relocation, before its init
+// routine ran, kept so that loading the same module again is a copy. It
+// is only good at the address it was relocated for, and only as long as
+// the symbols it imports resolve to the same addresses, and the functions
+// it calls through lazy binding stubs still exist. The entry, the imports
+// and their names live in the same pages as the copy, after it.
+//
+struct Module_cache {
+    char		mc_name[MAX_MODULE_NAMELEN];
+    uint64_t		mc_hash;	// Of the whole ELF image
+    uint32_t		mc_size;	// Of the ELF image
+    uint32_t		mc_base;	// Where the image was relocated for
+    uint32_t		mc_pages;
+    uint32_t		mc_meta_offset;	// Of the descriptor in the image
+    uint32_t		mc_copy;	// Our pages
+    uint32_t		mc_copy_pages;
+    uint32_t		mc_generation;	// ksym_generation() at last check
+    uint32_t		mc_num_imports;
+    struct Ksym_def	*mc_imports;
+    struct Module_cache	*mc_next;
+};
+
+// Most recently stored first
+static struct Module_cache *module_cache;
+static uint32_t module_cache_count;
+
+//
+// Bind calls to imported functions when they are first made, rather than
+// at load time. Off by default; kernels built with MODULE_LAZY_BIND turn
+// it on, and module_set_lazy_binding() switches it at runtime. Either way
+// every import has to be in the kernel symbol table when the module is
+// loaded.
+//
+#ifdef MODULE_LAZY_BIND
+static int module_lazy_binding = 1;
+#else
+static int module_lazy_binding = 0;
+#endif
+
+uint32_t module_lazy_resolve (struct Module *module, uint32_t index);
+void module_lazy_trampoline (void);
+
+//
+// Calls through a lazy binding stub that is not bound yet end up here,
+// with the module and the stub index pushed on top of the caller's
+// return address. Find the function, then jump to it as if the caller
+// had called it directly. %eax, %ecx and %edx are preserved in case the
+// function takes arguments in registers.
+//
+#if defined (__i386__)
+asm(".text\n"
+    ".globl module_lazy_trampoline\n"
+    "module_lazy_trampoline:\n"
+    "	pushl %eax\n"
+    "	pushl %ecx\n"
+    "	pushl %edx\n"
+    "	pushl 16(%esp)\n"		// index
+    "	pushl 16(%esp)\n"		// module
+    "	call module_lazy_resolve\n"
+    "	addl $8, %esp\n"
+    "	movl %eax, 16(%esp)\n"	// Return to the function
+    "	popl %edx\n"
+    "	popl %ecx\n"
+    "	popl %eax\n"
+    "	addl $4, %esp\n"
+    "	ret\n");
+#else
+// Never called, see MODULE_CALL() below
+void
+module_lazy_trampoline (void)
+{
+    panic("module_lazy_trampoline: not an i386 kernel");
+}
+#endif
+
+//
+// Call into a module's own code. Modules are i386 code, so only an i386
+// build can. Other builds, like the hosted benchmarks in host/, still link
+// and map them, they just skip the calls.
+//
+#if defined (__i386__)
+#define MODULE_CALL(call)	(call)
+#else
+#define MODULE_CALL(call)	module_no_call()
+
+static int
+module_no_call (void)
+{
+    return 0;
+}
+#endif
+
+// Pages of the MODULE_DATA window in use, one bit per page
+static uint32_t module_mem_bitmap[MODULE_DATA_PAGES / 32];
+
+#define MODULE_MEM_USED(i)	(module_mem_bitmap[(i) / 32] & (1U << ((i) % 32)))
+
+//
+// Give back the pages of a module image. Clearing the bits is all it takes
+// for the range to merge with free space on either side of it.
+//
+static void
+module_mem_free (uint32_t va, uint32_t npages)
+{
+    uint32_t i, page = (va - MODULE_DATA) / PGSIZE;
+
+    for (i = page; i < page + npages; i++) {
+	page_remove(boot_pgdir, (void *)(MODULE_DATA + i * PGSIZE));
+	module_mem_bitmap[i / 32] &= ~(1U << (i % 32));
+    }
+}
+
+//
+// Back pages [start, start + npages) of the MODULE_DATA window with fresh
+// zeroed pages that only the kernel can access. Returns the address of
+// the region, or 0.
+//
+static uint32_t
+module_mem_map (uint32_t start, uint32_t npages)
+{
+    struct Page *pp;
+    uint32_t i;
+    void *va;
+
+    for (i = start; i < start + npages; i++) {
+	va = (void *)(MODULE_DATA + i * PGSIZE);
+
+	if (page_alloc(&pp) < 0) {
+	    goto fail;
+	}
+
+	if (page_insert(boot_pgdir, pp, va, PTE_W) < 0) {
+	    page_free(pp);
+	    goto fail;
+	}
+
+	kmem_zero(va, PGSIZE);
+	module_mem_bitmap[i / 32] |= (1U << (i % 32));
+    }
+
+    return MODULE_DATA + start * PGSIZE;
+
+fail:
+    module_mem_free(MODULE_DATA + start * PGSIZE, i - start);
+    cprintf("module_mem_map: out of memory\n");
+    return 0;
+}
+
+//
+// Find room for a module image of 'npages' contiguous pages in the
+// MODULE_DATA window, first fit. Returns the address of the region, or 0.
+//
+static uint32_t
+module_mem_alloc (uint32_t npages)
+{
+    uint32_t i, run = 0;
+
+    for (i = 0; i < MODULE_DATA_PAGES && run < npages; i++) {
+	run = MODULE_MEM_USED(i) ? 0 : run + 1;
+    }
+
+    if (npages == 0 || run < npages) {
+	cprintf("module_mem_alloc: no room for %d pages\n", npages);
+	return 0;
+    }
+
+    return module_mem_map(i - npages, npages);
+}
+
+// Get the pages at a given address in the window, if they are free
+static uint32_t
+module_mem_alloc_at (uint32_t va, uint32_t npages)
+{
+    uint32_t i, start = (va - MODULE_DATA) / PGSIZE;
+
+    if (start + npages > MODULE_DATA_PAGES) {
+	return 0;
+    }
+
+    for (i = start; i < start + npages; i++) {
+	if (MODULE_MEM_USED(i)) {
+	    return 0;
+	}
+    }
+
+    return module_mem_map(start, npages);
+}
+
+//
+// Make the text pages of a module read-only once it is relocated. The
+// kernel runs with CR0_WP set, so this catches stray writes from the
+// kernel as well. Plain i386 paging has no no-execute bit, so the data
+// pages can't be made non-executable.
+//
+static void
+module_mem_protect_text (uint32_t va, uint32_t npages)
+{
+    pte_t *pte;
+    uint32_t i;
+
+    for (i = 0; i < npages; i++, va += PGSIZE) {
+	if ((pte = pgdir_walk(boot_pgdir, (void *)va, 0)) != NULL) {
+	    *pte &= ~PTE_W;
+	    tlb_invalidate(boot_pgdir, (void *)va);
+	}
+    }
+}
+
+// Should a section be loaded?
+static inline int
+module_section_loadable (struct Secthdr *sh)
+{
+    return (sh->sh_flags & SHF_ALLOC) && sh->sh_size != 0 && sh->sh_addr == 0;
+}
+
+// Place a section at the next suitably aligned offset
+static inline uint32_t
+module_section_place (uint32_t offset, struct Secthdr *sh)
+{
+    return ROUNDUP(offset, sh->sh_addralign ? sh->sh_addralign : 1);
+}
+
+//
+// State of a module being loaded. Only the section headers, the symbol
+// table and its string table are read into scratch memory. The sections
+// themselves are read straight to where they are loaded, and relocations
+// a page at a time.
+//
+struct Module_loader {
+    struct Module_source *ml_src;
+    struct Elf		ml_elf;
+    struct Secthdr	*ml_sections;
+    struct Secthdr	*ml_symtab;
+    struct Symbol	*ml_symbols;
+    uint32_t		ml_num_sym;
+    char		*ml_strtab;
+    void		*ml_buf;	// A page to read relocations into
+    int			ml_lazy;	// Calls to imports go through stubs
+    uint32_t		ml_num_undef;	// Imports, at most this many stubs
+    char		*ml_names;	// Where the next name is kept
+    uint32_t		ml_scratch[2];	// Scratch regions, and their pages
+    uint32_t		ml_scratch_pages[2];
+};
+
+// Read part of the module image
+static int
+module_read (struct Module_loader *ml, uint32_t offset, void *buf, uint32_t len)
+{
+    if (offset > ml->ml_src->ms_size || len > ml->ml_src->ms_size - offset) {
+	cprintf("module_read: %d bytes at %d are beyond the end of the image\n",
+		len, offset);
+	return -E_INVAL;
+    }
+
+    return ml->ml_src->ms_read(ml->ml_src->ms_arg, offset, buf, len);
+}
+
+static int module_cache_evict (void);
+
+//
+// Get scratch memory for the loader, released by module_loader_close().
+// Cached module images make way for it if they have to.
+//
+static void *
+module_loader_scratch (struct Module_loader *ml, int which, uint32_t size)
+{
+    ml->ml_scratch_pages[which] = ROUNDUP(size, PGSIZE) / PGSIZE;
+
+    while ((ml->ml_scratch[which] =
+	    module_mem_alloc(ml->ml_scratch_pages[which])) == 0 &&
+	   module_cache_evict())
+	;
+
+    return (void *)ml->ml_scratch[which];
+}
+
+static void
+module_loader_close (struct Module_loader *ml)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	if (ml->ml_scratch[i]) {
+	    module_mem_free(ml->ml_scratch[i], ml->ml_scratch_pages[i]);
+	    ml->ml_scratch[i] = 0;
+	}
+    }
+}
+
+//
+// Read the ELF header, the section headers, the symbol table and its
+// string table, and check that they make sense.
+//
+static int
+module_loader_open (struct Module_loader *ml, struct Module_source *src)
+{
+    struct Secthdr *sh;
+    uint32_t i, symtab_size, strtab_size;
+    int ret;
+
+    memset(ml, 0, sizeof(*ml));
+    ml->ml_src = src;
+
+    // First check if this is a valid ELF. bail if its not.
+    if ((ret = module_read(ml, 0, &ml->ml_elf, sizeof(ml->ml_elf))) < 0) {
+	return ret;
+    }
+
+    if (ml->ml_elf.e_magic != ELF_MAGIC ||
+	ml->ml_elf.e_shentsize != sizeof(struct Secthdr) ||
+	ml->ml_elf.e_shnum == 0) {
+	return -E_INVAL;
+    }
+
+    // The section headers
+    ml->ml_sections = module_loader_scratch(ml, 0, ml->ml_elf.e_shnum *
+					     sizeof(struct Secthdr));
+    if (ml->ml_sections == NULL) {
+	return -E_NO_MEM;
+    }
+
+    ret = module_read(ml, ml->ml_elf.e_shoff, ml->ml_sections,
+		      ml->ml_elf.e_shnum * sizeof(struct Secthdr));
+    if (ret < 0) {
+	return ret;
+    }
+
+    //
+    // Find the symbol table. While we are at it, make sure there are no
+    // relocations we can't handle.
+    //
+    for (i = 0; i < ml->ml_elf.e_shnum; i++) {
+	sh = &ml->ml_sections[i];
+
+	if (sh->sh_type == ELF_SHT_SYMTAB) {
+	    ml->ml_symtab = sh;
+	} else if (sh->sh_type == ELF_SHT_RELA) {
+	    cprintf("module_loader_open: SHT_RELA relocations\n");
+	    return -E_INVAL;
+	} else if (sh->sh_type == ELF_SHT_REL &&
+		   sh->sh_info >= ml->ml_elf.e_shnum) {
+	    return -E_INVAL;
+	}
+    }
+
+    if (ml->ml_symtab == NULL ||
+	ml->ml_symtab->sh_link >= ml->ml_elf.e_shnum) {
+	cprintf("module_loader_open: no symbol table\n");
+	return -E_INVAL;
+    }
+
+    //
+    // Read the symbol table and its string table, and leave a page for
+    // the relocations behind them. The pages come zeroed, so the string
+    // table is terminated even if the image is broken.
+    //
+    symtab_size = ROUNDUP(ml->ml_symtab->sh_size, PGSIZE);
+    strtab_size = ml->ml_sections[ml->ml_symtab->sh_link].sh_size;
+
+    ml->ml_symbols = module_loader_scratch(ml, 1, symtab_size +
+					   ROUNDUP(strtab_size + 1, PGSIZE) +
+					   PGSIZE);
+    if (ml->ml_symbols == NULL) {
+	return -E_NO_MEM;
+    }
+
+    ml->ml_num_sym = ml->ml_symtab->sh_size / sizeof(struct Symbol);
+    ml->ml_strtab = (char *)ml->ml_symbols + symtab_size;
+    ml->ml_buf = ml->ml_strtab + ROUNDUP(strtab_size + 1, PGSIZE);
+
+    if ((ret = module_read(ml, ml->ml_symtab->sh_offset, ml->ml_symbols,
+			   ml->ml_symtab->sh_size)) < 0 ||
+	(ret = module_read(ml, ml->ml_sections[ml->ml_symtab->sh_link].sh_offset,
+			   ml->ml_strtab, strtab_size)) < 0) {
+	return ret;
+    }
+
+    for (i = 0; i < ml->ml_num_sym; i++) {
+	if (ml->ml_symbols[i].sym_name >= strtab_size) {
+	    return -E_INVAL;
+	}
+    }
+
+    return 0;
+}
+
+// The name of a symbol
+static inline const char *
+module_symbol_name (struct Module_loader *ml, struct Symbol *sym)
+{
+    return ml->ml_strtab + sym->sym_name;
+}
+
+//
+// Does the module export this symbol? Only global functions and variables
+// that live in the module are exported. Every module has init_module and
+// cleanup_module, and may have migrate_module. They are not for others to
+// call.
+//
+static int
+module_symbol_exported (struct Module_loader *ml, struct Symbol *sym)
+{
+    uint32_t type = ELF32_ST_TYPE(sym->sym_info);
+    const char *name = module_symbol_name(ml, sym);
+
+    if (ELF32_ST_BIND(sym->sym_info) != STB_GLOBAL ||
+	(type != STT_FUNC && type != STT_OBJECT)) {
+	return 0;
+    }
+
+    if (sym->sym_shndx == ELF_SHN_UNDEF) {
+	return 0;
+    }
+
+    if (sym->sym_shndx < ml->ml_elf.e_shnum &&
+	!(ml->ml_sections[sym->sym_shndx].sh_flags & SHF_ALLOC)) {
+	return 0;
+    }
+
+    return strcmp(name, "init_module") != 0 &&
+	   strcmp(name, "cleanup_module") != 0 &&
+	   strcmp(name, "migrate_module") != 0;
+}
+
+//
+// Work out how big the module image is, from the section headers and the
+// symbols. The executable sections come first so that they get pages of
+// their own, followed by the lazy binding stubs. Then the rest of the
+// sections, the common block and the table the stubs jump through. The
+// descriptor, the export and import tables and their names go after that.
+// There is room for a stub for every import, whether it is called or not.
+//
+static void
+module_image_size (struct Module_loader *ml, uint32_t *text_size,
+		   uint32_t *data_size, uint32_t *meta_size)
+{
+    struct Secthdr *sh, *end_sh;
+    struct Symbol *sym, *end_sym;
+    uint32_t align;
+
+    *text_size = *data_size = 0;
+    *meta_size = sizeof(struct Module);
+
+    sh = ml->ml_sections;
+    end_sh = sh + ml->ml_elf.e_shnum;
+
+    for (; sh < end_sh; sh++) {
+	if (module_section_loadable(sh)) {
+	    if (sh->sh_flags & SHF_EXECINSTR) {
+		*text_size = module_section_place(*text_size, sh) + sh->sh_size;
+	    } else {
+		*data_size = module_section_place(*data_size, sh) + sh->sh_size;
+	    }
+	}
+    }
+
+    sym = ml->ml_symbols;
+    end_sym = sym + ml->ml_num_sym;
+
+    for (; sym < end_sym; sym++) {
+	// The common block. sym_value holds the alignment of these.
+	if (sym->sym_shndx == ELF_SHN_COMMON) {
+	    align = sym->sym_value ? sym->sym_value : 1;
+	    *data_size = ROUNDUP(*data_size, align) + sym->sym_size;
+	}
+
+	if (module_symbol_exported(ml, sym)) {
+	    *meta_size += sizeof(struct Ksym_def) +
+			  strlen(module_symbol_name(ml, sym)) + 1;
+	}
+
+	if (ml->ml_lazy && sym != ml->ml_symbols &&
+	    sym->sym_shndx == ELF_SHN_UNDEF) {
+	    ml->ml_num_undef++;
+	    *meta_size += sizeof(struct Ksym_def) +
+			  strlen(module_symbol_name(ml, sym)) + 1;
+	}
+    }
+
+    if (ml->ml_num_undef) {
+	*text_size = ROUNDUP(*text_size, MODULE_PLT_ENTRY) +
+		     (ml->ml_num_undef + 1) * MODULE_PLT_ENTRY;
+	*data_size = ROUNDUP(*data_size, sizeof(uint32_t)) +
+		     ml->ml_num_undef * sizeof(uint32_t);
+    }
+}
+
+//
+// Find the address of a symbol a relocation refers to. Symbols the module
+// imports are looked up in the kernel symbol table the first time they
+// are referenced. The address is then kept in the ELF symbol itself,
+// which is marked MODULE_SHN_IMPORT, so the next reference finds it
+// right there. Symbols the module defines are SHN_ABS by now.
+//
+static int
+module_symbol_addr (struct Module *module, struct Symbol *sym,
+		    const char *name, uint32_t *addr)
+{
+    struct Ksym_def *imp;
+    uint32_t index;
+
+    if (sym->sym_shndx == ELF_SHN_UNDEF || sym->sym_shndx == MODULE_SHN_LAZY) {
+	*addr = ksym_lookup(name);
+
+	if (*addr == 0 && ELF32_ST_BIND(sym->sym_info) != STB_WEAK) {
+	    cprintf("module_symbol_addr: undefined symbol %s\n", name);
+	    return -E_NOT_FOUND;
+	}
+
+	if (sym->sym_shndx == MODULE_SHN_LAZY) {
+	    //
+	    // Calls already go through a stub, but now we need the real
+	    // address. Bind the stub while we are at it.
+	    //
+	    index = (sym->sym_value - module->module_plt) / MODULE_PLT_ENTRY - 1;
+	    imp = &module->module_lazy[index];
+	    if (imp->kd_addr == 0) {
+		module->module_lazy_bound++;
+	    }
+	    imp->kd_addr = *addr;
+	    module->module_got[index] = *addr;
+	} else {
+	    module->module_eager_count++;
+	}
+
+	sym->sym_value = *addr;
+	sym->sym_shndx = MODULE_SHN_IMPORT;
+    }
+
+    if (sym->sym_shndx != ELF_SHN_ABS && sym->sym_shndx != MODULE_SHN_IMPORT) {
+	cprintf("module_symbol_addr: %s is in a section that is not loaded\n",
+		name);
+	return -E_INVAL;
+    }
+
+    *addr = sym->sym_value;
+    return 0;
+}
+
+//
+// Get the lazy binding stub for an imported function, making one if it
+// is the first call to it we see. Stub i is
+//
+//	jmp	*got[i]
+//	pushl	$i
+//	jmp	plt0
+//
+// and got[i] starts out pointing at the pushl. plt0 pushes the module and
+// jumps to module_lazy_trampoline, which binds got[i] to the function.
+//
+// The function is not bound yet, but it has to exist: a module calling a
+// function that isn't there fails to load, as it does with eager binding.
+// A hash probe of the symbol table is all that takes.
+//
+static int
+module_lazy_stub (struct Module *module, struct Module_loader *ml,
+		  struct Symbol *sym, const char *name, uint32_t *addr)
+{
+    struct Ksym_def *imp;
+    uint8_t *stub;
+    uint32_t index, hash;
+
+    if (sym->sym_shndx == MODULE_SHN_LAZY) {
+	*addr = sym->sym_value;
+	return 0;
+    }
+
+    hash = ksym_hash(name);
+    if (ksym_lookup_hash(name, hash) == 0) {
+	cprintf("module_lazy_stub: undefined symbol %s\n", name);
+	return -E_NOT_FOUND;
+    }
+
+    index = module->module_lazy_count++;
+    stub = (uint8_t *)module->module_plt + (index + 1) * MODULE_PLT_ENTRY;
+
+    stub[0] = 0xff;			// jmp *got[i]
+    stub[1] = 0x25;
+    *(module_word_t *)&stub[2] = (uint32_t)&module->module_got[index];
+    stub[6] = 0x68;			// pushl $i
+    *(module_word_t *)&stub[7] = index;
+    stub[11] = 0xe9;			// jmp plt0
+    *(module_word_t *)&stub[12] = module->module_plt - (uint32_t)&stub[16];
+
+    module->module_got[index] = (uint32_t)&stub[6];
+
+    // Keep the name, for when it is called
+    imp = &module->module_lazy[index];
+    imp->kd_name = ml->ml_names;
+    imp->kd_hash = hash;
+    imp->kd_addr = 0;
+    strcpy(ml->ml_names, name);
+    ml->ml_names += strlen(name) + 1;
+
+    sym->sym_shndx = MODULE_SHN_LAZY;
+    sym->sym_value = (uint32_t)stub;
+
+    *addr = sym->sym_value;
+    return 0;
+}
+
+// Set up the code all the lazy binding stubs of a module jump to
+static void
+module_lazy_init (struct Module *module)
+{
+    uint8_t *plt0 = (uint8_t *)module->module_plt;
+
+    memset(plt0, 0xcc, MODULE_PLT_ENTRY);	// int3
+    plt0[0] = 0x68;				// pushl $module
+    *(module_word_t *)&plt0[1] = (uint32_t)module;
+    plt0[5] = 0xe9;				// jmp module_lazy_trampoline
+    *(module_word_t *)&plt0[6] = (uint32_t)module_lazy_trampoline -
+			    (uint32_t)&plt0[10];
+}
+
+// Stands in for an imported function that went away since the load
+static int
+module_lazy_missing (void)
+{
+    return -E_NOT_FOUND;
+}
+
+//
+// Bind lazy binding stub 'index' of a module, and return the address of
+// the function. Called by module_lazy_trampoline, on the first call
+// through the stub.
+//
+// The function was there when the module was loaded, but the module that
+// exported it may have been unloaded since. Then the call returns
+// -E_NOT_FOUND, and the stub is left unbound, so that the next call finds
+// the function if it is back.
+//
+uint32_t
+module_lazy_resolve (struct Module *module, uint32_t index)
+{
+    struct Ksym_def *imp = &module->module_lazy[index];
+    uint32_t addr;
+
+    addr = ksym_lookup_hash(imp->kd_name, imp->kd_hash);
+    if (addr == 0) {
+	cprintf("module_lazy_resolve: module %s calls undefined function %s\n",
+		module->module_name, imp->kd_name);
+	return (uint32_t)module_lazy_missing;
+    }
+
+    if (imp->kd_addr == 0) {
+	module->module_lazy_bound++;
+    }
+    imp->kd_addr = addr;
+    module->module_got[index] = addr;
+
+    return addr;
+}
+
+//
+// Apply the relocations in one SHT_REL section to the section it is for,
+// which sh_info names. The addend is whatever is stored at the place
+// being relocated. Only the relocation types gcc uses in kernel code are
+// supported, anything else fails the load. The relocations are read a
+// page at a time and not kept.
+//
+static int
+module_relocate (struct Module *module, struct Module_loader *ml,
+		 struct Secthdr *rel_sh)
+{
+    struct Secthdr *target = &ml->ml_sections[rel_sh->sh_info];
+    struct Rel *rels = ml->ml_buf;
+    struct Symbol *sym;
+    uint32_t i, done, chunk, num_rels, sym_index, type, S, A, P;
+    module_word_t *where;
+    const char *name;
+    int ret;
+
+    // Relocations for sections we did not load, like debug info
+    if (!(target->sh_flags & SHF_ALLOC) || target->sh_size == 0) {
+	return 0;
+    }
+
+    num_rels = rel_sh->sh_size / sizeof(rels[0]);
+
+    for (done = 0; done < num_rels; done += chunk) {
+	chunk = MIN(num_rels - done, PGSIZE / sizeof(rels[0]));
+
+	ret = module_read(ml, rel_sh->sh_offset + done * sizeof(rels[0]),
+			  rels, chunk * sizeof(rels[0]));
+	if (ret < 0) {
+	    return ret;
+	}
+
+	for (i = 0; i < chunk; i++) {
+	    sym_index = ELF32_R_SYM(rels[i].rel_info);
+	    type = ELF32_R_TYPE(rels[i].rel_info);
+
+	    if (sym_index >= ml->ml_num_sym ||
+		target->sh_size < sizeof(uint32_t) ||
+		rels[i].rel_offset > target->sh_size - sizeof(uint32_t)) {
+		cprintf("module_relocate: bad relocation %d\n", done + i);
+		return -E_INVAL;
+	    }
+
+	    where = (module_word_t *)(target->sh_addr + rels[i].rel_offset);
+	    sym = &ml->ml_symbols[sym_index];
+	    name = module_symbol_name(ml, sym);
+
+	    //
+	    // Symbol, addend and place. Calls to imported functions go
+	    // through a stub if we bind lazily; any other reference needs
+	    // the real address now.
+	    //
+	    S = 0;
+	    if (sym_index == 0) {
+		// No symbol
+	    } else if (ml->ml_lazy && type == R_386_PC32 &&
+		       (sym->sym_shndx == ELF_SHN_UNDEF ||
+			sym->sym_shndx == MODULE_SHN_LAZY) &&
+		       ELF32_ST_BIND(sym->sym_info) != STB_WEAK) {
+		if ((ret = module_lazy_stub(module, ml, sym, name, &S)) < 0) {
+		    return ret;
+		}
+	    } else if ((ret = module_symbol_addr(module, sym, name, &S)) < 0) {
+		return ret;
+	    }
+	    A = *where;
+	    P = (uint32_t)where;
+
+	    switch (type) {
+		case R_386_NONE:
+		    break;
+
+		case R_386_32:
+		    // Absolute address
+		    *where = S + A;
+		    break;
+
+		case R_386_PC32:
+		    // PC relative address
+		    *where = S + A - P;
+		    break;
+
+		default:
+		    cprintf("module_relocate: unsupported relocation type %d "
+			    "against %s\n", type, name);
+		    return -E_INVAL;
+	    }
+	}
+    }
+
+    module->module_rel_count += num_rels;
+
+    return 0;
+}
+
+//
+// Hash the whole ELF image, a chunk at a time. This is done before the
+// loader is opened, so that a cache hit needs no scratch memory and does
+// not read the headers and the symbol table. Returns 0 if the image
+// can't be read.
+//
+static uint64_t
+module_image_hash (struct Module_source *src)
+{
+    uint64_t hash = MODULE_FNV_OFFSET;
+    uint8_t buf[MODULE_HASH_CHUNK];
+    uint32_t offset, len, i;
+
+    for (offset = 0; offset < src->ms_size; offset += len) {
+	len = MIN(src->ms_size - offset, MODULE_HASH_CHUNK);
+
+	if (src->ms_read(src->ms_arg, offset, buf, len) < 0) {
+	    return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+	    hash ^= buf[i];
+	    hash *= MODULE_FNV_PRIME;
+	}
+    }
+
+    return hash;
+}
+
+// Drop a cache entry, given the link that points to it
+static void
+module_cache_drop (struct Module_cache **link)
+{
+    struct Module_cache *mc = *link;
+
+    *link = mc->mc_next;
+    module_cache_count--;
+    module_mem_free(mc->mc_copy, mc->mc_copy_pages);
+}
+
+// Drop the least recently stored entry. Returns 0 if there was none.
+static int
+module_cache_evict (void)
+{
+    struct Module_cache **link;
+
+    if (module_cache == NULL) {
+	return 0;
+    }
+
+    for (link = &module_cache; (*link)->mc_next != NULL;
+	 link = &(*link)->mc_next)
+	;
+    module_cache_drop(link);
+
+    return 1;
+}
+
+//
+// Keep a copy of a freshly relocated module. The imports are whatever
+// the relocations looked up, see module_symbol_addr(), and the functions
+// called through stubs, which are kept with an address of 0.
+//
+static void
+module_cache_store (struct Module *module, struct Module_loader *ml,
+		    uint64_t hash, uint32_t meta_offset)
+{
+    struct Module_cache *mc, **link;
+    struct Symbol *sym, *end_sym;
+    uint32_t size, copy, num_imports = 0, names_size = 0;
+    const char *name;
+    char *names;
+
+    // One entry per module name
+    for (link = &module_cache; *link != NULL; link = &(*link)->mc_next) {
+	if (strcmp((*link)->mc_name, module->module_name) == 0) {
+	    module_cache_drop(link);
+	    break;
+	}
+    }
+
+    if (module_cache_count == MODULE_CACHE_MAX) {
+	module_cache_evict();
+    }
+
+    end_sym = ml->ml_symbols + ml->ml_num_sym;
+    for (sym = ml->ml_symbols; sym < end_sym; sym++) {
+	if (sym->sym_shndx == MODULE_SHN_IMPORT ||
+	    sym->sym_shndx == MODULE_SHN_LAZY) {
+	    num_imports++;
+	    names_size += strlen(module_symbol_name(ml, sym)) + 1;
+	}
+    }
+
+    size = module->module_pages * PGSIZE + sizeof(struct Module_cache) +
+	   num_imports * sizeof(struct Ksym_def) + names_size;
+    if ((copy = module_mem_alloc(ROUNDUP(size, PGSIZE) / PGSIZE)) == 0) {
+	return;
+    }
+
+    // Nobody reads the copy until the module is loaded again
+    kmem_copy_nt((void *)copy, (void *)module->module_base,
+		 module->module_pages * PGSIZE);
+
+    mc = (struct Module_cache *)(copy + module->module_pages * PGSIZE);
+    strcpy(mc->mc_name, module->module_name);
+    mc->mc_hash = hash;
+    mc->mc_size = ml->ml_src->ms_size;
+    mc->mc_base = module->module_base;
+    mc->mc_pages = module->module_pages;
+    mc->mc_meta_offset = meta_offset;
+    mc->mc_copy = copy;
+    mc->mc_copy_pages = ROUNDUP(size, PGSIZE) / PGSIZE;
+    mc->mc_generation = ksym_generation();
+    mc->mc_imports = (struct Ksym_def *)(mc + 1);
+    names = (char *)(mc->mc_imports + num_imports);
+
+    for (sym = ml->ml_symbols; sym < end_sym; sym++) {
+	if (sym->sym_shndx != MODULE_SHN_IMPORT &&
+	    sym->sym_shndx != MODULE_SHN_LAZY) {
+	    continue;
+	}
+
+	name = module_symbol_name(ml, sym);
+	strcpy(names, name);
+	mc->mc_imports[mc->mc_num_imports].kd_name = names;
+	mc->mc_imports[mc->mc_num_imports].kd_hash = ksym_hash(name);
+	mc->mc_imports[mc->mc_num_imports].kd_addr =
+	    sym->sym_shndx == MODULE_SHN_IMPORT ? sym->sym_value : 0;
+	mc->mc_num_imports++;
+	names += strlen(name) + 1;
+    }
+
+    mc->mc_next = module_cache;
+    module_cache = mc;
+    module_cache_count++;
+}
+
+//
+// Find a cached image of this module that is still good. If the symbol
+// table changed since we last looked, every import has to resolve to the
+// address it was relocated against, and every function called through a
+// stub has to still be there, as module_lazy_stub() checks at load time;
+// otherwise the entry is dropped.
+//
+static struct Module_cache *
+module_cache_lookup (char *mod_name, uint32_t size, uint64_t hash)
+{
+    struct Module_cache *mc, **link;
+    struct Ksym_def *imp;
+    uint32_t i, addr;
+
+    for (link = &module_cache; *link != NULL; link = &(*link)->mc_next) {
+	mc = *link;
+	if (mc->mc_size == size && mc->mc_hash == hash &&
+	    strcmp(mc->mc_name, mod_name) == 0) {
+	    break;
+	}
+    }
+
+    if ((mc = *link) == NULL) {
+	return NULL;
+    }
+
+    if (mc->mc_generation != ksym_generation()) {
+	for (i = 0; i < mc->mc_num_imports; i++) {
+	    imp = &mc->mc_imports[i];
+	    addr = ksym_lookup_hash(imp->kd_name, imp->kd_hash);
+	    if (imp->kd_addr ? addr != imp->kd_addr : addr == 0) {
+		module_cache_drop(link);
+		return NULL;
+	    }
+	}
+	mc->mc_generation = ksym_generation();
+    }
+
+    return mc;
+}
+
+//
+// Enter and leave a walk over the hook chains on this CPU. The locked
+// increment orders the count before the loads of the walk, so that
+// module_reap() can not miss a walker that already has a hook in hand.
+//
+static inline int
+module_walk_enter (void)
+{
+    int cpu = sched_cpunum();
+
+    asm volatile("lock; incl %0" : "+m" (module_walk_depth[cpu]) : :
+		 "cc", "memory");
+    return cpu;
+}
+
+static inline void
+module_walk_exit (int cpu)
+{
+    asm volatile("lock; decl %0" : "+m" (module_walk_depth[cpu]) : :
+		 "cc", "memory");
+}
+
+// Account for a call into a module that took 'cycles' TSC cycles
+static void
+module_account (struct Module_cost *mt, uint64_t cycles)
+{
+    mt->mt_calls++;
+    mt->mt_cycles += cycles;
+    loghist_record(mt->mt_hist, MODULE_COST_BUCKETS, MODULE_COST_SHIFT,
+		   &mt->mt_max, cycles);
+}
+
+//
+// Add a hook to the registry. A module that registers the same type again
+// replaces its earlier vector.
+//
+static void
+module_hook_add (int type, struct Module *module, int (*vector)(void))
+{
+    struct Module_hook *mh = &module->module_hook[type];
+    struct Module_hook **link;
+
+    mh->mh_vector = vector;
+
+    // On standby the hook is kept until module_hook_switch()
+    if (mh->mh_module != NULL || module->module_state == MODULE_STATE_STANDBY) {
+	return;
+    }
+
+    // Fill in the entry before it becomes visible to module_invoke_hooks()
+    mh->mh_module = module;
+    mh->mh_next = NULL;
+
+    for (link = &module_hooks[type]; *link != NULL; link = &(*link)->mh_next)
+	;
+    *link = mh;
+}
+
+// Drop every hook a module registered
+static void
+module_hook_remove (struct Module *module)
+{
+    struct Module_hook **link;
+    int type;
 
-// Global module structure
-struct Module *modules;
-uint32_t module_count;
+    for (type = 0; type < MODULE_HOOK_TYPES; type++) {
+	if (module->module_hook[type].mh_module == NULL) {
+	    continue;
+	}
 
-// Pointer to the actual module data
-void *module_data;
+	for (link = &module_hooks[type]; *link != NULL;
+	     link = &(*link)->mh_next) {
+	    if (*link == &module->module_hook[type]) {
+		*link = (*link)->mh_next;
+		break;
+	    }
+	}
 
-// Global module bitmap. Indicates which module slots are free / used
-uint16_t module_bitmap;
+	module->module_hook[type].mh_module = NULL;
+    }
+}
 
-// To keep the compiler happy!
-extern uint32_t get_symbol_addr (char *symbol_name);
-extern int insert_symbol (char *symbolName, uint32_t addr);
+//
+// Hand the hook 'old' registered for an API type over to 'new'. The new
+// hook takes the place of the old one in the chain, and goes live with
+// the store of a single pointer. The old hook still points at the rest of
+// the chain, for callers that are on it right now.
+//
+static void
+module_hook_switch (int type, struct Module *old, struct Module *new)
+{
+    struct Module_hook *oh = &old->module_hook[type];
+    struct Module_hook *nh = &new->module_hook[type];
+    struct Module_hook **link;
 
-// Insert the given module
-int
-module_init (char *mod_name, void *mod_binary, uint32_t mod_binary_size)
+    if (oh->mh_module == NULL) {
+	if (nh->mh_vector != NULL) {
+	    module_hook_add(type, new, nh->mh_vector);
+	}
+	return;
+    }
+
+    for (link = &module_hooks[type]; *link != oh; link = &(*link)->mh_next)
+	;
+
+    if (nh->mh_vector != NULL) {
+	nh->mh_module = new;
+	nh->mh_next = oh->mh_next;
+	*link = nh;
+    } else {
+	*link = oh->mh_next;
+    }
+
+    oh->mh_module = NULL;
+}
+
+// Find a loaded module by name
+static struct Module *
+module_lookup (char *mod_name)
 {
     struct Module *module;
-    struct Elf *elf_hdr = (struct Elf *)mod_binary;
-    struct Secthdr *sh, *end_sh, *section_base;
-    struct Secthdr *rel_sh, *sym_sh, *str_sh, *shstr_sh;
-    uint8_t *module_base, *sh_string_table, *start_addr;
-    uint32_t sh_size = 0, sh_count = 0, i = 0, j = 0, k = 0;
-    uint32_t text_start = 0, rodata_addr = 0, bss_addr = 0, data_addr = 0;
-    uint32_t common_block_addr = 0; // For ELF_SHN_COMMON case
-    int ret, module_index, rel_offset, next_addr, sym_addr;
 
-    // First check if this is a valid ELF. bail if its not.
-    if (elf_hdr->e_magic != ELF_MAGIC) {
-	return -E_INVAL;
+    for (module = modules; module != NULL; module = module->module_next) {
+	if (strcmp(module->module_name, mod_name) == 0) {
+	    return module;
+	}
     }
 
-    // Initialization
-    rel_sh = sym_sh = str_sh = shstr_sh = NULL;
-    module_index = INVALID_MODULE_INDEX;
+    return NULL;
+}
 
-    // First make sure we haven't already loaded this module!
-    for (i = 0; i < MAX_MODULES; i++) {
-	module = (struct Module *)(MODULES + i * MAX_MD_SIZE);
-	if (module->module_state == MODULE_STATE_ACTIVE &&
-	    strcmp(module->module_name, mod_name) == 0) {
-	    cprintf("module_init: module %s is already loaded\n", mod_name);
-	    return -E_FILE_EXISTS;
+// Find a loaded module by index
+static struct Module *
+module_lookup_index (uint32_t mod_index)
+{
+    struct Module *module;
+
+    for (module = modules; module != NULL; module = module->module_next) {
+	if (module->module_index == mod_index) {
+	    return module;
 	}
     }
 
-    // Find the first free slot for this module
-    for (i = 0; i < MAX_MODULES; i++) {
-	if ((module_bitmap & (1 << i)) == 0) {
-	    module_index = i;
-	    module_bitmap |= (1 << i);
-	    break;
+    return NULL;
+}
+
+//
+// Free the modules that were unloaded once nothing is running in them any
+// more. Their cleanup routine runs right before that.
+//
+static void
+module_reap (void)
+{
+    struct Module *module, **link;
+    uint64_t start;
+    int cpu;
+
+    // Order taking the hooks off the chains before reading the counts
+    asm volatile("lock; addl $0, %0" : "+m" (module_walk_depth[0]) : :
+		 "cc", "memory");
+
+    for (link = &module_retired; *link != NULL; ) {
+	module = *link;
+
+	// CPU masks are 32 bits, as for scheduler affinity
+	for (cpu = 0; cpu < SCHED_NCPU && cpu < 32; cpu++) {
+	    if (module_walk_depth[cpu] == 0) {
+		module->module_walkers &= ~(1U << cpu);
+	    }
+	}
+
+	if (module->module_walkers != 0) {
+	    link = &module->module_next;
+	    continue;
 	}
+	*link = module->module_next;
+
+	// Call the module's cleanup routine
+	start = read_tsc();
+	MODULE_CALL(module->cleanup_routine(module->module_index));
+	TRACE(TRACE_CAT_MODULE, TRACE_MODULE_REAP, module->module_index,
+	      read_tsc() - start, 0);
+
+	//
+	// Release the memory of the module image. The descriptor goes with
+	// it, so this has to be the last thing we do with it.
+	//
+	module_mem_free(module->module_base, module->module_pages);
     }
+}
 
-    // Were we able to find one?
-    if (module_index == INVALID_MODULE_INDEX) {
-	// We ran out of module space. Bail.
-	cprintf("module_init: can't load module %s due to lack of space\n",
-		mod_name);
-	return -E_NO_MEM;
+//
+// Unload a module. It is unhooked, and its exports and scheduler class go
+// away, right here. The module itself is freed as soon as no CPU can be
+// walking its hooks, which usually means right here as well.
+//
+static void
+module_unload (struct Module *module)
+{
+    struct Module **link;
+
+    // Take it off the list
+    for (link = &modules; *link != module; link = &(*link)->module_next)
+	;
+    *link = module->module_next;
+
+    // Update the module count
+    module_count--;
+
+    // Unhook the module before its cleanup routine runs
+    module_hook_remove(module);
+
+    // Stop using any scheduler class this module provides
+    sched_class_unregister_module(module->module_index);
+
+    // Take its symbols out of the kernel symbol table
+    ksym_remove_bulk(module->module_exports, module->module_export_count,
+		     module->module_index);
+
+    // Free it once no CPU can be on its hooks any more
+    module->module_state = MODULE_STATE_RETIRED;
+    module->module_walkers = SCHED_NCPU >= 32 ? ~0U : (1U << SCHED_NCPU) - 1;
+    module->module_next = module_retired;
+    module_retired = module;
+
+    module_reap();
+}
+
+//
+// Load a module, reading its ELF image from 'src'. The section headers
+// and the symbol table are read first, then the sections are read
+// straight to their place in the module image.
+//
+// If the module is to replace the loaded module 'old', it is loaded next
+// to it on standby: its exports are not published and the hooks it
+// registers are not called until module_replace() switches over.
+//
+static int
+module_link (char *mod_name, struct Module_source *src, struct Module *old,
+	     struct Module **module_store)
+{
+    struct Module_loader ml;
+    struct Module *module, *loaded;
+    struct Secthdr *sh, *end_sh;
+    struct Symbol *sym;
+    struct Ksym_def *exports;
+    uint8_t *module_base = NULL;
+    uint32_t sh_size = 0, sh_count = 0, i = 0;
+    uint32_t common_block_addr = 0; // For ELF_SHN_COMMON case
+    uint32_t text_size, data_size, meta_size, meta_offset;
+    uint32_t text_pages = 0, data_pages = 0, pass, exec, num_exports, shndx;
+    struct Module_cache *mc;
+    uint64_t hash, start;
+    const char *name;
+    char *names;
+    int ret, exported;
+
+    if (strlen(mod_name) >= MAX_MODULE_NAMELEN) {
+	cprintf("module_load: module name %s is too long\n", mod_name);
+	return -E_INVAL;
+    }
+
+    // First make sure we haven't already loaded this module!
+    if ((loaded = module_lookup(mod_name)) != NULL && loaded != old) {
+	cprintf("module_load: module %s is already loaded\n", mod_name);
+	return -E_FILE_EXISTS;
     }
 
-    // Get the descriptor for this module;
-    module = (struct Module *)(MODULES + module_index * sizeof(struct Module));
+    // The loader is only opened if the image is not cached
+    memset(&ml, 0, sizeof(ml));
+
+    //
+    // If we loaded this very image before, and it can go at the same
+    // address again, just copy the relocated image back in place.
+    //
+    hash = module_image_hash(src);
+    if (hash != 0 &&
+	(mc = module_cache_lookup(mod_name, src->ms_size, hash)) != NULL &&
+	(module_base = (uint8_t *)module_mem_alloc_at(mc->mc_base,
+						      mc->mc_pages)) != NULL) {
+	kmem_copy(module_base, (void *)mc->mc_copy, mc->mc_pages * PGSIZE);
+	module = (struct Module *)(module_base + mc->mc_meta_offset);
+	module->module_index = module_next_index++;
+	text_pages = module->module_text_pages;
+	goto publish;
+    }
 
-    // Get a pointer to the location where this module will be actually loaded
-    module_base = (uint8_t *)MODULE_DATA + module_index * PGSIZE;
+    // Get the section headers and the symbol table
+    if ((ret = module_loader_open(&ml, src)) < 0) {
+	cprintf("module_load: %s is not a module we can load\n", mod_name);
+	goto fail;
+    }
+    ml.ml_lazy = module_lazy_binding;
 
-    // Record the start of section headers
-    section_base = (struct Secthdr *)((uint8_t *)elf_hdr + elf_hdr->e_shoff);
+    //
+    // Get memory for the module image, as much as its sections need, with
+    // room for the descriptor and the export table after the data.
+    //
+    module_image_size(&ml, &text_size, &data_size, &meta_size);
+    text_pages = ROUNDUP(text_size, PGSIZE) / PGSIZE;
+    meta_offset = text_pages * PGSIZE +
+		  ROUNDUP(data_size, __alignof__(struct Module));
+    data_pages = ROUNDUP(meta_offset + meta_size, PGSIZE) / PGSIZE - text_pages;
+
+    // Make room by dropping cached images if we have to
+    while ((module_base = (uint8_t *)module_mem_alloc(text_pages + data_pages)) == NULL &&
+	   module_cache_evict())
+	;
+
+    if (module_base == NULL) {
+	cprintf("module_load: can't load module %s due to lack of memory\n",
+		mod_name);
+	ret = -E_NO_MEM;
+	goto fail;
+    }
 
-    // Record the location of section header string table
-    shstr_sh = (struct Secthdr *)(&section_base[elf_hdr->e_shstrndx]);
-    sh_string_table = (uint8_t *)elf_hdr + shstr_sh->sh_offset;
+    // Get the descriptor for this module, and the export table behind it
+    module = (struct Module *)(module_base + meta_offset);
+    exports = (struct Ksym_def *)(module + 1);
 
     // Do the basic initialization of the module
     strcpy(module->module_name, mod_name);
     module->module_state = MODULE_STATE_INIT;
-    module->module_index = module_index;
+    module->module_index = module_next_index++;
     module->module_base = (uint32_t)module_base;
+    module->module_pages = text_pages + data_pages;
+    module->module_text_pages = text_pages;
+    module->module_exports = exports;
 
-    // Walk through all the sections and load it to memory
-    sh = (struct Secthdr *)((uint8_t *)elf_hdr + elf_hdr->e_shoff);
-    end_sh= sh + elf_hdr->e_shnum;
-
-    for (; sh < end_sh; sh++) {
-
-	// Load only if required
-	if (sh->sh_flags & SHF_ALLOC && sh->sh_size != 0) {
-	    if (sh->sh_addr == 0) {
-		sh->sh_addr = (uint32_t)module_base + sh_size;
+    //
+    // Walk through all the sections and read them to memory. The first
+    // pass loads the executable sections, the second pass everything else
+    // starting at the first page after them.
+    //
+    end_sh = ml.ml_sections + ml.ml_elf.e_shnum;
 
-		if (sh->sh_type == ELF_SHT_NOBITS) {
-		    memset((void *)sh->sh_addr, 0, sh->sh_size);
-		} else {
-		    memmove((void *)sh->sh_addr, 
-			    (uint8_t *)mod_binary + sh->sh_offset,
-			    sh->sh_size);
-		}
+    for (pass = 0; pass < 2; pass++) {
+	sh_size = (pass == 0) ? 0 : text_pages * PGSIZE;
 
-		sh_size += sh->sh_size;
+	for (sh = ml.ml_sections; sh < end_sh; sh++) {
 
-		// Update bookkeeping info
-		module->sections[sh_count].sh_start = sh->sh_addr;
-		module->sections[sh_count].sh_size = sh->sh_size;
-		module->sections[sh_count].sh_type = sh->sh_type;
-		module->sections[sh_count].sh_offset = sh->sh_name;
-		sh_count++;
+	    // Load only if required, and only in the right pass
+	    exec = (sh->sh_flags & SHF_EXECINSTR) != 0;
+	    if (!module_section_loadable(sh) || exec != (pass == 0)) {
+		continue;
 	    }
-	}
 
-	//
-	// See if this is the symbol table, string table or relocatable
-	// section and store the pointer. This will be used in the second
-	// pass.
-	//
-	if (sh->sh_type == ELF_SHT_REL) {
-	    rel_sh = sh;
-	} else if (sh->sh_type == ELF_SHT_SYMTAB) {
-	    sym_sh = sh;
-	} else if (sh->sh_type == ELF_SHT_STRTAB) {
-	    str_sh = sh;
-	}
-    }
+	    sh_size = module_section_place(sh_size, sh);
+	    sh->sh_addr = (uint32_t)module_base + sh_size;
 
-    // 
-    // Make a second pass over the section headers and update the
-    // section names in our module structure
-    //
-    for (i = 0; i < sh_count; i++) {
-	sh = (struct Secthdr *)((uint8_t *)elf_hdr + elf_hdr->e_shoff);
-	end_sh= sh + elf_hdr->e_shnum;
-
-	for (; sh < end_sh; sh++) {
-	    if (sh->sh_name == module->sections[i].sh_offset) {
-		// Get the name from the string table
-		j = 0;
-		start_addr = sh_string_table + module->sections[i].sh_offset;
-		while (start_addr[j] != 0) {
-		    module->sections[i].sh_name[j] = start_addr[j];
-		    j++;
-		}
-		module->sections[i].sh_name[j] = 0;
+	    // The pages come zeroed, which is all SHT_NOBITS needs
+	    if (sh->sh_type != ELF_SHT_NOBITS &&
+		(ret = module_read(&ml, sh->sh_offset, (void *)sh->sh_addr,
+				   sh->sh_size)) < 0) {
+		goto fail;
 	    }
+
+	    sh_size += sh->sh_size;
+	    sh_count++;
 	}
-    }
 
-    //
-    // Now walk through the .rel.txt section and update the .text section
-    // with proper addresses. First get a pointer to the .text, .rodata,
-    // .bss and .data sections
-    //
-    for (i = 0; i < sh_count; i++) {
-	if (strcmp(module->sections[i].sh_name, ".text") == 0) {
-	    text_start = module->sections[i].sh_start;
-	} else if (strcmp(module->sections[i].sh_name, ".rodata") == 0) {
-	    rodata_addr = module->sections[i].sh_start;
-	} else if (strcmp(module->sections[i].sh_name, ".bss") == 0) {
-	    bss_addr = module->sections[i].sh_start;
-	} else if (strcmp(module->sections[i].sh_name, ".data") == 0) {
-	    data_addr = module->sections[i].sh_start;
+	// The lazy binding stubs go after the code
+	if (pass == 0 && ml.ml_num_undef) {
+	    sh_size = ROUNDUP(sh_size, MODULE_PLT_ENTRY);
+	    module->module_plt = (uint32_t)module_base + sh_size;
+	    sh_size += (ml.ml_num_undef + 1) * MODULE_PLT_ENTRY;
 	}
     }
 
@@ -182,280 +1395,456 @@ module_init (char *mod_name, void *mod_binary, uint32_t mod_binary_size)
     // Make a note of the module size so far. This will be needed later on
     // to allocate memory for symols defined as SHN_COMMON
     //
-    common_block_addr = text_start + sh_size;
+    common_block_addr = (uint32_t)module_base + sh_size;
 
     //
-    // Walk through the symbols and store them. Look for the address
-    // of init_module and cleanup_module and store it as the entry and
-    // cleanup points. This is where we find out what all functions are
-    // exposed by the module and copy them to the symbol table.
+    // Walk through the symbols and work out the address each symbol the
+    // module defines ended up at. The address goes in the ELF symbol, which
+    // is turned into an SHN_ABS symbol for the relocation code. Look for the
+    // address of init_module and cleanup_module and store it as the entry
+    // and cleanup points. This is where we find out what all functions and
+    // variables are exposed by the module, to go in the symbol table.
     //
 
-    uint8_t *sym_section = (uint8_t *)elf_hdr + sym_sh->sh_offset;
-    uint8_t *string_table = (uint8_t *)elf_hdr + str_sh->sh_offset;
-    struct Symbol *symbols = (struct Symbol *)sym_section;
-    int num_sym = sym_sh->sh_size / sizeof(symbols[0]);
-
-    for (i = 0; i < num_sym; i++) {
-	start_addr = string_table + symbols[i].sym_name;
-	j =0;
-	while (start_addr[j] != 0) {
-	    module->sym_table[i].sym_name[j] = start_addr[j];
-	    j++;
+    // The names go right behind the export table, so count the exports first
+    for (i = 0, num_exports = 0; i < ml.ml_num_sym; i++) {
+	if (module_symbol_exported(&ml, &ml.ml_symbols[i])) {
+	    num_exports++;
 	}
-	module->sym_table[i].sym_name[j] = 0;
-	module->sym_table[i].sym_value = symbols[i].sym_value;
+    }
+    module->module_lazy = exports + num_exports;
+    names = (char *)(module->module_lazy + ml.ml_num_undef);
 
-	if (ELF32_ST_TYPE(symbols[i].sym_info) == STT_FUNC) {
-	    //
-	    // This is a symbol exposed by the module and has to go in the
-	    // symbol table
-	    //
-	    insert_symbol(module->sym_table[i].sym_name,
-			  (uint32_t)((uint8_t *)text_start + symbols[i].sym_value));
-	}
+    for (i = 0; i < ml.ml_num_sym; i++) {
+	sym = &ml.ml_symbols[i];
+	name = module_symbol_name(&ml, sym);
+	shndx = sym->sym_shndx;
 
-	if (ELF32_ST_TYPE(symbols[i].sym_info) == STT_OBJECT) {
-	    //
-	    // This is a symbol exposed by the module and has to go in the
-	    // symbol table. First figure out the section it has to go in.
-	    //
-	    int sym_shndx = symbols[i].sym_shndx;
-	    int section = -1;
-	    struct Secthdr *s;
-
-	    // ELF_SHN_COMMON needs to be handled differently
-	    if (sym_shndx != ELF_SHN_COMMON) {
-		s = &section_base[sym_shndx];
-		
-		for (k = 0; k < sh_count; k++) {
-		    if (s->sh_addr == module->sections[k].sh_start) {
-			if (strcmp(module->sections[k].sh_name, ".bss") == 0) {
-			    section = SECTION_BSS;
-			} else if (strcmp(module->sections[k].sh_name, ".data") == 0) {
-			    section = SECTION_DATA;
-			}
-			break;
-		    }
-		}
+	if (shndx == ELF_SHN_UNDEF) {
+	    // Defined elsewhere. Looked up when a relocation needs it.
+	    continue;
+	}
 
-		switch (section) {
-		    case SECTION_BSS:
-			insert_symbol(module->sym_table[i].sym_name,
-				      (uint32_t)((uint8_t *)bss_addr + symbols[i].sym_value));
-			break;
+	exported = module_symbol_exported(&ml, sym);
 
-		    case SECTION_DATA:
-			insert_symbol(module->sym_table[i].sym_name,
-				      (uint32_t)((uint8_t *)data_addr + symbols[i].sym_value));
-			break;
-		}
-	    } else {
-		// 
-		// Use the common block for this symbol and update pointer
-		// accordingly. Align the address first as indicated in the
-		// symbol.
-		//
-		uint32_t align = common_block_addr % symbols[i].sym_value;
-		common_block_addr = common_block_addr - align + symbols[i].sym_value;
-
-		insert_symbol(module->sym_table[i].sym_name,
-			      (uint32_t)((uint8_t *)common_block_addr));
-		common_block_addr += symbols[i].sym_size;
-	    }
+	if (shndx == ELF_SHN_COMMON) {
+	    // 
+	    // Use the common block for this symbol and update pointer
+	    // accordingly. Align the address first as indicated in the
+	    // symbol.
+	    //
+	    common_block_addr = ROUNDUP(common_block_addr,
+					sym->sym_value ? sym->sym_value : 1);
+	    sym->sym_value = common_block_addr;
+	    common_block_addr += sym->sym_size;
+	} else if (shndx < ml.ml_elf.e_shnum &&
+		   (ml.ml_sections[shndx].sh_flags & SHF_ALLOC)) {
+	    sym->sym_value += ml.ml_sections[shndx].sh_addr;
+	} else if (shndx != ELF_SHN_ABS) {
+	    // Lives in a section we did not load
+	    continue;
+	}
+	sym->sym_shndx = ELF_SHN_ABS;
+
+	if (exported) {
+	    // Keep the name. The ELF image goes away once we are done.
+	    exports[module->module_export_count].kd_name = names;
+	    exports[module->module_export_count].kd_hash = ksym_hash(name);
+	    exports[module->module_export_count].kd_addr = sym->sym_value;
+	    module->module_export_count++;
+	    strcpy(names, name);
+	    names += strlen(name) + 1;
 	}
 
-	if (strcmp(module->sym_table[i].sym_name, "init_module") == 0) {
+	if (strcmp(name, "init_module") == 0) {
 	    // Update the module entry point
-	    module->init_routine = 
-		(void *)((uint8_t *)text_start + symbols[i].sym_value);
-	} else if (strcmp(module->sym_table[i].sym_name, "cleanup_module") == 0) {
+	    module->init_routine = (void *)sym->sym_value;
+	} else if (strcmp(name, "cleanup_module") == 0) {
 	    // Update the module exit point
-	    module->cleanup_routine = 
-		(void *)((uint8_t *)text_start + symbols[i].sym_value);
+	    module->cleanup_routine = (void *)sym->sym_value;
+	} else if (strcmp(name, "migrate_module") == 0) {
+	    // Takes over the state of the module this one replaces
+	    module->migrate_routine = (void *)sym->sym_value;
 	}
     }
 
-    //
-    // Start the actual relocation process. Walk through all the entries in
-    // the .rel.txt section and apply relocation accordingly.
-    //
+    if (module->init_routine == NULL || module->cleanup_routine == NULL) {
+	cprintf("module_load: %s lacks init_module or cleanup_module\n",
+		mod_name);
+	ret = -E_INVAL;
+	goto fail;
+    }
 
-    uint8_t *rel_section = (uint8_t *)elf_hdr + rel_sh->sh_offset;
-    struct Rel *rels = (struct Rel *)rel_section;
-    int num_rels = rel_sh->sh_size / sizeof(rels[0]);
-    int section = 0, var_size = 0;
-
-    for (i = 0; i < num_rels; i++) {
-	// First construct the relocatable entry
-	struct Symbol *sym = &symbols[ELF32_R_SYM(rels[i].rel_info)];
-
-	start_addr = string_table + sym->sym_name;
-	j =0;
-	while (start_addr[j] != 0) {
-	    module->rel_entry[i].sym_name[j] = start_addr[j];
-	    j++;
-	}
-	module->rel_entry[i].sym_name[j] = 0;
-
-	module->rel_entry[i].rel_type = ELF32_R_TYPE(rels[i].rel_info);
-	module->rel_entry[i].rel_offset = rels[i].rel_offset;
-
-	// Now apply the relocation based on the symbol type
-	switch (module->rel_entry[i].rel_type) {
-	    case R_386_32:
-		//
-		// This signifies absolute addressing. Here, the relocation
-		// may have to be done either on the .rodata / .bss / .data /
-		// .text section. This information can be obtained from the
-		// shndx parameter of the symbol.
-		//
-		if (module->rel_entry[i].sym_name[0] == '\0') {
-		    // .rodata / .bss / .data. Figure out which.
-		    struct Secthdr *r386_32_sh = &section_base[sym->sym_shndx];
-		    for (k = 0; k < sh_count; k++) {
-			if (r386_32_sh->sh_addr == module->sections[k].sh_start) {
-			    if (strcmp(module->sections[k].sh_name, ".rodata") == 0) {
-				section = SECTION_RODATA;
-			    } else if (strcmp(module->sections[k].sh_name, ".bss") == 0) {
-				section = SECTION_BSS;
-			    } else if (strcmp(module->sections[k].sh_name, ".data") == 0) {
-				section = SECTION_DATA;
-			    }
-			}
-		    }
-
-		    switch (section) {
-			case SECTION_RODATA:
-			    rel_offset = module->rel_entry[i].rel_offset;
-			    *(uint32_t *)((uint8_t *)text_start + rel_offset) = rodata_addr;
-
-			    // Fix the rodata pointer to point to the next string
-			    j = 0;
-			    while (*((uint8_t *)rodata_addr + j) != '\0') {
-				j++;
-			    }
-			    rodata_addr += (j + 1);
-			    break;
-
-			case SECTION_BSS:
-			    rel_offset = module->rel_entry[i].rel_offset;
-			    *(uint32_t *)((uint8_t *)text_start + rel_offset) = bss_addr;
-			    break;
-
-			case SECTION_DATA:
-			    rel_offset = module->rel_entry[i].rel_offset;
-			    *(uint32_t *)((uint8_t *)text_start + rel_offset) = data_addr;
-			    data_addr += sym->sym_size;
-			    break;
-		    }
-		} else {
-		    // .text section
-		    rel_offset = module->rel_entry[i].rel_offset;
-		    sym_addr = get_symbol_addr(module->rel_entry[i].sym_name);
-		    *(uint32_t *)((uint8_t *)text_start + rel_offset) = sym_addr;
-		}
-		break;
+    // The table the lazy binding stubs jump through goes after the data
+    if (ml.ml_num_undef) {
+	common_block_addr = ROUNDUP(common_block_addr, sizeof(uint32_t));
+	module->module_got = (uint32_t *)common_block_addr;
+	common_block_addr += ml.ml_num_undef * sizeof(uint32_t);
+	module_lazy_init(module);
+    }
+    ml.ml_names = names;
 
-	    case R_386_PC32:
-		// PC relative addressing
-		rel_offset = module->rel_entry[i].rel_offset;
-		sym_addr = get_symbol_addr(module->rel_entry[i].sym_name);
-		next_addr = text_start + rel_offset + 4;
-		*(uint32_t *)((uint8_t *)text_start + rel_offset) = sym_addr - next_addr;
-		break;
+    //
+    // Start the actual relocation process. Every SHT_REL section applies
+    // to the section its sh_info points to, be it .text, .data, .rodata
+    // or any other section.
+    //
+    for (sh = ml.ml_sections; sh < end_sh; sh++) {
+	if (sh->sh_type == ELF_SHT_REL &&
+	    sh->sh_link == ml.ml_symtab - ml.ml_sections) {
+	    if ((ret = module_relocate(module, &ml, sh)) < 0) {
+		cprintf("module_load: can't relocate module %s\n", mod_name);
+		goto fail;
+	    }
 	}
     }
 
     // Bookkeeping info
-    module->module_size = sh_size;
+    module->module_size = common_block_addr - (uint32_t)module_base;
     module->module_sh_count = sh_count;
-    module->module_rel_count = num_rels;
-    module->module_sym_count = num_sym;
+    module->module_sym_count = ml.ml_num_sym;
+
+    // Keep a copy for the next time this module is loaded
+    module_cache_store(module, &ml, hash, meta_offset);
+
+publish:
+    // The scratch memory is not needed any more
+    module_loader_close(&ml);
+
+    if (old) {
+	// Its exports would clash with the old module's for now
+	module->module_state = MODULE_STATE_STANDBY;
+    } else {
+	// Publish the exported symbols in one go
+	ksym_insert_bulk(module->module_exports, module->module_export_count,
+			 module->module_index);
+	module->module_state = MODULE_STATE_ACTIVE;
+    }
 
-    // Update the module state
-    module->module_state = MODULE_STATE_ACTIVE;
+    // The code is final now. Keep anyone from writing to it.
+    module_mem_protect_text((uint32_t)module_base, text_pages);
+
+    // Add it to the list
+    module->module_next = modules;
+    modules = module;
 
     // Update the count as well
     module_count++;
 
+    TRACE(TRACE_CAT_MODULE, TRACE_MODULE_LOAD, module->module_index,
+	  module->module_base, module->module_pages);
+
     // All done.. Invoke the module
-    module->init_routine(module->module_index);
+    start = read_tsc();
+    MODULE_CALL(module->init_routine(module->module_index));
+    module_account(&module->module_cost[MODULE_COST_INIT], read_tsc() - start);
 
     // For debugging
     if (module->module_vectors.test_api_vector) {
-	module->module_vectors.test_api_vector();
+	start = read_tsc();
+	MODULE_CALL(module->module_vectors.test_api_vector());
+	module_account(&module->module_cost[MODULE_TEST_API],
+		       read_tsc() - start);
+    }
+
+    if (module_store) {
+	*module_store = module;
     }
+    return 0;
+
+fail:
+    if (module_base) {
+	module_mem_free((uint32_t)module_base, text_pages + data_pages);
+    }
+    module_loader_close(&ml);
+    return ret;
+}
 
+int
+module_load (char *mod_name, struct Module_source *src)
+{
+    module_reap();
+
+    return module_link(mod_name, src, NULL, NULL);
+}
+
+// Read a module image that is already in memory
+static int
+module_mem_read (void *arg, uint32_t offset, void *buf, uint32_t len)
+{
+    kmem_copy(buf, (uint8_t *)arg + offset, len);
     return 0;
 }
 
+// Insert the given module, whose ELF image is at mod_binary
+int
+module_init (char *mod_name, void *mod_binary, uint32_t mod_binary_size)
+{
+    struct Module_source src;
+
+    src.ms_read = module_mem_read;
+    src.ms_arg = mod_binary;
+    src.ms_size = mod_binary_size;
+
+    return module_load(mod_name, &src);
+}
+
 // Delete the given module
 int
 module_cleanup (char *mod_name)
 {
-    int i, module_found = 0;
-    struct Module *module = (struct Module *)MODULES;
-    struct Module *rmmod = NULL;
+    struct Module *rmmod;
+
+    module_reap();
 
     // Get a pointer to this module
-    for (i = 0; i < MAX_MODULES; i++) {
-	if (strcmp(module[i].module_name, mod_name) == 0) {
-	    rmmod = &module[i];
-	    module_found = 1;
-	}
+    if ((rmmod = module_lookup(mod_name)) == NULL) {
+	cprintf("module_cleanup: cannot find module %s\n", mod_name);
+	return -E_NOT_FOUND;
     }
 
-    if (!module_found) {
-	cprintf("module_cleanup: cannot find module %s\n", mod_name);
+    module_unload(rmmod);
+
+    return 0;
+}
+
+//
+// Replace a loaded module with a new version of it, read from 'src',
+// without a moment where its hooks are not there. The new module is
+// loaded next to the old one, and its migrate_module routine, if it has
+// one, is called with both module indices to take over the old module's
+// state. The old module's exports are still in the kernel symbol table at
+// that point. Then every hook of the old module is swapped for the new
+// module's hook of the same type with a single pointer store, and the
+// exports and scheduler class follow. The old module is unloaded as
+// usual, which frees it once calls still running in it have returned.
+//
+int
+module_replace (char *mod_name, struct Module_source *src)
+{
+    struct Module *old, *new;
+    struct Sched_class *sc;
+    uint64_t start;
+    int type, ret, active;
+
+    module_reap();
+
+    if ((old = module_lookup(mod_name)) == NULL) {
+	cprintf("module_replace: cannot find module %s\n", mod_name);
 	return -E_NOT_FOUND;
     }
 
-    // Update the bitmap
-    module_bitmap &= ~(1 << rmmod->module_index);
+    if ((ret = module_link(mod_name, src, old, &new)) < 0) {
+	return ret;
+    }
 
-    // Call the module's cleanup routine
-    rmmod->cleanup_routine(rmmod->module_index);
+    // Hand the state over
+    if (new->migrate_routine) {
+	start = read_tsc();
+	ret = MODULE_CALL(new->migrate_routine(new->module_index,
+						 old->module_index));
+	module_account(&new->module_cost[MODULE_COST_MIGRATE],
+		       read_tsc() - start);
+    }
 
-    // Zero out the corresponding module data section
-    memset((void *)rmmod->module_base, 0, PGSIZE);
+    if (ret < 0) {
+	cprintf("module_replace: new %s can't take over, keeping the old one\n",
+		mod_name);
+	module_unload(new);
+	return ret;
+    }
 
-    // Zero out the module descriptor
-    memset((void *)rmmod, 0, PGSIZE);
+    // Switch over
+    new->module_state = MODULE_STATE_ACTIVE;
 
-    // Update the module count
-    module_count--;
+    for (type = 0; type < MODULE_HOOK_TYPES; type++) {
+	module_hook_switch(type, old, new);
+    }
+
+    ksym_remove_bulk(old->module_exports, old->module_export_count,
+		     old->module_index);
+    ksym_insert_bulk(new->module_exports, new->module_export_count,
+		     new->module_index);
+
+    //
+    // Scheduler classes are looked up by name, so the new class can only
+    // be registered once the old one is gone. Select it if the old one
+    // was in use.
+    //
+    sc = new->module_vectors.sched_class_vector;
+    active = sched_class->sc_module == (int)old->module_index;
+    sched_class_unregister_module(old->module_index);
+
+    if (sc) {
+	if (sched_class_register(sc, new->module_index) < 0) {
+	    new->module_vectors.sched_class_vector = NULL;
+	} else if (active) {
+	    sched_set_policy(sc->sc_name);
+	}
+    }
+
+    module_unload(old);
 
     return 0;
 }
 
+// Upper bound of the call time, in cycles, that 'pct' percent of calls fit in
+static uint64_t
+module_cost_percentile (struct Module_cost *mt, int pct)
+{
+    return loghist_percentile(mt->mt_hist, MODULE_COST_BUCKETS,
+			      MODULE_COST_SHIFT, mt->mt_max, pct);
+}
+
+//
+// Show what the calls into a module cost, one line per kind of call that
+// was made. Times are in TSC cycles, the total in units of 1024. P50 and
+// P99 are bucket bounds of the call time histogram, whose buckets start at
+// 2^MODULE_COST_SHIFT cycles; the scheduler's wait histograms start
+// higher, so the two do not line up bucket for bucket.
+//
+static void
+module_display_cost (struct Module *module)
+{
+    static const char *slot_names[MODULE_COST_SLOTS] = {
+	[MODULE_SHOW_SYSCALL]	= "show_syscall",
+	[MODULE_COUNT_SYSCALL]	= "count_syscall",
+	[MODULE_SHOW_TIME]	= "show_time",
+	[MODULE_TEST_API]	= "test_api",
+	[MODULE_SCHED_CLASS]	= "sched_class",
+	[MODULE_TIMER_TICK]	= "timer_tick",
+	[MODULE_SHOW_PROFILE]	= "show_profile",
+	[MODULE_COST_INIT]	= "init",
+	[MODULE_COST_MIGRATE]	= "migrate",
+    };
+    struct Module_cost *mt;
+    int i;
+
+    cprintf("Call Costs \t : log2 buckets from %u cycles\n",
+	    1 << MODULE_COST_SHIFT);
+    cprintf("\t\t   %-13s %8s %9s %7s %7s %7s %8s\n", "CALL",
+	    "CALLS", "TOTAL/1K", "AVG", "P50", "P99", "MAX");
+
+    for (i = 0; i < MODULE_COST_SLOTS; i++) {
+	mt = &module->module_cost[i];
+	if (mt->mt_calls == 0) {
+	    continue;
+	}
+
+	cprintf("\t\t   %-13s %8u %9u %7u %7u %7u %8u\n", slot_names[i],
+		mt->mt_calls, (uint32_t)(mt->mt_cycles >> 10),
+		(uint32_t)(mt->mt_cycles / mt->mt_calls),
+		(uint32_t)module_cost_percentile(mt, 50),
+		(uint32_t)module_cost_percentile(mt, 99),
+		(uint32_t)mt->mt_max);
+    }
+}
+
 // Routine to display the list of modules currently loaded
 int
 module_display (void)
 {
-    struct Module *module = (struct Module *)MODULES;
-    int i;
+    struct Module *module;
 
     if (module_count == 0) {
 	cprintf("\nThere are no modules loaded in kernel\n");
 	return 0;
     }
 
-    cprintf("\nTotal number of modules: %d\n\n", module_count);
+    cprintf("\nTotal number of modules: %d\n", module_count);
+    cprintf("Cached module images: %d\n\n", module_cache_count);
+
+    for (module = modules; module != NULL; module = module->module_next) {
+	cprintf("Name \t\t : %s\n", module->module_name);
+	cprintf("Index \t\t : %d\n", module->module_index);
+	cprintf("Base Address \t : 0x%x\n", module->module_base);
+	cprintf("Size \t\t : %d bytes\n", module->module_size);
+	cprintf("Pages \t\t : %d (%d text)\n", module->module_pages,
+		module->module_text_pages);
+	cprintf("Module Entry \t : 0x%x\n", module->init_routine);
+	cprintf("Module Exit \t : 0x%x\n", module->cleanup_routine);
+	cprintf("No of Sections \t : %d\n", module->module_sh_count);
+	cprintf("No of Relocations     : %d\n", module->module_rel_count);
+	cprintf("No of Symbols \t : %d\n", module->module_sym_count);
+	cprintf("No of Exports \t : %d\n", module->module_export_count);
+	cprintf("No of Imports \t : %d bound at load, %d lazily (%d bound)\n",
+		module->module_eager_count, module->module_lazy_count,
+		module->module_lazy_bound);
+	module_display_cost(module);
+	cprintf("\n");
+    }
+
+    return 0;
+}
+
+//
+// Time loading the module image at mod_binary 'runs' times over, both
+// from scratch, which is mostly reading and relocating the ELF image,
+// and from the cache of relocated images. The time the module's own
+// init and test routines take is not counted. Prints a line starting
+// with MODULEBENCH for each of the two, in the same key=value format as
+// the scheduler benchmarks. Times are in TSC cycles.
+//
+int
+module_bench (char *mod_name, void *mod_binary, uint32_t mod_binary_size,
+	      int runs)
+{
+    static const char *kind_names[2] = { "cold", "cached" };
+    struct Module_cache **link;
+    struct Module *module;
+    uint64_t start, cycles, total, min, max;
+    uint32_t relocs = 0;
+    int kind, i, ret;
+
+    if (runs <= 0) {
+	return -E_INVAL;
+    }
+
+    if (module_lookup(mod_name) != NULL) {
+	cprintf("module_bench: module %s is loaded, unload it first\n",
+		mod_name);
+	return -E_FILE_EXISTS;
+    }
+
+    for (kind = 0; kind < 2; kind++) {
+	total = max = 0;
+	min = ~(uint64_t)0;
+
+	for (i = 0; i < runs; i++) {
+	    // Cold loads must not find the image in the cache
+	    for (link = &module_cache; kind == 0 && *link != NULL; ) {
+		if (strcmp((*link)->mc_name, mod_name) == 0) {
+		    module_cache_drop(link);
+		} else {
+		    link = &(*link)->mc_next;
+		}
+	    }
+
+	    start = read_tsc();
+	    if ((ret = module_init(mod_name, mod_binary, mod_binary_size)) < 0) {
+		return ret;
+	    }
+	    cycles = read_tsc() - start;
+
+	    module = module_lookup(mod_name);
+	    cycles -= module->module_cost[MODULE_COST_INIT].mt_cycles +
+		      module->module_cost[MODULE_TEST_API].mt_cycles;
+	    relocs = module->module_rel_count;
 
-    for (i = 0; i < MAX_MODULES; i++) {
-	if (module[i].module_state == MODULE_STATE_ACTIVE) {
-	    cprintf("Name \t\t : %s\n", module[i].module_name);
-	    cprintf("Index \t\t : %d\n", module[i].module_index);
-	    cprintf("Base Address \t : 0x%x\n", module[i].module_base);
-	    cprintf("Size \t\t : %d bytes\n", module[i].module_size);
-	    cprintf("Module Entry \t : 0x%x\n", module[i].init_routine);
-	    cprintf("Module Exit \t : 0x%x\n", module[i].cleanup_routine);
-	    cprintf("No of Sections \t : %d\n", module[i].module_sh_count);
-	    cprintf("No of Relocations     : %d\n", module[i].module_rel_count);
-	    cprintf("No of Symbols \t : %d\n", module[i].module_sym_count);
-	    cprintf("\n");
+	    module_cleanup(mod_name);
+
+	    total += cycles;
+	    if (cycles < min) {
+		min = cycles;
+	    }
+	    if (cycles > max) {
+		max = cycles;
+	    }
 	}
+
+	cprintf("MODULEBENCH load name=%s kind=%s runs=%d size=%u relocs=%u "
+		"min=%llu avg=%llu max=%llu\n", mod_name, kind_names[kind],
+		runs, mod_binary_size, relocs, min, total / runs, max);
     }
 
     return 0;
@@ -500,72 +1889,126 @@ module_invoke_test_syscall (void)
 void
 module_register (uint32_t mod_index, int type, void *vector)
 {
-    struct Module *modules = (struct Module *)MODULES;
+    struct Module *module = module_lookup_index(mod_index);
 
-    cprintf("module_register: module %d type %d vector 0x%x\n", 
-	    mod_index, type, vector);
+    TRACE(TRACE_CAT_MODULE, TRACE_MODULE_REGISTER, mod_index, type, vector);
+
+    if (module == NULL) {
+	cprintf("module_register: no module with index %d\n", mod_index);
+	return;
+    }
 
     if (type == MODULE_SHOW_SYSCALL) {
-	modules[mod_index].module_vectors.show_syscall_vector = vector;
+	module->module_vectors.show_syscall_vector = vector;
     } else if (type == MODULE_COUNT_SYSCALL) {
-	modules[mod_index].module_vectors.count_syscall_vector = vector;
+	module->module_vectors.count_syscall_vector = vector;
     } else if (type == MODULE_SHOW_TIME) {
-	modules[mod_index].module_vectors.show_time_vector = vector;
+	module->module_vectors.show_time_vector = vector;
     } else if (type == MODULE_TEST_API) {
-	modules[mod_index].module_vectors.test_api_vector = vector;
+	module->module_vectors.test_api_vector = vector;
+    } else if (type == MODULE_SCHED_CLASS) {
+	//
+	// The vector is a struct Sched_class. It only becomes the active
+	// policy once it is selected with sched_set_policy().
+	//
+	if (module->module_state == MODULE_STATE_STANDBY) {
+	    // Registered by module_replace()
+	    module->module_vectors.sched_class_vector = vector;
+	} else if (sched_class_register(vector, mod_index) == 0) {
+	    module->module_vectors.sched_class_vector = vector;
+	}
+	return;
+    } else if (type == MODULE_TIMER_TICK) {
+	module->module_vectors.timer_tick_vector = vector;
+    } else if (type == MODULE_SHOW_PROFILE) {
+	module->module_vectors.show_profile_vector = vector;
+    } else {
+	cprintf("module_register: unknown type %d\n", type);
+	return;
     }
+
+    // Make the kernel call it
+    module_hook_add(type, module, vector);
 }
 
-// Debug routines to test the syscall module
+//
+// Choose whether modules loaded from now on call imported functions
+// through lazy binding stubs, or have every import bound at load time.
+//
+void
+module_set_lazy_binding (int on)
+{
+    module_lazy_binding = on;
+}
 
+//
+// Call every hook registered for the given API type. This sits on hot
+// paths like the syscall path, so there is no lookup by module name here.
+//
 void
-module_invoke_count_syscall (void)
+module_invoke_hooks (int type)
 {
-    struct Module *modules = (struct Module *)MODULES;
-    int module_index = -1, i = 0;
+    struct Module_hook *mh;
+    struct Module *module;
+    uint64_t start;
+    int cpu;
 
-    // Find the syscall module
-    for (i = 0; i < MAX_MODULES; i++) {
-	if (strcmp(modules[i].module_name, "testmod_syscall.o") == 0) {
-	    module_index = modules[i].module_index;
-	    break;
+    cpu = module_walk_enter();
+    for (mh = module_hooks[type]; mh != NULL; mh = mh->mh_next) {
+	if ((module = mh->mh_module) == NULL) {
+	    continue;
 	}
-    }
 
-    if (module_index == -1) {
-	// Module not present. Nothing much we can do.
-	return;
+	start = read_tsc();
+	mh->mh_vector();
+	module_account(&module->module_cost[type], read_tsc() - start);
     }
 
-    // Invoke the module
-    if (modules[i].module_vectors.count_syscall_vector) {
-	modules[i].module_vectors.count_syscall_vector();
-    }
+    module_walk_exit(cpu);
 }
 
+//
+// Called from the timer interrupt, before sched_tick(), with the trap
+// frame of whatever was interrupted. Timer hooks get the frame, e.g. to
+// sample where the CPU was.
+//
 void
-module_invoke_show_syscall (void)
+module_invoke_timer_tick (struct Trapframe *tf)
 {
-    struct Module *modules = (struct Module *)MODULES;
-    int module_index = -1, i = 0;
-
-    // Find the syscall module
-    for (i = 0; i < MAX_MODULES; i++) {
-	if (strcmp(modules[i].module_name, "testmod_syscall.o") == 0) {
-	    module_index = modules[i].module_index;
-	    break;
+    struct Module_hook *mh;
+    struct Module *module;
+    uint64_t start;
+    int (*vector)(struct Trapframe *);
+    int cpu;
+
+    cpu = module_walk_enter();
+    for (mh = module_hooks[MODULE_TIMER_TICK]; mh != NULL; mh = mh->mh_next) {
+	if ((module = mh->mh_module) == NULL) {
+	    continue;
 	}
-    }
 
-    if (module_index == -1) {
-	// Module not present. Nothing much we can do.
-	return;
+	vector = (int (*)(struct Trapframe *))mh->mh_vector;
+	start = read_tsc();
+	vector(tf);
+	module_account(&module->module_cost[MODULE_TIMER_TICK],
+		       read_tsc() - start);
     }
 
-    // Invoke the module
-    if (modules[i].module_vectors.show_syscall_vector) {
-	modules[i].module_vectors.show_syscall_vector();
-    }
+    module_walk_exit(cpu);
+}
+
+// Debug routines to test the syscall module
+
+void
+module_invoke_count_syscall (void)
+{
+    module_invoke_hooks(MODULE_COUNT_SYSCALL);
+}
+
+void
+module_invoke_show_syscall (void)
+{
+    module_invoke_hooks(MODULE_SHOW_SYSCALL);
 }
 
 // Debug routines to test the show_time module
@@ -573,26 +2016,15 @@ module_invoke_show_syscall (void)
 void
 module_invoke_show_time (void)
 {
-    struct Module *modules = (struct Module *)MODULES;
-    int module_index = -1, i = 0;
-
-    // Find the show_time module
-    for (i = 0; i < MAX_MODULES; i++) {
-	if (strcmp(modules[i].module_name, "testmod_showtime.o") == 0) {
-	    module_index = modules[i].module_index;
-	    break;
-	}
-    }
+    module_invoke_hooks(MODULE_SHOW_TIME);
+}
 
-    if (module_index == -1) {
-	// Module not present. Nothing much we can do.
-	return;
-    }
+// Have the profiler module print what it found
 
-    // Invoke the module
-    if (modules[i].module_vectors.show_time_vector) {
-	modules[i].module_vectors.show_time_vector();
-    }
+void
+module_invoke_show_profile (void)
+{
+    module_invoke_hooks(MODULE_SHOW_PROFILE);
 }
 
 // End of File
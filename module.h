@@ -3,59 +3,82 @@
 
 // Defines
 
-#define MAX_MODULES		16
 #define MAX_MODULE_NAMELEN	32
-#define MAX_SECTION_NAMELEN	16
-#define MAX_SYM_NAMELEN		16
-#define MAX_SECTIONS		10
-#define MAX_MD_SIZE		4096
-#define MAX_REL_ENTRIES		100
-#define MAX_SYM_TABLE_SIZE	100
 
 #define INVALID_MODULE_INDEX	-1
 
-// Section identifiers
-#define SECTION_NULL		0
-#define SECTION_TEXT		1
-#define SECTION_RODATA		2
-#define	SECTION_BSS		3
-#define	SECTION_DATA		4
-#define	SECTION_REL		5
-#define	SECTION_SYMTAB		6
-#define	SECTION_STRTAB		7
-#define	SECTION_SHSTRTAB	8
+//
+// Module images are loaded into this window, starting at MODULE_DATA.
+// Memory is handed out in page sized chunks, so a module can be as large
+// as the window allows. memlayout.h can make the window bigger.
+//
+#ifndef MODULE_DATA_SIZE
+#define MODULE_DATA_SIZE	PTSIZE
+#endif
+#define MODULE_DATA_PAGES	(MODULE_DATA_SIZE / PGSIZE)
 
 // Different API types exposed by the modules
 #define MODULE_SHOW_SYSCALL	0
 #define MODULE_COUNT_SYSCALL	1
 #define MODULE_SHOW_TIME	2
 #define MODULE_TEST_API		3
+#define MODULE_SCHED_CLASS	4
+#define MODULE_TIMER_TICK	5
+#define MODULE_SHOW_PROFILE	6
+
+//
+// Number of API types. All but MODULE_SCHED_CLASS are function hooks the
+// kernel calls.
+//
+#define MODULE_HOOK_TYPES	7
+
+//
+// Calls into a module are timed, per API type and for its own init and
+// migrate routines. The cleanup routine is timed too, but the descriptor
+// is gone by then, so that is only printed.
+//
+#define MODULE_COST_INIT	MODULE_HOOK_TYPES
+#define MODULE_COST_MIGRATE	(MODULE_HOOK_TYPES + 1)
+#define MODULE_COST_SLOTS	(MODULE_HOOK_TYPES + 2)
+
+// Call time histogram: bucket b counts calls of 2^(b + SHIFT) cycles or
+// more, bucket 0 everything shorter than that too. Calls are much shorter
+// than scheduler waits, so the buckets start lower than SCHED_WAIT_SHIFT.
+#define MODULE_COST_BUCKETS	16
+#define MODULE_COST_SHIFT	6
 
 // Data Structures
 
+struct Sched_class;
+struct Trapframe;
+struct Ksym_def;
+struct Module;
+
 enum Module_state {
     MODULE_STATE_INIT,
     MODULE_STATE_ACTIVE,
-    MODULE_STATE_DELETED
-};
-
-struct Section {
-    char	sh_name[MAX_SECTION_NAMELEN];
-    uint32_t	sh_start;
-    uint32_t	sh_size;
-    uint32_t	sh_type;
-    uint32_t	sh_offset;
+    MODULE_STATE_DELETED,
+    MODULE_STATE_STANDBY,	// Loaded to replace a module, not in use yet
+    MODULE_STATE_RETIRED	// Unloaded, waiting for its callers to leave
 };
 
-struct RelText {
-    uint32_t	    rel_offset;
-    uint32_t	    rel_type;
-    char	    sym_name[MAX_SYM_NAMELEN];
+//
+// A hook registered by a module. The hooks of one API type are chained
+// together, so dispatching is a walk over the chain. Every module has one
+// of these per API type; mh_module is NULL when it is not registered.
+//
+struct Module_hook {
+    int		    (*mh_vector)(void);
+    struct Module   *mh_module;
+    struct Module_hook *mh_next;
 };
 
-struct SymTab {
-    char	    sym_name[MAX_SYM_NAMELEN];
-    uint32_t	    sym_value;
+// What the calls of one kind into a module cost, in TSC cycles
+struct Module_cost {
+    uint32_t		mt_calls;
+    uint64_t		mt_cycles;
+    uint64_t		mt_max;
+    uint32_t		mt_hist[MODULE_COST_BUCKETS];
 };
 
 struct module_vectors {
@@ -63,8 +86,17 @@ struct module_vectors {
     int             (*count_syscall_vector)(void);
     int		    (*show_time_vector)(void);
     int		    (*test_api_vector)(void);
+    struct Sched_class	*sched_class_vector;
+    int		    (*timer_tick_vector)(struct Trapframe *tf);
+    int		    (*show_profile_vector)(void);
 };
 
+//
+// A loaded module. The descriptor lives in the module's own memory, right
+// after its data, followed by the table of symbols it exports, the table
+// of functions its lazy binding stubs call, and their names. Nothing else
+// is kept once the module is linked.
+//
 struct Module {
     char		    module_name[MAX_MODULE_NAMELEN];
     uint32_t		    module_index;
@@ -72,23 +104,53 @@ struct Module {
     int			    module_state;
     int			    (*init_routine)(uint32_t);
     int			    (*cleanup_routine)(uint32_t);
+    int			    (*migrate_routine)(uint32_t, uint32_t);
     uint32_t		    module_base;
+    uint32_t		    module_pages;	// Pages mapped at module_base
+    uint32_t		    module_text_pages;	// Read-only pages at the start
     uint32_t		    module_sh_count;
     uint32_t		    module_rel_count;
     uint32_t		    module_sym_count;
-    struct Section	    sections[MAX_SECTIONS];
-    struct RelText	    rel_entry[MAX_REL_ENTRIES];
-    struct SymTab	    sym_table[MAX_SYM_TABLE_SIZE];
+    uint32_t		    module_export_count;
+    struct Ksym_def	    *module_exports;	// In the kernel symbol table
+    uint32_t		    module_eager_count;	// Imports bound at load time
+    uint32_t		    module_lazy_count;	// Imports called through stubs
+    uint32_t		    module_lazy_bound;	// Stubs that have been called
+    struct Ksym_def	    *module_lazy;	// Functions the stubs call
+    uint32_t		    module_plt;		// The stubs
+    uint32_t		    *module_got;	// Where the stubs jump to
     struct module_vectors   module_vectors;
+    struct Module_hook	    module_hook[MODULE_HOOK_TYPES];
+    uint32_t		    module_walkers;	// CPUs that may be on its hooks
+    struct Module_cost	    module_cost[MODULE_COST_SLOTS];
+    struct Module	    *module_next;
+};
+
+//
+// Where module_load() reads a module's ELF image from, e.g. a file or an
+// IPC stream. ms_read copies 'len' bytes at 'offset' in the image to
+// 'buf' and returns 0, or a negative error code. ms_size is the size of
+// the image.
+//
+struct Module_source {
+    int		    (*ms_read)(void *arg, uint32_t offset, void *buf,
+			       uint32_t len);
+    void	    *ms_arg;
+    uint32_t	    ms_size;
 };
 
 extern struct Module *modules;
 extern void *module_data;
+extern struct Module_hook *module_hooks[];
 
 // Function Prototypes
 
 int module_init (char *mod_name, void *mod_binary, uint32_t mod_binary_size);
+int module_load (char *mod_name, struct Module_source *src);
 int module_cleanup (char *mod_name);
+int module_replace (char *mod_name, struct Module_source *src);
+int module_bench (char *mod_name, void *mod_binary, uint32_t mod_binary_size,
+		  int runs);
 int module_display (void);
 int module_invoke_insmod (void);
 int module_invoke_rmmod (void);
@@ -97,5 +159,9 @@ void module_register (uint32_t mod_index, int type, void *vector);
 void module_invoke_count_syscall (void);
 void module_invoke_show_syscall (void);
 void module_invoke_show_time (void);
+void module_invoke_hooks (int type);
+void module_invoke_timer_tick (struct Trapframe *tf);
+void module_invoke_show_profile (void);
+void module_set_lazy_binding (int on);
 
 #endif // !JOS_KERN_MODULE_H
@@ -0,0 +1,354 @@
+#include <inc/stdio.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <kern/pfilter.h>
+
+//
+// Packet filter machine, run by the network drivers on every frame they
+// receive before it is copied anywhere. This is classic BPF: an
+// accumulator A, an index register X, a few words of scratch memory, and
+// the packet, which can only be read.
+//
+// Programs are checked once, when they are loaded, so the interpreter does
+// not have to. Jumps only go forward and every program ends in a return,
+// so a program runs at most as many instructions as it has, and always
+// returns. The only checks left for run time are the bounds of packet
+// loads and division by X. A load past the end of the packet drops it.
+//
+// Filters that only look at the ethertype are by far the most common ones.
+// pfilter_load() spots them and runs them without the interpreter.
+//
+
+//
+// Check that a program is safe to run. Returns 0 if it is, or -E_INVAL
+// saying which instruction is not.
+//
+int
+pfilter_verify (const struct Pf_insn *insns, uint32_t len)
+{
+    const struct Pf_insn *pi;
+    uint32_t i, left;
+
+    if (len == 0 || len > PFILTER_MAX_INSNS) {
+	cprintf("pfilter_verify: bad program length %d\n", len);
+	return -E_INVAL;
+    }
+
+    for (i = 0; i < len; i++) {
+	pi = &insns[i];
+
+	// Instructions left after this one, for the jumps
+	left = len - i - 1;
+
+	if (pi->pi_code > 0xff) {
+	    goto bad;
+	}
+
+	switch (PF_CLASS(pi->pi_code)) {
+	case PF_LD:
+	    switch (PF_MODE(pi->pi_code)) {
+	    case PF_ABS:
+	    case PF_IND:
+		if (PF_SIZE(pi->pi_code) == 0x18) {
+		    goto bad;
+		}
+		break;
+	    case PF_MEM:
+		if (pi->pi_k >= PFILTER_MEMWORDS) {
+		    goto bad;
+		}
+		// Fall through
+	    case PF_IMM:
+	    case PF_LEN:
+		if (PF_SIZE(pi->pi_code) != PF_W) {
+		    goto bad;
+		}
+		break;
+	    default:
+		goto bad;
+	    }
+	    break;
+
+	case PF_LDX:
+	    if (pi->pi_code == (PF_LDX | PF_MEM) &&
+		pi->pi_k >= PFILTER_MEMWORDS) {
+		goto bad;
+	    }
+	    if (pi->pi_code != (PF_LDX | PF_W | PF_IMM) &&
+		pi->pi_code != (PF_LDX | PF_W | PF_MEM) &&
+		pi->pi_code != (PF_LDX | PF_W | PF_LEN) &&
+		pi->pi_code != (PF_LDX | PF_B | PF_MSH)) {
+		goto bad;
+	    }
+	    break;
+
+	case PF_ST:
+	case PF_STX:
+	    if ((pi->pi_code & ~0x07) != 0 || pi->pi_k >= PFILTER_MEMWORDS) {
+		goto bad;
+	    }
+	    break;
+
+	case PF_ALU:
+	    if (PF_OP(pi->pi_code) > PF_NEG) {
+		goto bad;
+	    }
+	    if (pi->pi_code == (PF_ALU | PF_DIV | PF_K) && pi->pi_k == 0) {
+		goto bad;
+	    }
+	    if ((pi->pi_code == (PF_ALU | PF_LSH | PF_K) ||
+		 pi->pi_code == (PF_ALU | PF_RSH | PF_K)) && pi->pi_k >= 32) {
+		goto bad;
+	    }
+	    break;
+
+	case PF_JMP:
+	    if (PF_OP(pi->pi_code) == PF_JA) {
+		if (pi->pi_code != (PF_JMP | PF_JA) || pi->pi_k >= left) {
+		    goto bad;
+		}
+	    } else if (PF_OP(pi->pi_code) > PF_JSET ||
+		       pi->pi_jt >= left || pi->pi_jf >= left) {
+		goto bad;
+	    }
+	    break;
+
+	case PF_RET:
+	    if (pi->pi_code != (PF_RET | PF_K) &&
+		pi->pi_code != (PF_RET | PF_A)) {
+		goto bad;
+	    }
+	    break;
+
+	case PF_MISC:
+	    if (pi->pi_code != (PF_MISC | PF_TAX) &&
+		pi->pi_code != (PF_MISC | PF_TXA)) {
+		goto bad;
+	    }
+	    break;
+	}
+    }
+
+    // Falling off the end is not allowed
+    if (PF_CLASS(insns[len - 1].pi_code) != PF_RET) {
+	cprintf("pfilter_verify: program does not end with a return\n");
+	return -E_INVAL;
+    }
+
+    return 0;
+
+bad:
+    cprintf("pfilter_verify: bad instruction %d (code 0x%x, k %d)\n",
+	    i, pi->pi_code, pi->pi_k);
+    return -E_INVAL;
+}
+
+//
+// Verify a program and make it the one 'pf' runs. A zero length program
+// removes the filter, so that everything is accepted.
+//
+int
+pfilter_load (struct Pfilter *pf, const struct Pf_insn *insns, uint32_t len)
+{
+    const struct Pf_insn *ld, *jeq;
+    int r;
+
+    if (len == 0) {
+	pf->pf_len = 0;
+	pf->pf_fast = PFILTER_FAST_NONE;
+	return 0;
+    }
+
+    if ((r = pfilter_verify(insns, len)) < 0) {
+	return r;
+    }
+
+    memmove(pf->pf_insns, insns, len * sizeof(struct Pf_insn));
+    pf->pf_len = len;
+    pf->pf_fast = PFILTER_FAST_NONE;
+
+    // Look for the programs with a fast path
+    if (len == 1 && insns[0].pi_code == (PF_RET | PF_K)) {
+	pf->pf_fast = PFILTER_FAST_CONST;
+	pf->pf_match = insns[0].pi_k;
+    } else if (len == 4) {
+	ld = &insns[0];
+	jeq = &insns[1];
+
+	if (ld->pi_code == (PF_LD | PF_H | PF_ABS) &&
+	    ld->pi_k == PFILTER_ETHERTYPE_OFF &&
+	    jeq->pi_code == (PF_JMP | PF_JEQ | PF_K) && jeq->pi_k <= 0xffff &&
+	    insns[2].pi_code == (PF_RET | PF_K) &&
+	    insns[3].pi_code == (PF_RET | PF_K)) {
+	    pf->pf_fast = PFILTER_FAST_ETHERTYPE;
+	    pf->pf_type = jeq->pi_k;
+	    pf->pf_match = insns[2 + jeq->pi_jt].pi_k;
+	    pf->pf_nomatch = insns[2 + jeq->pi_jf].pi_k;
+	}
+    }
+
+    return 0;
+}
+
+//
+// Run a filter on a packet and return its verdict: PFILTER_DROP,
+// PFILTER_ACCEPT, or the class to steer it to. Without a filter every
+// packet is accepted.
+//
+uint32_t
+pfilter_run (const struct Pfilter *pf, const uint8_t *pkt, uint32_t len)
+{
+    const struct Pf_insn *pi;
+    uint32_t A = 0, X = 0, k, size;
+    uint32_t mem[PFILTER_MEMWORDS];
+
+    switch (pf->pf_fast) {
+    case PFILTER_FAST_CONST:
+	return pf->pf_match;
+    case PFILTER_FAST_ETHERTYPE:
+	if (len < PFILTER_ETHERTYPE_OFF + 2) {
+	    return PFILTER_DROP;
+	}
+	return ((pkt[PFILTER_ETHERTYPE_OFF] << 8 |
+		 pkt[PFILTER_ETHERTYPE_OFF + 1]) == pf->pf_type) ?
+	       pf->pf_match : pf->pf_nomatch;
+    }
+
+    if (pf->pf_len == 0) {
+	return PFILTER_ACCEPT;
+    }
+
+    memset(mem, 0, sizeof(mem));
+
+    for (pi = pf->pf_insns; ; pi++) {
+	k = pi->pi_k;
+
+	switch (pi->pi_code) {
+	// Loads from the packet. Multi byte values are in network order.
+	case PF_LD | PF_W | PF_IND:
+	case PF_LD | PF_H | PF_IND:
+	case PF_LD | PF_B | PF_IND:
+	    if (k + X < k) {
+		return PFILTER_DROP;
+	    }
+	    k += X;
+	    // Fall through
+	case PF_LD | PF_W | PF_ABS:
+	case PF_LD | PF_H | PF_ABS:
+	case PF_LD | PF_B | PF_ABS:
+	    size = (PF_SIZE(pi->pi_code) == PF_W) ? 4 :
+		   (PF_SIZE(pi->pi_code) == PF_H) ? 2 : 1;
+	    if (k > len || size > len - k) {
+		return PFILTER_DROP;
+	    }
+	    for (A = 0; size > 0; size--) {
+		A = A << 8 | pkt[k++];
+	    }
+	    break;
+	case PF_LDX | PF_B | PF_MSH:
+	    if (k >= len) {
+		return PFILTER_DROP;
+	    }
+	    X = (pkt[k] & 0xf) << 2;
+	    break;
+
+	// Other loads and stores
+	case PF_LD | PF_IMM:
+	    A = k;
+	    break;
+	case PF_LD | PF_LEN:
+	    A = len;
+	    break;
+	case PF_LD | PF_MEM:
+	    A = mem[k];
+	    break;
+	case PF_LDX | PF_IMM:
+	    X = k;
+	    break;
+	case PF_LDX | PF_LEN:
+	    X = len;
+	    break;
+	case PF_LDX | PF_MEM:
+	    X = mem[k];
+	    break;
+	case PF_ST:
+	    mem[k] = A;
+	    break;
+	case PF_STX:
+	    mem[k] = X;
+	    break;
+
+	// Arithmetic
+	case PF_ALU | PF_ADD | PF_X:	A += X; break;
+	case PF_ALU | PF_SUB | PF_X:	A -= X; break;
+	case PF_ALU | PF_MUL | PF_X:	A *= X; break;
+	case PF_ALU | PF_OR | PF_X:	A |= X; break;
+	case PF_ALU | PF_AND | PF_X:	A &= X; break;
+	case PF_ALU | PF_LSH | PF_X:	A = (X < 32) ? A << X : 0; break;
+	case PF_ALU | PF_RSH | PF_X:	A = (X < 32) ? A >> X : 0; break;
+	case PF_ALU | PF_ADD | PF_K:	A += k; break;
+	case PF_ALU | PF_SUB | PF_K:	A -= k; break;
+	case PF_ALU | PF_MUL | PF_K:	A *= k; break;
+	case PF_ALU | PF_DIV | PF_K:	A /= k; break;
+	case PF_ALU | PF_OR | PF_K:	A |= k; break;
+	case PF_ALU | PF_AND | PF_K:	A &= k; break;
+	case PF_ALU | PF_LSH | PF_K:	A <<= k; break;
+	case PF_ALU | PF_RSH | PF_K:	A >>= k; break;
+	case PF_ALU | PF_NEG:
+	case PF_ALU | PF_NEG | PF_X:	A = -A; break;
+	case PF_ALU | PF_DIV | PF_X:
+	    if (X == 0) {
+		return PFILTER_DROP;
+	    }
+	    A /= X;
+	    break;
+
+	// Jumps. The offsets are relative to the next instruction.
+	case PF_JMP | PF_JA:
+	    pi += k;
+	    break;
+	case PF_JMP | PF_JEQ | PF_K:
+	    pi += (A == k) ? pi->pi_jt : pi->pi_jf;
+	    break;
+	case PF_JMP | PF_JGT | PF_K:
+	    pi += (A > k) ? pi->pi_jt : pi->pi_jf;
+	    break;
+	case PF_JMP | PF_JGE | PF_K:
+	    pi += (A >= k) ? pi->pi_jt : pi->pi_jf;
+	    break;
+	case PF_JMP | PF_JSET | PF_K:
+	    pi += (A & k) ? pi->pi_jt : pi->pi_jf;
+	    break;
+	case PF_JMP | PF_JEQ | PF_X:
+	    pi += (A == X) ? pi->pi_jt : pi->pi_jf;
+	    break;
+	case PF_JMP | PF_JGT | PF_X:
+	    pi += (A > X) ? pi->pi_jt : pi->pi_jf;
+	    break;
+	case PF_JMP | PF_JGE | PF_X:
+	    pi += (A >= X) ? pi->pi_jt : pi->pi_jf;
+	    break;
+	case PF_JMP | PF_JSET | PF_X:
+	    pi += (A & X) ? pi->pi_jt : pi->pi_jf;
+	    break;
+
+	case PF_RET | PF_K:
+	    return k;
+	case PF_RET | PF_A:
+	    return A;
+
+	case PF_MISC | PF_TAX:
+	    X = A;
+	    break;
+	case PF_MISC | PF_TXA:
+	    A = X;
+	    break;
+
+	default:
+	    // pfilter_verify() lets nothing else through
+	    return PFILTER_DROP;
+	}
+    }
+}
+
+// End of File
@@ -0,0 +1,122 @@
+#ifndef JOS_KERN_PFILTER_H
+#define JOS_KERN_PFILTER_H
+
+#include <inc/types.h>
+
+// Defines
+
+//
+// Packet filter instructions use the classic BPF encoding, so the output
+// of "tcpdump -dd" can be loaded as is. An instruction code is made of a
+// class, and a size and addressing mode or an operation and a source.
+//
+#define PF_CLASS(code)		((code) & 0x07)
+#define PF_LD			0x00
+#define PF_LDX			0x01
+#define PF_ST			0x02
+#define PF_STX			0x03
+#define PF_ALU			0x04
+#define PF_JMP			0x05
+#define PF_RET			0x06
+#define PF_MISC			0x07
+
+// Load sizes
+#define PF_SIZE(code)		((code) & 0x18)
+#define PF_W			0x00
+#define PF_H			0x08
+#define PF_B			0x10
+
+// Load addressing modes
+#define PF_MODE(code)		((code) & 0xe0)
+#define PF_IMM			0x00
+#define PF_ABS			0x20
+#define PF_IND			0x40
+#define PF_MEM			0x60
+#define PF_LEN			0x80
+#define PF_MSH			0xa0
+
+// ALU operations and jump conditions
+#define PF_OP(code)		((code) & 0xf0)
+#define PF_ADD			0x00
+#define PF_SUB			0x10
+#define PF_MUL			0x20
+#define PF_DIV			0x30
+#define PF_OR			0x40
+#define PF_AND			0x50
+#define PF_LSH			0x60
+#define PF_RSH			0x70
+#define PF_NEG			0x80
+
+#define PF_JA			0x00
+#define PF_JEQ			0x10
+#define PF_JGT			0x20
+#define PF_JGE			0x30
+#define PF_JSET			0x40
+
+// Operand of ALU, jump and return instructions
+#define PF_SRC(code)		((code) & 0x08)
+#define PF_K			0x00
+#define PF_X			0x08
+#define PF_RVAL(code)		((code) & 0x18)
+#define PF_A			0x10
+
+// Register transfers
+#define PF_MISCOP(code)		((code) & 0xf8)
+#define PF_TAX			0x00
+#define PF_TXA			0x80
+
+// Building instructions
+#define PF_STMT(code, k)		{ (code), 0, 0, (k) }
+#define PF_JUMP(code, k, jt, jf)	{ (code), (jt), (jf), (k) }
+
+// Largest program we take, and the number of scratch memory words
+#define PFILTER_MAX_INSNS	64
+#define PFILTER_MEMWORDS	16
+
+//
+// What a filter returns. Anything above PFILTER_ACCEPT accepts the packet
+// too, and is the class the packet is steered to.
+//
+#define PFILTER_DROP		0
+#define PFILTER_ACCEPT		1
+
+// Programs pfilter_load() recognizes and runs without the interpreter
+#define PFILTER_FAST_NONE	0
+#define PFILTER_FAST_CONST	1	// ret #k
+#define PFILTER_FAST_ETHERTYPE	2	// ldh [12]; jeq #type; ret; ret
+
+// Offset of the ethertype in an ethernet frame
+#define PFILTER_ETHERTYPE_OFF	12
+
+// Data Structures
+
+struct Pf_insn {
+    uint16_t	    pi_code;
+    uint8_t	    pi_jt;	// Forward offsets of the jump targets
+    uint8_t	    pi_jf;
+    uint32_t	    pi_k;
+};
+
+//
+// A verified filter program. pf_fast says whether it is one of the
+// programs that have a fast path, in which case the fields after it hold
+// what the program does.
+//
+struct Pfilter {
+    struct Pf_insn  pf_insns[PFILTER_MAX_INSNS];
+    uint32_t	    pf_len;	// 0 if there is no program
+    int		    pf_fast;
+    uint16_t	    pf_type;	// Ethertype we look for
+    uint32_t	    pf_match;	// Return value if it matches
+    uint32_t	    pf_nomatch;	// Return value otherwise
+};
+
+// Function Prototypes
+
+int pfilter_verify (const struct Pf_insn *insns, uint32_t len);
+int pfilter_load (struct Pfilter *pf, const struct Pf_insn *insns,
+		  uint32_t len);
+uint32_t pfilter_run (const struct Pfilter *pf, const uint8_t *pkt,
+		      uint32_t len);
+
+#endif // !JOS_KERN_PFILTER_H
@@ -1,212 +1,1838 @@
 #include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/kclock.h>
+#include <kern/picirq.h>
 #include <kern/sched.h>
+#include <kern/tasklet.h>
+#include <kern/tsc.h>
+#include <kern/trace.h>
+#include <kern/loghist.h>
 
+//
+// The scheduler keeps one run queue per CPU. An environment is put on a
+// run queue by sched_wakeup() when it becomes runnable, and taken off it
+// when a CPU picks it to run. A CPU whose run queue is empty steals work
+// from the busiest run queue.
+//
+// Environments that stop being runnable while they sit on a run queue
+// (they blocked in ipc_recv, or were destroyed) are not removed eagerly.
+// They are dropped the next time a CPU walks over them. Environments which
+// become runnable without going through sched_wakeup() are picked up by
+// the resync scan that an idle CPU does before giving up.
+//
+// Which env to run next is decided by the scheduler class in use. Round
+// robin and fixed priority classes are built in; PRIORITY_SCHED selects
+// the priority class at boot. Others can be loaded as modules, and the
+// class can be switched at runtime with sched_set_policy().
+//
+// When there is nothing to run, the CPU halts with interrupts enabled
+// instead of running the idle environment. On the boot CPU the periodic
+// timer is replaced by a one shot timer programmed for the earliest sleep
+// deadline, so an idle machine takes very few timer interrupts.
+//
+
+// 8253 PIT bits not in kclock.h
+#ifndef TIMER_INTTC
+#define TIMER_INTTC		0x00	// mode 0, intr on terminal cnt
+#endif
+#define TIMER_READBACK_CNTR0	0xc2	// latch status and count of cntr 0
+#define TIMER_STATUS_OUT	0x80	// output pin, set at terminal count
+#define TIMER_MAX_COUNT		0xffff
+
+// PIT input clocks in one scheduler tick
+#define SCHED_TICK_COUNT	TIMER_DIV(SCHED_HZ)
+
+// Top of the kernel stack of a CPU, for sched_halt()
+#if defined (JOS_SMP)
+#define SCHED_KSTACKTOP(cpu)	(KSTACKTOP - (cpu) * (KSTKSIZE + KSTKGAP))
+#else
+#define SCHED_KSTACKTOP(cpu)	KSTACKTOP
+#endif
+
+struct Sched_env sched_envs[NENV];
+struct Sched_cpu sched_cpus[SCHED_NCPU];
+
+static struct Sched_class sched_class_rr;
+static struct Sched_class sched_class_prio;
+
+static void sched_prio_update(struct Env *e, int depth);
+
+#if defined (PRIORITY_SCHED)
+#define SCHED_CLASS_DEFAULT	sched_class_prio
+#else
+#define SCHED_CLASS_DEFAULT	sched_class_rr
+#endif
+
+// All the registered classes, and the one in use
+static struct Sched_class *sched_classes = &sched_class_rr;
+struct Sched_class * volatile sched_class = &SCHED_CLASS_DEFAULT;
+
+// Timer ticks since boot, including the ones we slept through when idle
+volatile uint32_t sched_ticks;
+
+// Sleeping envs. Protected by sched_sleep_lock.
+static struct Sched_lock sched_sleep_lock;
+static int sched_nr_sleeping;
+static uint32_t sched_next_wake;
+
+static inline uint32_t
+sched_xchg (volatile uint32_t *addr, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; xchgl %0, %1" :
+		     "+m" (*addr), "=a" (result) :
+		     "1" (newval) :
+		     "cc");
+	return result;
+}
+
+static void
+sched_lock (struct Sched_lock *lk)
+{
+	while (sched_xchg(&lk->locked, 1) != 0) {
+	    asm volatile("pause");
+	}
+}
+
+static void
+sched_unlock (struct Sched_lock *lk)
+{
+	sched_xchg(&lk->locked, 0);
+}
+
+// Mask of all the CPUs we have run queues for
+static inline uint32_t
+sched_cpu_mask (void)
+{
+	if (SCHED_NCPU >= 32) {
+	    return SCHED_AFFINITY_ALL;
+	}
+	return (1 << SCHED_NCPU) - 1;
+}
+
+// CPU a run queue belongs to
+static inline int
+sched_rq_cpu (struct Sched_rq *rq)
+{
+	return ((uint8_t *)rq - (uint8_t *)&sched_cpus[0].cpu_rq) /
+	       sizeof(struct Sched_cpu);
+}
+
+//
+// Get the scheduler state of an environment. If the slot was last used by
+// a different env, reset the per env settings. A new env is not running
+// anywhere yet, whatever the last one in the slot left behind. If the slot
+// is still on a run queue, it stays there: the queue links env indices
+// and not env ids, so the entry is good for the new env as well, and we
+// may be called with that queue's lock held.
+//
+static struct Sched_env *
+sched_env_get (struct Env *e)
+{
+	struct Sched_env *se = &sched_envs[ENVX(e->env_id)];
+
+	if (se->se_env_id != e->env_id) {
+	    se->se_env_id = e->env_id;
+	    se->se_running = 0;
+	    if (!se->se_queued) {
+		se->se_next = se->se_prev = SCHED_RQ_END;
+	    }
+	    se->se_affinity = SCHED_AFFINITY_ALL;
+	    se->se_last_cpu = sched_cpunum();
+	    se->se_slice = SCHED_RR_SLICE;
+	    se->se_base_prio = e->priority;
+	    // Whoever the last env boosted drops it in sched_put_prev()
+	    se->se_blocked_on = 0;
+	    memset(&se->se_stats, 0, sizeof(se->se_stats));
+	    se->se_wait_start = 0;
+	    se->se_top_runtime = 0;
+	}
+
+	return se;
+}
+
+//
+// Run queue helpers. These are called with rq_lock held, by the scheduler
+// classes from their enqueue and dequeue hooks.
+//
+
+//
+// Mark an env as running on this CPU. This is what stops two CPUs from
+// running the same env: whoever claims it first wins. A claimed env can
+// still sit on a run queue for a while, it is just not eligible there.
+//
+static inline int
+sched_claim (int env)
+{
+	return sched_xchg(&sched_envs[env].se_running, 1) == 0;
+}
+
+// Append an env to the tail of a run queue
+void
+sched_rq_append (struct Sched_rq *rq, int env)
+{
+	sched_rq_insert_before(rq, SCHED_RQ_END, env);
+}
+
+// Insert an env in front of 'before', or at the tail if it is SCHED_RQ_END
+void
+sched_rq_insert_before (struct Sched_rq *rq, int before, int env)
+{
+	struct Sched_env *se = &sched_envs[env];
+
+	se->se_next = before;
+
+	if (before == SCHED_RQ_END) {
+	    se->se_prev = rq->rq_tail;
+	    rq->rq_tail = env;
+	} else {
+	    se->se_prev = sched_envs[before].se_prev;
+	    sched_envs[before].se_prev = env;
+	}
+
+	if (se->se_prev == SCHED_RQ_END) {
+	    rq->rq_head = env;
+	} else {
+	    sched_envs[se->se_prev].se_next = env;
+	}
+
+	se->se_rq = sched_rq_cpu(rq);
+	se->se_queued = 1;
+	rq->rq_nr_queued++;
+}
+
+// Unlink an env from a run queue
+void
+sched_rq_remove (struct Sched_rq *rq, int env)
+{
+	struct Sched_env *se = &sched_envs[env];
+
+	if (se->se_prev == SCHED_RQ_END) {
+	    rq->rq_head = se->se_next;
+	} else {
+	    sched_envs[se->se_prev].se_next = se->se_next;
+	}
+
+	if (se->se_next == SCHED_RQ_END) {
+	    rq->rq_tail = se->se_prev;
+	} else {
+	    sched_envs[se->se_next].se_prev = se->se_prev;
+	}
+
+	se->se_next = se->se_prev = SCHED_RQ_END;
+	se->se_queued = 0;
+	rq->rq_nr_queued--;
+}
+
+// Can this queued env be run on 'cpu' right now?
+int
+sched_env_eligible (int env, int cpu)
+{
+	struct Sched_env *se = &sched_envs[env];
+
+	return envs[env].env_status == ENV_RUNNABLE && !se->se_running &&
+	       se->se_env_id == envs[env].env_id &&
+	       (se->se_affinity & (1 << cpu)) != 0;
+}
+
+//
+// Round robin class. The run queue is kept in FIFO order, so taking the
+// first env we may run gives us the next env in circular fashion.
+//
+
+static void
+rr_enqueue (struct Sched_rq *rq, int env)
+{
+	sched_rq_append(rq, env);
+}
+
+static void
+rr_dequeue (struct Sched_rq *rq, int env)
+{
+	sched_rq_remove(rq, env);
+}
+
+static int
+rr_pick_next (struct Sched_rq *rq, int cpu)
+{
+	int env;
+
+	for (env = rq->rq_head; env != SCHED_RQ_END;
+	     env = sched_envs[env].se_next) {
+	    if (sched_env_eligible(env, cpu)) {
+		return env;
+	    }
+	}
+
+	return SCHED_RQ_END;
+}
+
+static int
+rr_tick (struct Sched_rq *rq, struct Env *e)
+{
+	struct Sched_env *se = sched_env_get(e);
+
+	if (--se->se_slice > 0) {
+	    return 0;
+	}
+
+	se->se_slice = SCHED_RR_SLICE;
+	return 1;
+}
+
+static void
+rr_yield (struct Sched_rq *rq, struct Env *e)
+{
+	sched_env_get(e)->se_slice = SCHED_RR_SLICE;
+}
+
+// A woken env runs next. This is what gives us IPC handoff.
+static int
+rr_check_preempt (struct Env *curr, struct Env *woken)
+{
+	return 1;
+}
+
+static struct Sched_class sched_class_rr = {
+	.sc_name	= "rr",
+	.sc_enqueue	= rr_enqueue,
+	.sc_dequeue	= rr_dequeue,
+	.sc_pick_next	= rr_pick_next,
+	.sc_tick	= rr_tick,
+	.sc_yield	= rr_yield,
+	.sc_check_preempt = rr_check_preempt,
+	.sc_module	= -1,
+	.sc_next	= &sched_class_prio,
+};
+
+//
+// Fixed priority class. Whenever the kernel has to choose a user
+// environment to run, it chooses the one with the maximum priority. Here,
+// lower value indicates higher priority. Environments of equal priority
+// are run in round robin fashion.
+//
+// To test this, we have modified Env struct to store the priority
+// associated with an environment in the field 'priority'.
+//
+// By default, the priority of an environment is hardcoded in the
+// env_alloc() routine and its equal to the index of that environment in
+// the envs array i.e. priority(envs[5]) = 5. ENV_CREATE_PRIORITY and
+// sched_env_set_priority() change it. 'priority' holds the priority the
+// env runs at, which may be raised by priority inheritance.
+//
+// 3 new files have been added to the user directory to test this:
+// - sched_prio1.c
+// - sched_prio2.c
+// - sched_prio3.c
+//
+// The run queue is kept sorted by priority, so the first env we may run
+// is the one to pick.
+//
+
+static void
+prio_enqueue (struct Sched_rq *rq, int env)
+{
+	int pos;
+
+	// Go behind all the envs with the same or a higher priority
+	for (pos = rq->rq_head; pos != SCHED_RQ_END;
+	     pos = sched_envs[pos].se_next) {
+	    if (envs[pos].priority > envs[env].priority) {
+		break;
+	    }
+	}
+
+	sched_rq_insert_before(rq, pos, env);
+}
+
+static int
+prio_tick (struct Sched_rq *rq, struct Env *e)
+{
+	int env, cpu = sched_rq_cpu(rq);
+
+	env = rr_pick_next(rq, cpu);
+	if (env == SCHED_RQ_END || envs[env].priority > e->priority) {
+	    // Nothing better to run
+	    return 0;
+	}
+
+	if (envs[env].priority < e->priority) {
+	    return 1;
+	}
+
+	// Equal priority. Take turns.
+	return rr_tick(rq, e);
+}
+
+// A woken env runs first only if it does not have a lower priority
+static int
+prio_check_preempt (struct Env *curr, struct Env *woken)
+{
+	return woken->priority <= curr->priority;
+}
+
+static struct Sched_class sched_class_prio = {
+	.sc_name	= "prio",
+	.sc_enqueue	= prio_enqueue,
+	.sc_dequeue	= rr_dequeue,
+	.sc_pick_next	= rr_pick_next,
+	.sc_tick	= prio_tick,
+	.sc_yield	= rr_yield,
+	.sc_check_preempt = prio_check_preempt,
+	.sc_module	= -1,
+	.sc_next	= NULL,
+};
+
+//
+// Put a runnable environment on a run queue. This has to be called
+// whenever an env's status is set to ENV_RUNNABLE. Calling it for an env
+// that is already queued or currently running is harmless.
+//
+void
+sched_wakeup (struct Env *e)
+{
+	struct Sched_env *se;
+	struct Sched_rq *rq;
+	int cpu, env = ENVX(e->env_id);
+
+	// The idle environment is never queued
+	if (env == 0 || e->env_status != ENV_RUNNABLE) {
+	    return;
+	}
+
+	se = sched_env_get(e);
+	if (se->se_queued || se->se_running) {
+	    return;
+	}
+
+	//
+	// Choose a run queue. We prefer the CPU the env last ran on, to keep
+	// its cache warm. Otherwise we take the least loaded CPU the env is
+	// allowed on.
+	//
+	if (se->se_affinity & (1 << se->se_last_cpu)) {
+	    cpu = se->se_last_cpu;
+	} else {
+	    int i;
+
+	    cpu = -1;
+	    for (i = 0; i < SCHED_NCPU; i++) {
+		if ((se->se_affinity & (1 << i)) == 0) {
+		    continue;
+		}
+		if (cpu == -1 || sched_cpus[i].cpu_rq.rq_nr_queued <
+				 sched_cpus[cpu].cpu_rq.rq_nr_queued) {
+		    cpu = i;
+		}
+	    }
+	}
+
+	rq = &sched_cpus[cpu].cpu_rq;
+
+	sched_lock(&rq->rq_lock);
+
+	// Check again, someone else may have queued it in the meantime
+	if (!se->se_queued && !se->se_running) {
+	    sched_class->sc_enqueue(rq, env);
+	    se->se_wait_start = read_tsc();
+	    se->se_wait_tick = sched_ticks;
+	}
+
+	sched_unlock(&rq->rq_lock);
+}
+
+//
+// Take the env that should run next on 'cpu' off the run queue of
+// 'rq_cpu'. On our own run queue, stale entries are dropped first, and
+// envs whose affinity no longer allows this CPU are moved to the
+// 'migrate' list, to be queued again once the lock is released.
+//
+static int
+sched_rq_take (int rq_cpu, int cpu, int *migrate)
+{
+	struct Sched_rq *rq = &sched_cpus[rq_cpu].cpu_rq;
+	struct Sched_class *sc;
+	struct Sched_env *se;
+	int env, next;
+
+	sched_lock(&rq->rq_lock);
+
+	sc = sched_class;
+
+	if (rq_cpu == cpu) {
+	    for (env = rq->rq_head; env != SCHED_RQ_END; env = next) {
+		se = &sched_envs[env];
+		next = se->se_next;
+
+		if (envs[env].env_status != ENV_RUNNABLE || se->se_running) {
+		    // Blocked, destroyed or already running somewhere
+		    sc->sc_dequeue(rq, env);
+		    continue;
+		}
+
+		sched_env_get(&envs[env]);
+
+		if ((se->se_affinity & (1 << cpu)) == 0) {
+		    sc->sc_dequeue(rq, env);
+		    se->se_next = *migrate;
+		    *migrate = env;
+		}
+	    }
+	}
+
+	while ((env = sc->sc_pick_next(rq, cpu)) != SCHED_RQ_END) {
+	    sc->sc_dequeue(rq, env);
+	    if (sched_claim(env)) {
+		break;
+	    }
+	}
+
+	sched_unlock(&rq->rq_lock);
+
+	return env;
+}
+
+// Pick from our own run queue, then put back any envs that have to move
+static int
+sched_pick_local (int cpu)
+{
+	int env, migrate = SCHED_RQ_END;
+
+	env = sched_rq_take(cpu, cpu, &migrate);
+
+	while (migrate != SCHED_RQ_END) {
+	    int next = sched_envs[migrate].se_next;
+	    sched_envs[migrate].se_next = SCHED_RQ_END;
+	    sched_wakeup(&envs[migrate]);
+	    migrate = next;
+	}
+
+	return env;
+}
+
+//
+// Our run queue is empty. Steal an env from the busiest run queue that has
+// something we are allowed to run.
+//
+static int
+sched_steal (int cpu)
+{
+	int victim, busiest, tried = 0, env;
+
+	while (tried != (sched_cpu_mask() & ~(1 << cpu))) {
+	    busiest = -1;
+	    for (victim = 0; victim < SCHED_NCPU; victim++) {
+		if (victim == cpu || (tried & (1 << victim))) {
+		    continue;
+		}
+		if (busiest == -1 || sched_cpus[victim].cpu_rq.rq_nr_queued >
+				     sched_cpus[busiest].cpu_rq.rq_nr_queued) {
+		    busiest = victim;
+		}
+	    }
+
+	    if (busiest == -1 || sched_cpus[busiest].cpu_rq.rq_nr_queued == 0) {
+		break;
+	    }
+
+	    env = sched_rq_take(busiest, cpu, NULL);
+	    if (env != SCHED_RQ_END) {
+		return env;
+	    }
+	    tried |= (1 << busiest);
+	}
+
+	return SCHED_RQ_END;
+}
+
+//
+// Last resort before going idle: queue up runnable environments that were
+// made runnable without a call to sched_wakeup(), e.g. by env_create().
+// Returns the number of envs queued.
+//
+static int
+sched_resync (void)
+{
+	struct Sched_env *se;
+	int i, found = 0;
+
+	for (i = 1; i < NENV; i++) {
+	    if (envs[i].env_status != ENV_RUNNABLE) {
+		continue;
+	    }
+
+	    se = sched_env_get(&envs[i]);
+	    if (!se->se_queued && !se->se_running) {
+		sched_wakeup(&envs[i]);
+		found++;
+	    }
+	}
+
+	return found;
+}
+
+// Record how long a runnable env waited before it got to run
+static void
+sched_account_wait (struct Sched_stats *ss, uint64_t wait)
+{
+	loghist_record(ss->ss_wait_hist, SCHED_WAIT_BUCKETS, SCHED_WAIT_SHIFT,
+		       &ss->ss_wait_max, wait);
+}
+
+// Run the chosen environment on this CPU
+static void __attribute__((noreturn))
+sched_run (int cpu, int env)
+{
+	struct Sched_env *se = &sched_envs[env];
+	uint64_t now = read_tsc();
+
+	if (se->se_wait_start) {
+	    sched_account_wait(&se->se_stats, now - se->se_wait_start);
+	    se->se_wait_start = 0;
+	}
+	se->se_stats.ss_nr_sched++;
+	se->se_run_start = now;
+
+	se->se_last_cpu = cpu;
+	sched_cpus[cpu].cpu_env = &envs[env];
+
+	TRACE(TRACE_CAT_SCHED, TRACE_SCHED_RUN, envs[env].env_id, cpu, 0);
+	env_run(&envs[env]);
+}
+
+//
+// The env running on this CPU is giving it up. Account for the time it
+// ran and put it back on a run queue if it is still runnable.
+//
+static void
+sched_put_prev (int cpu)
+{
+	struct Sched_env *se = &sched_envs[ENVX(curenv->env_id)];
+
+	if (se->se_running) {
+	    se->se_stats.ss_runtime += read_tsc() - se->se_run_start;
+	    if (sched_cpus[cpu].cpu_preempt) {
+		se->se_stats.ss_nr_involuntary++;
+	    } else {
+		se->se_stats.ss_nr_voluntary++;
+	    }
+	}
+
+	//
+	// If it runs at an inherited priority, make sure someone is still
+	// blocked on it. A sender that was destroyed, or that stopped
+	// retrying, never calls sched_ipc_unblock().
+	//
+	if (curenv->priority != se->se_base_prio) {
+	    sched_prio_update(curenv, 0);
+	}
+
+	se->se_running = 0;
+	sched_wakeup(curenv);
+
+	sched_cpus[cpu].cpu_env = NULL;
+	sched_cpus[cpu].cpu_preempt = 0;
+}
+
+//
+// The env that was running on this CPU is gone: env_destroy() freed it and
+// cleared curenv before calling sched_yield(). Drop its claim on the slot,
+// which sched_put_prev() would have done, and take the slot off the run
+// queue it may still sit on, so that the next env allocated in it can be
+// scheduled.
+//
+static void
+sched_put_dead (int cpu)
+{
+	int env = sched_cpus[cpu].cpu_env - envs;
+	struct Sched_env *se = &sched_envs[env];
+	struct Sched_rq *rq;
+
+	sched_cpus[cpu].cpu_env = NULL;
+	se->se_running = 0;
+
+	// Whoever it was boosting goes back to its own priority
+	sched_ipc_unblock(&envs[env]);
+
+	if (!se->se_queued) {
+	    return;
+	}
+
+	rq = &sched_cpus[se->se_rq].cpu_rq;
+	sched_lock(&rq->rq_lock);
+
+	// The slot may have been given to a new env meanwhile
+	if (se->se_queued && &sched_cpus[se->se_rq].cpu_rq == rq &&
+	    envs[env].env_status != ENV_RUNNABLE) {
+	    sched_class->sc_dequeue(rq, env);
+	}
+
+	sched_unlock(&rq->rq_lock);
+}
+
+// Have we reached 'tick'? Copes with sched_ticks wrapping around.
+static inline int
+sched_tick_reached (uint32_t tick)
+{
+	return (int32_t)(sched_ticks - tick) >= 0;
+}
+
+//
+// Wake up the sleeping envs whose deadline has passed, and work out the
+// next deadline.
+//
+static void
+sched_wake_sleepers (void)
+{
+	struct Sched_env *se;
+	int i, next_valid = 0;
+
+	if (sched_nr_sleeping == 0 || !sched_tick_reached(sched_next_wake)) {
+	    return;
+	}
+
+	sched_lock(&sched_sleep_lock);
+
+	for (i = 1; i < NENV; i++) {
+	    se = &sched_envs[i];
+	    if (!se->se_sleep_env) {
+		continue;
+	    }
+
+	    if (envs[i].env_id != se->se_sleep_env ||
+		envs[i].env_status != ENV_NOT_RUNNABLE) {
+		// Destroyed, or woken up by someone else
+		se->se_sleep_env = 0;
+		sched_nr_sleeping--;
+		continue;
+	    }
+
+	    if (sched_tick_reached(se->se_wake_tick)) {
+		se->se_sleep_env = 0;
+		sched_nr_sleeping--;
+		envs[i].env_status = ENV_RUNNABLE;
+		sched_wakeup(&envs[i]);
+		continue;
+	    }
+
+	    if (!next_valid ||
+		(int32_t)(se->se_wake_tick - sched_next_wake) < 0) {
+		sched_next_wake = se->se_wake_tick;
+		next_valid = 1;
+	    }
+	}
+
+	sched_unlock(&sched_sleep_lock);
+}
+
+// Put the PIT back into periodic mode
+static void
+sched_pit_periodic (void)
+{
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
+	outb(IO_TIMER1, SCHED_TICK_COUNT % 256);
+	outb(IO_TIMER1, SCHED_TICK_COUNT / 256);
+}
+
+// Have the PIT interrupt once, after 'count' input clocks
+static void
+sched_pit_oneshot (uint32_t count)
+{
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_INTTC | TIMER_16BIT);
+	outb(IO_TIMER1, count % 256);
+	outb(IO_TIMER1, count / 256);
+}
+
+// Number of PIT input clocks since sched_pit_oneshot(count)
+static uint32_t
+sched_pit_elapsed (uint32_t count)
+{
+	uint8_t status, lo, hi;
+
+	outb(TIMER_MODE, TIMER_READBACK_CNTR0);
+	status = inb(IO_TIMER1);
+	lo = inb(IO_TIMER1);
+	hi = inb(IO_TIMER1);
+
+	if (status & TIMER_STATUS_OUT) {
+	    // The one shot went off
+	    return count;
+	}
+
+	return count - (lo | (hi << 8));
+}
+
+//
+// We are about to halt. On the boot CPU, stop the periodic tick and
+// program a single timer interrupt for the next sleep deadline. The PIT
+// counter is 16 bits, so without a deadline, or with a far one, we still
+// wake up every TIMER_MAX_COUNT clocks (about 55ms) to keep sched_ticks
+// right.
+//
+static void
+sched_idle_enter (int cpu)
+{
+	uint32_t count = TIMER_MAX_COUNT;
+	int32_t delta;
+
+	sched_cpus[cpu].cpu_idle = 1;
+	sched_cpus[cpu].cpu_idle_start = read_tsc();
+
+	if (cpu != 0) {
+	    return;
+	}
+
+	if (sched_nr_sleeping) {
+	    delta = sched_next_wake - sched_ticks;
+	    if (delta < 1) {
+		delta = 1;
+	    }
+	    if ((uint32_t)delta < TIMER_MAX_COUNT / SCHED_TICK_COUNT) {
+		count = delta * SCHED_TICK_COUNT -
+			sched_cpus[cpu].cpu_idle_residue;
+	    }
+	}
+
+	sched_cpus[cpu].cpu_idle_count = count;
+	sched_pit_oneshot(count);
+}
+
+//
+// We were woken up by an interrupt. Account for the ticks we slept
+// through and go back to the periodic tick.
+//
+static void
+sched_idle_exit (int cpu)
+{
+	struct Sched_cpu *c = &sched_cpus[cpu];
+
+	c->cpu_idle = 0;
+	c->cpu_idle_cycles += read_tsc() - c->cpu_idle_start;
+
+	if (cpu != 0) {
+	    return;
+	}
+
+	c->cpu_idle_residue += sched_pit_elapsed(c->cpu_idle_count);
+	sched_ticks += c->cpu_idle_residue / SCHED_TICK_COUNT;
+	c->cpu_idle_residue %= SCHED_TICK_COUNT;
+
+	sched_pit_periodic();
+	sched_wake_sleepers();
+	tsc_tick();
+}
+
+//
+// Nothing to run on this CPU. Reset the stack pointer, enable interrupts
+// and then halt. The interrupt that wakes us up comes in through trap()
+// with no current env, which calls sched_yield() again.
+//
+static void __attribute__((noreturn))
+sched_halt (int cpu)
+{
+	curenv = NULL;
+	sched_cpus[cpu].cpu_env = NULL;
+
+	sched_idle_enter(cpu);
+
+#if !defined (JOS_HOSTED)
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"sti\n"
+		"1:\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (SCHED_KSTACKTOP(cpu)));
+#else
+	// The hosted benchmarks in host/ have no CPU to halt
+	panic("sched_halt: nothing to run");
+#endif
+
+	while (1)
+	    ;
+}
+
+// Is there any env, besides the idle env, that may become runnable?
+static int
+sched_envs_alive (void)
+{
+	int i;
+
+	for (i = 1; i < NENV; i++) {
+	    if (envs[i].env_status != ENV_FREE) {
+		return 1;
+	    }
+	}
+
+	return 0;
+}
+
+//
+// Called from the timer interrupt. Returns non zero if the scheduler
+// class wants the running env preempted, in which case the caller should
+// call sched_yield().
+//
+int
+sched_tick (void)
+{
+	int cpu = sched_cpunum();
+	struct Sched_rq *rq = &sched_cpus[cpu].cpu_rq;
+	struct Sched_class *sc;
+	int preempt = 1;
+
+	if (cpu == 0) {
+	    if (sched_cpus[cpu].cpu_idle) {
+		// The one shot timer we halted with went off
+		sched_idle_exit(cpu);
+	    } else {
+		sched_ticks++;
+		sched_wake_sleepers();
+		tsc_tick();
+	    }
+	}
+
+	if (curenv && curenv != &envs[0]) {
+	    sched_lock(&rq->rq_lock);
+	    sc = sched_class;
+	    preempt = sc->sc_tick ? sc->sc_tick(rq, curenv) : 0;
+	    sched_unlock(&rq->rq_lock);
+	}
+
+	//
+	// Switching now would abandon the tasklet we interrupted, see
+	// sched_irq_exit(). The interrupt that is running it switches once
+	// it is done.
+	//
+	if (preempt && tasklet_active()) {
+	    sched_cpus[cpu].cpu_need_resched = 1;
+	    preempt = 0;
+	}
+
+	if (preempt) {
+	    sched_cpus[cpu].cpu_preempt = 1;
+	}
+
+	return preempt;
+}
 
 // Choose a user environment to run and run it.
 void
-sched_yield(void)
+sched_yield(void)
+{
+	int cpu = sched_cpunum();
+	struct Sched_rq *rq = &sched_cpus[cpu].cpu_rq;
+	struct Sched_class *sc;
+	int env;
+
+	if (sched_cpus[cpu].cpu_idle) {
+	    sched_idle_exit(cpu);
+	}
+
+	//
+	// The yielding env goes back on our run queue if it is still
+	// runnable. Where it goes is up to the scheduler class. With round
+	// robin it goes to the tail, so it is chosen again only if nothing
+	// else is runnable.
+	//
+	if (curenv) {
+	    if (!sched_cpus[cpu].cpu_preempt && curenv != &envs[0]) {
+		sched_lock(&rq->rq_lock);
+		sc = sched_class;
+		if (sc->sc_yield) {
+		    sc->sc_yield(rq, curenv);
+		}
+		sched_unlock(&rq->rq_lock);
+	    }
+	    sched_put_prev(cpu);
+	} else if (sched_cpus[cpu].cpu_env) {
+	    sched_put_dead(cpu);
+	}
+	sched_cpus[cpu].cpu_env = NULL;
+	sched_cpus[cpu].cpu_preempt = 0;
+
+	env = sched_pick_local(cpu);
+
+	if (env == SCHED_RQ_END) {
+	    env = sched_steal(cpu);
+	}
+
+	if (env == SCHED_RQ_END && sched_resync()) {
+	    env = sched_pick_local(cpu);
+	    if (env == SCHED_RQ_END) {
+		env = sched_steal(cpu);
+	    }
+	}
+
+	if (env != SCHED_RQ_END) {
+	    sched_run(cpu, env);
+	}
+
+	//
+	// Nothing is runnable. If some env may still become runnable, halt
+	// until an interrupt comes in. Other CPUs always do that, since there
+	// is only one idle environment.
+	//
+	if (cpu != 0 || sched_envs_alive()) {
+	    sched_halt(cpu);
+	}
+
+	// Run the special idle environment when nothing else is left.
+	if (envs[0].env_status == ENV_RUNNABLE) {
+	    sched_envs[0].se_running = 1;
+	    sched_run(cpu, 0);
+	} else {
+	    cprintf("Destroyed all environments - nothing more to do!\n");
+	    while (1)
+		monitor(NULL);
+	}
+}
+
+//
+// Directed yield. Run 'e' on this CPU right away, instead of whatever the
+// scheduler class would pick, and give it the rest of our time slice if
+// 'donate' is set. The yielding env goes back on the run queue. Does not
+// return if the switch happens, so the caller has to set up the return
+// value of its syscall beforehand.
+//
+static int
+sched_handoff(struct Env *e, int donate)
+{
+	int cpu = sched_cpunum();
+	int env = ENVX(e->env_id);
+	struct Sched_env *se, *cur;
+	struct Sched_rq *rq;
+
+	if (!curenv || curenv == &envs[0] || e == curenv || env == 0)
+		return -E_INVAL;
+
+	se = sched_env_get(e);
+	if (e->env_status != ENV_RUNNABLE ||
+	    (se->se_affinity & (1 << cpu)) == 0)
+		return -E_INVAL;
+
+	// Take it off whatever run queue it is on
+	if (se->se_queued) {
+	    rq = &sched_cpus[se->se_rq].cpu_rq;
+	    sched_lock(&rq->rq_lock);
+	    if (se->se_queued && rq == &sched_cpus[se->se_rq].cpu_rq) {
+		sched_class->sc_dequeue(rq, env);
+	    }
+	    sched_unlock(&rq->rq_lock);
+	}
+
+	if (!sched_claim(env)) {
+	    // It is running on some other CPU
+	    return -E_INVAL;
+	}
+
+	// Donate what is left of our time slice
+	cur = sched_env_get(curenv);
+	if (donate) {
+	    se->se_slice = cur->se_slice > 0 ? cur->se_slice : 1;
+	} else {
+	    se->se_slice = SCHED_RR_SLICE;
+	}
+	cur->se_slice = SCHED_RR_SLICE;
+
+	sched_put_prev(cpu);
+	sched_run(cpu, env);
+	return 0;
+}
+
+//
+// Body of sys_sleep(). Put the current env to sleep for at least 'msec'
+// milliseconds. Does not return.
+//
+int
+sched_sleep(uint32_t msec)
+{
+	struct Sched_env *se = sched_env_get(curenv);
+	uint32_t ticks = (msec * SCHED_HZ + 999) / 1000;
+
+	curenv->env_tf.tf_regs.reg_eax = 0;
+
+	if (ticks == 0)
+		sched_yield();
+
+	sched_lock(&sched_sleep_lock);
+
+	se->se_wake_tick = sched_ticks + ticks;
+	if (!se->se_sleep_env) {
+	    se->se_sleep_env = curenv->env_id;
+	    sched_nr_sleeping++;
+	}
+
+	if (sched_nr_sleeping == 1 ||
+	    (int32_t)(se->se_wake_tick - sched_next_wake) < 0) {
+	    sched_next_wake = se->se_wake_tick;
+	}
+
+	sched_unlock(&sched_sleep_lock);
+
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
+// Body of sys_yield_to(). Returns only on failure.
+int
+sched_yield_to(envid_t envid)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+
+	curenv->env_tf.tf_regs.reg_eax = 0;
+
+	return sched_handoff(e, 1);
+}
+
+//
+// Called by sys_ipc_try_send() once it has delivered a message and made
+// the receiver runnable. If the scheduler class agrees, the receiver runs
+// right away on our time slice, and the sender resumes later with its
+// send having returned 0. Otherwise the receiver is just queued.
+//
+void
+sched_ipc_handoff(struct Env *receiver)
 {
-#if defined (PRIORITY_SCHED)
+	struct Sched_class *sc = sched_class;
+
+	if (curenv && sc->sc_check_preempt &&
+	    sc->sc_check_preempt(curenv, receiver)) {
+	    curenv->env_tf.tf_regs.reg_eax = 0;
+	    sched_handoff(receiver, 1);
+	}
 
-	priority_sched_yield();
+	sched_wakeup(receiver);
+}
 
-#else
+//
+// Wakeup preemption. An interrupt handler that made an env runnable, or
+// has news for one that is spinning on it, calls this instead of
+// sched_wakeup(). 'latency' is how many ticks the env can afford to wait;
+// SCHED_WAKE_NOW asks for it to run as soon as the policy allows. If the
+// scheduler class says it should run before the current env, and it would
+// not get to run within 'latency' anyway, we mark this CPU for
+// rescheduling. sched_irq_exit() then switches to it on the way out of
+// the interrupt.
+//
+void
+sched_wakeup_hint(struct Env *e, int latency)
+{
+	int cpu = sched_cpunum();
+	struct Sched_cpu *c = &sched_cpus[cpu];
+	struct Sched_class *sc = sched_class;
+
+	sched_wakeup(e);
+	TRACE(TRACE_CAT_SCHED, TRACE_SCHED_WAKE_HINT, e->env_id, latency, 0);
+
+	if (e == curenv || e->env_status != ENV_RUNNABLE)
+		return;
+
+	if (curenv && curenv != &envs[0]) {
+	    if (!sc->sc_check_preempt || !sc->sc_check_preempt(curenv, e))
+		return;
+
+	    // It gets the CPU soon enough when our time slice runs out
+	    if (latency > 0 && sched_env_get(curenv)->se_slice <= latency)
+		return;
+	}
+
+	// The first env woken in an interrupt wins
+	if (!c->cpu_wake_env)
+	    c->cpu_wake_env = e->env_id;
+	c->cpu_need_resched = 1;
+}
+
+//
+// Called by trap() just before it returns to the interrupted env, with the
+// frame of the interrupt. Runs the work interrupt handlers deferred to
+// tasklets first, which may wake envs too. If an interrupt handler asked
+// for it, switch to the env it woke up. The switch counts as a preemption
+// of the interrupted env.
+//
+// Tasklets run on this kernel stack, so nothing may switch away from
+// under them: that would abandon the tasklet's frame and leave
+// tasklet_run() marked busy on this CPU for good. By default they run with
+// interrupts disabled and nothing can. Kernels built with TASKLET_IRQS run
+// them with interrupts enabled, and need a trap() that returns from an
+// interrupt taken in the kernel with iret rather than env_run(). Whatever
+// trap() does, we only ever switch away from an interrupted env, never
+// from the kernel; that is asserted below. Besides that, trap() calls
+// sched_yield() in two cases, and neither may happen in an interrupt that
+// comes in while tasklets run:
+//
+// - sched_tick() asks for a preemption. While tasklet_active() it sets
+//   cpu_need_resched instead, and we switch here once the tasklets are
+//   done.
+// - There is no current env, because the CPU was halted. tasklet_run()
+//   keeps interrupts disabled in that case, so there is no nested
+//   interrupt to begin with.
+//
+void
+sched_irq_exit(struct Trapframe *tf)
+{
+	struct Sched_cpu *c = &sched_cpus[sched_cpunum()];
+	struct Env *e;
+	envid_t envid;
+
+	tasklet_run();
+
+	// We interrupted a tasklet. It has to finish before we switch.
+	if (tasklet_active())
+		return;
+
+	if (!c->cpu_need_resched)
+		return;
+
+	envid = c->cpu_wake_env;
+	c->cpu_wake_env = 0;
+	c->cpu_need_resched = 0;
 
-	// 
-        // Implement simple round-robin scheduling.
-	// Search through 'envs' for a runnable environment,
-	// in circular fashion starting after the previously running env,
-	// and switch to the first such environment found.
-	// It's OK to choose the previously running env if no other env
-	// is runnable.
-	// But never choose envs[0], the idle environment,
-	// unless NOTHING else is runnable.
-        //
-
-	int i, env;
-	
 	if (!curenv) {
-            //
-            // We come here in 2 cases
-            //
-            // 1. When the kernel starts up and calls sched_yield to run the 
-            //    first available environment. In this case, we have to run
-            //    the idle process.
-            // 2. When one environment exits gracefully and we have to run the
-            //    next available environment. In this case, we have to loop
-            //    through the available environments and pick the next
-            //    available one.
-            //
-	    if (prev_curenv_id == 0) {
-		goto end;
-	    } else {
-		env = ENVX(prev_curenv_id);
+		// We were halted. trap() calls sched_yield() anyway.
+		return;
+	}
+
+	// Only user mode is ever interrupted with a current env
+	assert((tf->tf_cs & 3) == 3);
+	c->cpu_preempt = 1;
+
+	if (envid && envid2env(envid, &e, 0) == 0)
+		sched_handoff(e, 0);
+
+	// It can not run here. Let the scheduler class choose.
+	sched_yield();
+}
+
+//
+// Switch to a different scheduler class. All the run queues are locked
+// while the queued envs are moved over, so every CPU sees either the old
+// class with the old queue order or the new class with the new one.
+//
+static void
+sched_class_switch (struct Sched_class *new)
+{
+	struct Sched_class *old = sched_class;
+	struct Sched_rq *rq;
+	int cpu, env, moved;
+
+	for (cpu = 0; cpu < SCHED_NCPU; cpu++) {
+	    sched_lock(&sched_cpus[cpu].cpu_rq.rq_lock);
+	}
+
+	for (cpu = 0; cpu < SCHED_NCPU; cpu++) {
+	    rq = &sched_cpus[cpu].cpu_rq;
+
+	    // Take everything off, remembering the order through se_next
+	    moved = SCHED_RQ_END;
+	    while ((env = rq->rq_tail) != SCHED_RQ_END) {
+		old->sc_dequeue(rq, env);
+		sched_envs[env].se_next = moved;
+		moved = env;
 	    }
-	} else {
-            //
-            // We come here when one environment yields the CPU. Here, we loop
-            // through the available environments and pick the next one
-            //
-	    env = ENVX(curenv->env_id);
-	}
-
-        // Loop through the available environments in a circular fashion
-	for (i = (env + 1) % NENV; i < NENV; i = (i + 1) % NENV) {
-
-	    if (i == env) {
-                //
-                // If we come back to the same environment we started with,
-                // it means there are no other runnable environments. Here,
-                // we run the same environment again if its runnable. We run
-                // the idle process otherwise.
-                //
-		if (curenv && curenv->env_status == ENV_RUNNABLE) {
-		    env_run(curenv);
-		} else {
-		    goto end;
-		}
-	    } else if (i == 0) {
-                //
-                // We don't run the idle process until we are sure there are
-                // no other runnable environments
-                //
-		continue;
-	    } else {
-                // See if this environment is runnable and run it
-		if (envs[i].env_status == ENV_RUNNABLE) {
-		    env_run(&envs[i]);
-		}
+
+	    while ((env = moved) != SCHED_RQ_END) {
+		moved = sched_envs[env].se_next;
+		new->sc_enqueue(rq, env);
 	    }
 	}
 
-end:
-	// Run the special idle environment when nothing else is runnable.
-	if (envs[0].env_status == ENV_RUNNABLE)
-		env_run(&envs[0]);
-	else {
-		cprintf("Destroyed all environments - nothing more to do!\n");
-		while (1)
-			monitor(NULL);
+	sched_class = new;
+
+	for (cpu = SCHED_NCPU - 1; cpu >= 0; cpu--) {
+	    sched_unlock(&sched_cpus[cpu].cpu_rq.rq_lock);
+	}
+}
+
+// Register a scheduler class. Called through module_register().
+int
+sched_class_register (struct Sched_class *sc, int module_index)
+{
+	struct Sched_class *c;
+
+	if (!sc->sc_enqueue || !sc->sc_dequeue || !sc->sc_pick_next) {
+	    return -E_INVAL;
+	}
+
+	for (c = sched_classes; c; c = c->sc_next) {
+	    if (c == sc || strcmp(c->sc_name, sc->sc_name) == 0) {
+		cprintf("sched_class_register: class %s already registered\n",
+			sc->sc_name);
+		return -E_FILE_EXISTS;
+	    }
 	}
 
-#endif // PRIORITY_SCHED
+	sc->sc_module = module_index;
+	sc->sc_next = sched_classes;
+	sched_classes = sc;
+
+	return 0;
 }
 
+//
+// A module is going away. Drop the classes it registered, going back to
+// the default class first if one of them is in use.
+//
 void
-priority_sched_yield(void)
+sched_class_unregister_module (int module_index)
 {
-	int i, env, min_priority, min_priority_index;
-	
-	//
-	// This function implements a fixed priority scheduling policy in the
-	// kernel. Whenever the kernel has to choose a user environment to
-	// run, it goes through the list of available environments and choose
-	// the one with the maximum priority. Here, lower value indicates
-	// higher priority.
-	//
-	// To test this function, we have modified Env struct to store the
-	// priority associated with an environment in the field 'priority'.
-	//
-	// Here we are setting the priority of the environment in a static
-	// fashion. Ideally, ENV_CREATE has to be modified to pass an
-	// additional priority field to env_create. But as of now, the
-	// priority of an environment is hardcoded in the env_alloc() routine
-	// and its equal to the index of that environment in the envs array
-	// i.e. priority(envs[5]) = 5.
-	//
-	// 3 new files have been added to the user directory to test this:
-	// - sched_prio1.c
-	// - sched_prio2.c
-	// - sched_prio3.c
-	//
+	struct Sched_class **cp;
 
-	if (!curenv) {
-            //
-            // We come here in 2 cases
-            //
-            // 1. When the kernel starts up and calls sched_yield to run the 
-            //    first available environment. In this case, we have to run
-            //    the idle process.
-            // 2. When one environment exits gracefully and we have to run the
-            //    next available environment. In this case, we have to loop
-            //    through the available environments and pick the next
-            //    available one.
-            //
-	    if (prev_curenv_id == 0) {
-		goto end;
+	if (sched_class->sc_module == module_index) {
+	    sched_class_switch(&SCHED_CLASS_DEFAULT);
+	}
+
+	for (cp = &sched_classes; *cp; ) {
+	    if ((*cp)->sc_module == module_index) {
+		*cp = (*cp)->sc_next;
 	    } else {
-		env = ENVX(prev_curenv_id);
+		cp = &(*cp)->sc_next;
 	    }
-	} else {
-            //
-            // We come here when one environment yields the CPU. Here, we loop
-            // through the available environments and pick the next one
-            //
-	    env = ENVX(curenv->env_id);
-	}
-
-	// To keep track of environment with maximum priority
-	min_priority = 10000;
-	min_priority_index = env;
-
-        // Loop through the available environments in a circular fashion
-	for (i = (env + 1) % NENV; i < NENV; i = (i + 1) % NENV) {
-
-	    if (i == env) {
-                //
-                // If we come back to the same environment we started with,
-                // it means we have scanned all the environments. If we have
-		// another environment with maximum priority, we run it. Else,
-		// we run the same environment which called yield, if its
-		// runnable or run the idle environment.
-                //
-		if (min_priority_index != env) {
-		    break;
-		} else {
-		    if (curenv && curenv->env_status == ENV_RUNNABLE) {
-			break;
-		    } else {
-			goto end;
-		    }
+	}
+}
+
+// Select the scheduler class to use by name
+int
+sched_set_policy (char *name)
+{
+	struct Sched_class *c;
+
+	for (c = sched_classes; c; c = c->sc_next) {
+	    if (strcmp(c->sc_name, name) == 0) {
+		if (c != sched_class) {
+		    sched_class_switch(c);
 		}
-	    } else if (i == 0) {
-                //
-                // We don't run the idle process until we are sure there are
-                // no other runnable environments
-                //
+		return 0;
+	    }
+	}
+
+	cprintf("sched_set_policy: no scheduler class %s\n", name);
+	return -E_NOT_FOUND;
+}
+
+// Routine to display the scheduler classes available
+int
+sched_display_policies (void)
+{
+	struct Sched_class *c;
+
+	cprintf("\nScheduler classes:\n\n");
+
+	for (c = sched_classes; c; c = c->sc_next) {
+	    cprintf("%c %s", c == sched_class ? '*' : ' ', c->sc_name);
+	    if (c->sc_module >= 0) {
+		cprintf(" (module %d)", c->sc_module);
+	    }
+	    cprintf("\n");
+	}
+
+	return 0;
+}
+
+//
+// Change the priority an env runs at. If it sits on a run queue it is
+// queued again, so that the class can put it in the right place.
+//
+static void
+sched_env_requeue(struct Env *e, int prio)
+{
+	struct Sched_env *se = sched_env_get(e);
+	struct Sched_rq *rq;
+	int env = ENVX(e->env_id);
+
+	if (!se->se_queued) {
+	    e->priority = prio;
+	    return;
+	}
+
+	rq = &sched_cpus[se->se_rq].cpu_rq;
+	sched_lock(&rq->rq_lock);
+
+	if (se->se_queued && &sched_cpus[se->se_rq].cpu_rq == rq) {
+	    sched_class->sc_dequeue(rq, env);
+	    e->priority = prio;
+	    sched_class->sc_enqueue(rq, env);
+	} else {
+	    e->priority = prio;
+	}
+
+	sched_unlock(&rq->rq_lock);
+}
+
+//
+// Work out the priority an env should run at: its own base priority, or
+// the priority of the highest priority env blocked sending to it, if that
+// is higher. If the env is itself blocked sending to someone, pass the
+// result along the chain.
+//
+static void
+sched_prio_update(struct Env *e, int depth)
+{
+	struct Sched_env *se = sched_env_get(e), *ws;
+	struct Env *target;
+	int i, prio = se->se_base_prio;
+
+	for (i = 1; i < NENV; i++) {
+	    ws = &sched_envs[i];
+	    if (envs[i].env_status != ENV_FREE &&
+		ws->se_env_id == envs[i].env_id &&
+		ws->se_blocked_on == e->env_id &&
+		envs[i].priority < prio) {
+		prio = envs[i].priority;
+	    }
+	}
+
+	if (prio == e->priority) {
+	    return;
+	}
+
+	sched_env_requeue(e, prio);
+
+	if (se->se_blocked_on && depth < SCHED_PI_DEPTH &&
+	    envid2env(se->se_blocked_on, &target, 0) == 0) {
+	    sched_prio_update(target, depth + 1);
+	}
+}
+
+// Set the base priority of an environment
+int
+sched_env_set_priority(envid_t envid, int prio)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	if (prio < SCHED_PRIO_HIGHEST || prio > SCHED_PRIO_LOWEST)
+		return -E_INVAL;
+
+	sched_env_get(e)->se_base_prio = prio;
+	sched_prio_update(e, 0);
+
+	return 0;
+}
+
+// Get the base priority of an environment
+int
+sched_env_get_priority(envid_t envid)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	return sched_env_get(e)->se_base_prio;
+}
+
+//
+// Priority inheritance across IPC. sys_ipc_try_send() calls
+// sched_ipc_block() when the target is not receiving yet, and
+// sched_ipc_unblock() once the send went through. While the sender keeps
+// retrying, the target runs at the sender's priority if that is higher,
+// so a low priority server can not hold up a high priority client.
+//
+void
+sched_ipc_block(struct Env *sender, envid_t target)
+{
+	struct Sched_env *se = sched_env_get(sender);
+	struct Env *e;
+
+	// The sender retries in a loop. Only the first attempt counts.
+	if (se->se_blocked_on == target)
+		return;
+
+	sched_ipc_unblock(sender);
+
+	if (envid2env(target, &e, 0) < 0)
+		return;
+
+	se->se_blocked_on = target;
+	sched_prio_update(e, 0);
+}
+
+void
+sched_ipc_unblock(struct Env *sender)
+{
+	struct Sched_env *se = sched_env_get(sender);
+	struct Env *e;
+	envid_t target = se->se_blocked_on;
+
+	if (!target)
+		return;
+
+	se->se_blocked_on = 0;
+
+	if (envid2env(target, &e, 0) == 0)
+		sched_prio_update(e, 0);
+}
+
+// Note all the envs that exist now. See ENV_CREATE_PRIORITY.
+void
+sched_env_sync(void)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++) {
+	    if (envs[i].env_status != ENV_FREE) {
+		sched_env_get(&envs[i]);
+	    }
+	}
+}
+
+// Give a priority to the envs created since sched_env_sync()
+void
+sched_env_adopt(int prio)
+{
+	int i;
+
+	if (prio < SCHED_PRIO_HIGHEST || prio > SCHED_PRIO_LOWEST) {
+	    cprintf("sched_env_adopt: bad priority %d\n", prio);
+	    return;
+	}
+
+	for (i = 0; i < NENV; i++) {
+	    if (envs[i].env_status != ENV_FREE &&
+		sched_envs[i].se_env_id != envs[i].env_id) {
+		sched_env_get(&envs[i])->se_base_prio = prio;
+		sched_prio_update(&envs[i], 0);
+	    }
+	}
+}
+
+// Body of the syscall that returns the accounting of an env
+int
+sched_env_stats(envid_t envid, struct Sched_stats *stats)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+
+	*stats = sched_env_get(e)->se_stats;
+
+	return 0;
+}
+
+// Upper bound of the wait time, in cycles, that 'pct' percent of waits fit in
+static uint64_t
+sched_wait_percentile (struct Sched_stats *ss, int pct)
+{
+	return loghist_percentile(ss->ss_wait_hist, SCHED_WAIT_BUCKETS,
+				  SCHED_WAIT_SHIFT, ss->ss_wait_max, pct);
+}
+
+//
+// Routine behind the 'top' monitor command. Shows, for every env, how
+// much CPU it used since the last time we were called, how often it was
+// scheduled and how long it waited to run. Times are in units of 1024
+// TSC cycles. The wait percentiles are bucket bounds of the wait time
+// histogram, whose buckets start at 2^SCHED_WAIT_SHIFT cycles.
+//
+int
+sched_display(void)
+{
+	static uint64_t last_tsc;
+	uint64_t now = read_tsc(), window, used;
+	struct Sched_env *se;
+	struct Sched_stats *ss;
+	char state;
+	int i;
+
+	window = last_tsc ? now - last_tsc : 0;
+
+	cprintf("\nPolicy: %s\tTicks: %u\tWait buckets: log2 from %u cycles\n\n",
+		sched_class->sc_name, sched_ticks, 1 << SCHED_WAIT_SHIFT);
+	cprintf("ENVID     S PRIO  CPU  %%CPU     RUNS      VOL    INVOL"
+		"   RUNTIME   WAIT50   WAIT99  WAITMAX\n");
+
+	for (i = 0; i < NENV; i++) {
+	    if (envs[i].env_status == ENV_FREE) {
 		continue;
+	    }
+
+	    se = sched_env_get(&envs[i]);
+	    ss = &se->se_stats;
+
+	    if (se->se_running) {
+		state = 'R';
+	    } else if (envs[i].env_status == ENV_RUNNABLE) {
+		state = 'Q';
+	    } else if (se->se_sleep_env == envs[i].env_id) {
+		state = 'S';
 	    } else {
-                // See if this environment is runnable
-		if (envs[i].env_status == ENV_RUNNABLE) {
-		    if (envs[i].priority < min_priority) {
-			//
-			// Check if this has the maximum priority. If so,
-			// remember it.
-			//
-			min_priority = envs[i].priority;
-			min_priority_index = i;
-		    }
-		}
+		state = 'B';
+	    }
+
+	    used = ss->ss_runtime;
+	    if (se->se_running) {
+		used += now - se->se_run_start;
+	    }
+	    used -= se->se_top_runtime;
+	    se->se_top_runtime += used;
+
+	    cprintf("%08x  %c %4d %4d %5u %8u %8u %8u %9u %8u %8u %8u\n",
+		    envs[i].env_id, state, envs[i].priority, se->se_last_cpu,
+		    window ? (uint32_t)(used * 100 / window) : 0,
+		    ss->ss_nr_sched, ss->ss_nr_voluntary,
+		    ss->ss_nr_involuntary,
+		    (uint32_t)(ss->ss_runtime >> 10),
+		    (uint32_t)(sched_wait_percentile(ss, 50) >> 10),
+		    (uint32_t)(sched_wait_percentile(ss, 99) >> 10),
+		    (uint32_t)(ss->ss_wait_max >> 10));
+	}
+
+	last_tsc = now;
+
+	return 0;
+}
+
+//
+// Scheduler benchmarks. A benchmark run resets the accounting, lets its
+// envs run, and then calls sched_bench_report(), which prints one line per
+// env and a summary line. Every line starts with SCHEDBENCH and is made of
+// key=value pairs, so that the console output of a headless QEMU run can
+// be parsed by a script. Times are in TSC cycles.
+//
+
+static uint64_t sched_bench_start;
+
+void
+sched_bench_reset(void)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++) {
+	    memset(&sched_envs[i].se_stats, 0, sizeof(struct Sched_stats));
+	    sched_envs[i].se_top_runtime = 0;
+	    if (sched_envs[i].se_running) {
+		sched_envs[i].se_run_start = read_tsc();
+	    }
+	}
+
+	for (i = 0; i < SCHED_NCPU; i++) {
+	    sched_cpus[i].cpu_idle_cycles = 0;
+	}
+
+	sched_bench_start = read_tsc();
+}
+
+int
+sched_bench_report(void)
+{
+	uint64_t window = read_tsc() - sched_bench_start;
+	uint64_t runtime = 0, idle = 0, overhead;
+	uint32_t switches = 0, waited;
+	int i, nenvs = 0, starved = 0, is_starved;
+	struct Sched_env *se;
+	struct Sched_stats *ss;
+
+	for (i = 0; i < NENV; i++) {
+	    if (envs[i].env_status == ENV_FREE) {
+		continue;
+	    }
+
+	    se = sched_env_get(&envs[i]);
+	    ss = &se->se_stats;
+	    nenvs++;
+
+	    //
+	    // Starvation check: a queued env that has not been picked for a
+	    // long time. With the priority policy this is what happens to low
+	    // priority envs under a high priority CPU hog.
+	    //
+	    waited = 0;
+	    if (envs[i].env_status == ENV_RUNNABLE && !se->se_running &&
+		se->se_wait_start) {
+		waited = sched_ticks - se->se_wait_tick;
 	    }
+	    is_starved = waited >= SCHED_STARVE_TICKS;
+	    starved += is_starved;
+
+	    runtime += ss->ss_runtime;
+	    switches += ss->ss_nr_voluntary + ss->ss_nr_involuntary;
+
+	    cprintf("SCHEDBENCH env=%08x prio=%d runs=%u vol=%u invol=%u "
+		    "runtime=%llu wait_p50=%llu wait_p99=%llu wait_max=%llu "
+		    "waiting_ticks=%u starved=%d\n",
+		    envs[i].env_id, envs[i].priority, ss->ss_nr_sched,
+		    ss->ss_nr_voluntary, ss->ss_nr_involuntary,
+		    ss->ss_runtime,
+		    sched_wait_percentile(ss, 50),
+		    sched_wait_percentile(ss, 99),
+		    ss->ss_wait_max, waited, is_starved);
 	}
 
-	// Run the environment with the maximum priority
-	if (envs[min_priority_index].env_status == ENV_RUNNABLE) {
-	    env_run(&envs[min_priority_index]);
+	for (i = 0; i < SCHED_NCPU; i++) {
+	    idle += sched_cpus[i].cpu_idle_cycles;
+	}
+
+	//
+	// Whatever time was neither spent in an env nor halted went to the
+	// scheduler and the context switches.
+	//
+	overhead = window * SCHED_NCPU;
+	overhead = overhead > runtime + idle ? overhead - runtime - idle : 0;
+
+	cprintf("SCHEDBENCH summary policy=%s cpus=%d envs=%d window=%llu "
+		"runtime=%llu idle=%llu switches=%u cycles_per_switch=%llu "
+		"starved=%d\n",
+		sched_class->sc_name, SCHED_NCPU, nenvs, window, runtime, idle,
+		switches, switches ? overhead / switches : 0, starved);
+
+	return 0;
+}
+
+//
+// Time the scheduler class on its own, without the context switches:
+// make 'decisions' scheduling decisions on this CPU's run queue, each of
+// them picking the next env, taking it off the queue and queueing it
+// again, which is what happens to an env that runs and is preempted. The
+// envs queued here take their turns as usual, so this does not change
+// who gets to run, only when.
+//
+int
+sched_bench_decide(int decisions)
+{
+	int cpu = sched_cpunum();
+	struct Sched_rq *rq = &sched_cpus[cpu].cpu_rq;
+	struct Sched_class *sc;
+	uint64_t start, cycles, total = 0, max = 0;
+	int i, env, queued, picked = 0;
+
+	if (decisions <= 0)
+		return -E_INVAL;
+
+	sched_lock(&rq->rq_lock);
+
+	sc = sched_class;
+	queued = rq->rq_nr_queued;
+
+	for (i = 0; i < decisions; i++) {
+	    start = read_tsc();
+	    env = sc->sc_pick_next(rq, cpu);
+	    if (env != SCHED_RQ_END) {
+		sc->sc_dequeue(rq, env);
+		sc->sc_enqueue(rq, env);
+		picked++;
+	    }
+	    cycles = read_tsc() - start;
+
+	    total += cycles;
+	    if (cycles > max)
+		max = cycles;
 	}
 
-end:
-	// Run the special idle environment when nothing else is runnable.
-	if (envs[0].env_status == ENV_RUNNABLE)
-		env_run(&envs[0]);
-	else {
-		cprintf("Destroyed all environments - nothing more to do!\n");
-		while (1)
-			monitor(NULL);
+	sched_unlock(&rq->rq_lock);
+
+	cprintf("SCHEDBENCH decide policy=%s cpu=%d queued=%d decisions=%d "
+		"picked=%d cycles_per_decision=%llu max=%llu\n",
+		sc->sc_name, cpu, queued, decisions, picked,
+		total / decisions, max);
+
+	return 0;
+}
+
+//
+// Routine to run the priority scheduling test programs with the
+// accounting reset, so that sched_bench_report() shows how each of them
+// fared. They are given distinct priorities, so that with the priority
+// policy the lower ones should show up as starved while the higher ones
+// keep the CPU busy.
+//
+int
+sched_invoke_prio_test(void)
+{
+	sched_bench_reset();
+
+	ENV_CREATE_PRIORITY(user_sched_prio1, 1);
+	ENV_CREATE_PRIORITY(user_sched_prio2, 2);
+	ENV_CREATE_PRIORITY(user_sched_prio3, 3);
+
+	sched_yield();
+}
+
+//
+// Run one of the scheduler benchmark programs with the accounting reset.
+// They print their own SCHEDBENCH lines, and sched_bench_report() adds the
+// kernel's view of the same run. Only one should run at a time, so that
+// they don't measure each other.
+//
+int
+sched_invoke_bench(int test)
+{
+	switch (test) {
+	case SCHED_BENCH_PINGPONG:
+		sched_bench_reset();
+		ENV_CREATE(user_schedbench_pingpong);
+		break;
+	case SCHED_BENCH_SWITCH:
+		sched_bench_reset();
+		ENV_CREATE(user_schedbench_switch);
+		break;
+	case SCHED_BENCH_MIX:
+		sched_bench_reset();
+		ENV_CREATE(user_schedbench_mix);
+		break;
+	case SCHED_BENCH_PRIO:
+		sched_invoke_prio_test();
+		break;
+	default:
+		return -E_INVAL;
 	}
+
+	sched_yield();
+}
+
+// Restrict the CPUs an environment may run on
+int
+sched_set_affinity(envid_t envid, uint32_t mask)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	mask &= sched_cpu_mask();
+	if (mask == 0)
+		return -E_INVAL;
+
+	//
+	// If the env is queued on a CPU it may no longer use, that CPU
+	// moves it the next time it walks its run queue.
+	//
+	sched_env_get(e)->se_affinity = mask;
+
+	return 0;
 }
 
+int
+sched_get_affinity(envid_t envid, uint32_t *mask_store)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	*mask_store = sched_env_get(e)->se_affinity & sched_cpu_mask();
+
+	return 0;
+}
@@ -0,0 +1,214 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SCHED_H
+#define JOS_KERN_SCHED_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <kern/env.h>
+
+// Defines
+
+//
+// Number of CPUs the scheduler keeps run queues for. SMP kernels define
+// JOS_SMP and provide NCPU and cpunum() through kern/cpu.h. Affinity masks
+// are 32 bits wide, so at most 32 CPUs are supported.
+//
+#if defined (JOS_SMP)
+#include <kern/cpu.h>
+#define SCHED_NCPU		NCPU
+#define sched_cpunum()		cpunum()
+#else
+#define SCHED_NCPU		1
+#define sched_cpunum()		0
+#endif
+
+// Affinity mask that lets an environment run on any CPU
+#define SCHED_AFFINITY_ALL	0xFFFFFFFF
+
+// Terminates a run queue. envs[0] is the idle env and never gets queued.
+#define SCHED_RQ_END		0
+
+// Timer ticks an env runs before it is preempted in favour of its peers
+#define SCHED_RR_SLICE		1
+
+#define MAX_SCHED_NAMELEN	16
+
+// Timer interrupts per second, as programmed by kclock_init()
+#define SCHED_HZ		100
+
+// Latency hint for sched_wakeup_hint(): run the env as soon as possible
+#define SCHED_WAKE_NOW		0
+
+// Range of env priorities. Lower value indicates higher priority.
+#define SCHED_PRIO_HIGHEST	0
+#define SCHED_PRIO_LOWEST	9999
+
+// How far priority inheritance follows a chain of blocked senders
+#define SCHED_PI_DEPTH		8
+
+// Wait time histogram: bucket b counts waits of 2^(b + SHIFT) cycles
+// or more, bucket 0 everything shorter than that too.
+#define SCHED_WAIT_BUCKETS	16
+#define SCHED_WAIT_SHIFT	10
+
+// A runnable env that has not run for this many ticks counts as starved
+#define SCHED_STARVE_TICKS	(5 * SCHED_HZ)
+
+// Benchmark programs for sched_invoke_bench()
+#define SCHED_BENCH_PINGPONG	0	// Yield and IPC round trips
+#define SCHED_BENCH_SWITCH	1	// Switch cost, 2 to NENV envs
+#define SCHED_BENCH_MIX		2	// CPU bound and IPC bound envs
+#define SCHED_BENCH_PRIO	3	// Starvation under the priority policy
+
+// Data Structures
+
+// Accounting kept for every env, returned by sched_env_stats()
+struct Sched_stats {
+    uint64_t		ss_runtime;	// TSC cycles spent running
+    uint32_t		ss_nr_sched;	// Times it was picked to run
+    uint32_t		ss_nr_voluntary;   // Switches away on its own
+    uint32_t		ss_nr_involuntary; // Switches away by preemption
+    uint64_t		ss_wait_max;	// Longest runnable to running wait
+    uint32_t		ss_wait_hist[SCHED_WAIT_BUCKETS];
+};
+
+struct Sched_lock {
+    volatile uint32_t	locked;
+};
+
+//
+// Scheduler state for each environment, indexed by ENVX(env_id). This is
+// kept outside struct Env so that env.c does not need to know about it.
+// se_env_id tells us whether the slot still describes the same env.
+//
+struct Sched_env {
+    envid_t		se_env_id;
+    uint32_t		se_affinity;	// CPUs this env may run on
+    int			se_next;	// Next env index on the run queue
+    int			se_prev;	// Previous env index on the run queue
+    int			se_rq;		// Run queue we are on, if se_queued
+    int			se_last_cpu;	// CPU this env last ran on
+    int			se_slice;	// Ticks left in the time slice
+    int			se_base_prio;	// Priority without inheritance
+    envid_t		se_blocked_on;	// Env we are trying to ipc_send to
+    envid_t		se_sleep_env;	// Env sleeping in this slot, if any
+    uint32_t		se_wake_tick;	// sched_ticks value to wake it at
+    struct Sched_stats	se_stats;
+    uint64_t		se_run_start;	// TSC when it was last dispatched
+    uint64_t		se_wait_start;	// TSC when it was queued, or 0
+    uint32_t		se_wait_tick;	// sched_ticks when it was queued
+    uint64_t		se_top_runtime;	// ss_runtime at the last display
+    uint8_t		se_queued;
+    volatile uint32_t	se_running;	// Claimed by a CPU, see sched_claim()
+};
+
+// Per CPU run queue. A doubly linked list of env indices.
+struct Sched_rq {
+    struct Sched_lock	rq_lock;
+    int			rq_head;
+    int			rq_tail;
+    volatile int	rq_nr_queued;
+};
+
+struct Sched_cpu {
+    struct Sched_rq	cpu_rq;
+    struct Env		*cpu_env;	// Env currently running on this CPU
+    volatile int	cpu_preempt;	// Set when a tick asked us to switch
+    volatile int	cpu_need_resched; // Set by sched_wakeup_hint()
+    envid_t		cpu_wake_env;	// Env to switch to on interrupt exit
+    volatile int	cpu_idle;	// Halted with no env to run
+    uint32_t		cpu_idle_count;	// PIT count programmed for the halt
+    uint32_t		cpu_idle_residue; // PIT counts not yet making a tick
+    uint64_t		cpu_idle_start;	// TSC when we halted
+    uint64_t		cpu_idle_cycles; // TSC cycles spent halted
+};
+
+//
+// A scheduling policy. sched_yield() dispatches through the hooks of the
+// class currently in use, which can be switched at runtime. Classes can be
+// provided by loadable modules through module_register().
+//
+// The enqueue, dequeue and pick_next hooks work on the run queue list
+// with the sched_rq_* helpers and are called with rq_lock held.
+// pick_next returns the env to run next on 'cpu' without removing it, or
+// SCHED_RQ_END. tick is called on every timer interrupt for the running
+// env and returns non zero if it should be preempted. yield is called when
+// the running env gives up the CPU on its own. check_preempt is asked
+// whether an env that was just woken up for 'curr' should run before it,
+// e.g. an IPC receiver the running env handed a message to. tick, yield
+// and check_preempt may be NULL.
+//
+struct Sched_class {
+    char		sc_name[MAX_SCHED_NAMELEN];
+    void		(*sc_enqueue)(struct Sched_rq *rq, int env);
+    void		(*sc_dequeue)(struct Sched_rq *rq, int env);
+    int			(*sc_pick_next)(struct Sched_rq *rq, int cpu);
+    int			(*sc_tick)(struct Sched_rq *rq, struct Env *e);
+    void		(*sc_yield)(struct Sched_rq *rq, struct Env *e);
+    int			(*sc_check_preempt)(struct Env *curr, struct Env *woken);
+
+    // Owned by the scheduler
+    int			sc_module;	// Module index, or -1 if built in
+    struct Sched_class	*sc_next;
+};
+
+extern struct Sched_env sched_envs[];
+extern struct Sched_cpu sched_cpus[];
+extern struct Sched_class * volatile sched_class;
+extern volatile uint32_t sched_ticks;
+
+// Function Prototypes
+
+// This function does not return.
+void sched_yield(void) __attribute__((noreturn));
+int sched_tick(void);
+
+void sched_wakeup(struct Env *e);
+void sched_wakeup_hint(struct Env *e, int latency);
+void sched_irq_exit(struct Trapframe *tf);
+int sched_set_affinity(envid_t envid, uint32_t mask);
+int sched_get_affinity(envid_t envid, uint32_t *mask_store);
+
+int sched_sleep(uint32_t msec);
+int sched_yield_to(envid_t envid);
+void sched_ipc_handoff(struct Env *receiver);
+int sched_env_stats(envid_t envid, struct Sched_stats *stats);
+int sched_display(void);
+void sched_bench_reset(void);
+int sched_bench_report(void);
+int sched_bench_decide(int decisions);
+int sched_invoke_prio_test(void);
+int sched_invoke_bench(int test);
+int sched_env_set_priority(envid_t envid, int prio);
+int sched_env_get_priority(envid_t envid);
+void sched_ipc_block(struct Env *sender, envid_t target);
+void sched_ipc_unblock(struct Env *sender);
+void sched_env_sync(void);
+void sched_env_adopt(int prio);
+
+//
+// Create an environment with the given priority. ENV_CREATE does not tell
+// us which env it allocated, so we note the envs that exist beforehand and
+// give the priority to the one that is new afterwards.
+//
+#define ENV_CREATE_PRIORITY(x, prio)			\
+	do {						\
+		sched_env_sync();			\
+		ENV_CREATE(x);				\
+		sched_env_adopt(prio);			\
+	} while (0)
+
+int sched_class_register(struct Sched_class *sc, int module_index);
+void sched_class_unregister_module(int module_index);
+int sched_set_policy(char *name);
+int sched_display_policies(void);
+
+// Run queue helpers for the scheduler classes
+void sched_rq_append(struct Sched_rq *rq, int env);
+void sched_rq_insert_before(struct Sched_rq *rq, int before, int env);
+void sched_rq_remove(struct Sched_rq *rq, int env);
+int sched_env_eligible(int env, int cpu);
+
+#endif	// !JOS_KERN_SCHED_H
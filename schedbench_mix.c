@@ -0,0 +1,137 @@
+// Scheduler benchmark: CPU bound envs and IPC bound envs side by side.
+//
+// CPU_ENVS envs spin through a fixed amount of work and report how much
+// they got done per million cycles. IPC_PAIRS client and server pairs do
+// ROUNDS request/response round trips each, and the clients report the
+// latency distribution. A policy that lets the CPU hogs hold up the IPC
+// envs shows it in the tail latency. Prints a SCHEDBENCH line per env, in
+// the same key=value format as the kernel's report. Times are in TSC
+// cycles.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define CPU_ENVS	2
+#define IPC_PAIRS	2
+
+#define WORK		(64 * 1024 * 1024)
+#define ROUNDS		5000
+
+// Latency histogram: bucket b counts round trips of 2^(b + SHIFT) cycles
+// or more, bucket 0 everything shorter than that too.
+#define BUCKETS		16
+#define SHIFT		10
+
+static void
+cpu_env(int id)
+{
+	uint64_t start, cycles;
+	volatile uint32_t x = 1;
+	uint32_t i;
+
+	start = read_tsc();
+	for (i = 0; i < WORK; i++)
+		x = x * 1103515245 + 12345;
+	cycles = read_tsc() - start;
+
+	cprintf("SCHEDBENCH mix env=cpu%d work=%u cycles=%llu "
+		"work_per_mcycle=%llu\n", id, WORK, cycles,
+		(uint64_t)WORK * 1000000 / cycles);
+	exit();
+}
+
+static void
+server_env(void)
+{
+	envid_t from;
+	uint32_t val;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++) {
+		val = ipc_recv(&from, 0, 0);
+		ipc_send(from, val, 0, 0);
+	}
+	exit();
+}
+
+// Upper bound of the latency 'pct' percent of round trips fit in
+static uint64_t
+percentile(uint32_t *hist, uint64_t max, int pct)
+{
+	uint32_t seen = 0;
+	int b;
+
+	for (b = 0; b < BUCKETS - 1; b++) {
+		seen += hist[b];
+		if ((uint64_t)seen * 100 >= (uint64_t)ROUNDS * pct)
+			return (uint64_t)1 << (b + SHIFT + 1);
+	}
+
+	return max;
+}
+
+static void
+client_env(int id, envid_t server)
+{
+	uint32_t hist[BUCKETS];
+	uint64_t start, cycles, total = 0, max = 0;
+	int i, b;
+
+	memset(hist, 0, sizeof(hist));
+
+	for (i = 0; i < ROUNDS; i++) {
+		start = read_tsc();
+		ipc_send(server, i, 0, 0);
+		ipc_recv(0, 0, 0);
+		cycles = read_tsc() - start;
+
+		total += cycles;
+		if (cycles > max)
+			max = cycles;
+
+		b = 0;
+		if ((cycles >> SHIFT) >> 32)
+			b = BUCKETS - 1;
+		else if (cycles >> SHIFT)
+			b = 31 - __builtin_clz((uint32_t)(cycles >> SHIFT));
+		hist[b < BUCKETS ? b : BUCKETS - 1]++;
+	}
+
+	cprintf("SCHEDBENCH mix env=ipc%d rounds=%d avg=%llu p50=%llu "
+		"p99=%llu max=%llu\n", id, ROUNDS, total / ROUNDS,
+		percentile(hist, max, 50), percentile(hist, max, 99), max);
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[CPU_ENVS + 2 * IPC_PAIRS];
+	envid_t server;
+	int i, n = 0;
+
+	for (i = 0; i < IPC_PAIRS; i++) {
+		if ((server = fork()) < 0)
+			panic("fork: %e", server);
+		if (server == 0)
+			server_env();
+		kids[n++] = server;
+
+		if ((kids[n] = fork()) < 0)
+			panic("fork: %e", kids[n]);
+		if (kids[n] == 0)
+			client_env(i, server);
+		n++;
+	}
+
+	for (i = 0; i < CPU_ENVS; i++) {
+		if ((kids[n] = fork()) < 0)
+			panic("fork: %e", kids[n]);
+		if (kids[n] == 0)
+			cpu_env(i);
+		n++;
+	}
+
+	for (i = 0; i < n; i++)
+		wait(kids[i]);
+}
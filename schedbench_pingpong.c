@@ -0,0 +1,97 @@
+// Scheduler benchmark: two envs passing the CPU back and forth.
+//
+// First with sys_yield(), which with nothing else runnable switches
+// straight to the other env and back. Then with an IPC round trip, which
+// goes through the directed handoff to the receiver. Prints a SCHEDBENCH
+// line for each, in the same key=value format as the kernel's report.
+// Times are in TSC cycles, for a whole round trip.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define ROUNDS		10000
+
+static void
+report(const char *test, uint64_t total, uint64_t min, uint64_t max)
+{
+	cprintf("SCHEDBENCH pingpong test=%s rounds=%d min=%llu avg=%llu "
+		"max=%llu\n", test, ROUNDS, min, total / ROUNDS, max);
+}
+
+static void
+yield_pingpong(void)
+{
+	uint64_t start, cycles, total = 0, min = ~0ULL, max = 0;
+	envid_t child;
+	int i;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		for (i = 0; i < ROUNDS; i++)
+			sys_yield();
+		exit();
+	}
+
+	for (i = 0; i < ROUNDS; i++) {
+		start = read_tsc();
+		sys_yield();
+		cycles = read_tsc() - start;
+
+		total += cycles;
+		if (cycles < min)
+			min = cycles;
+		if (cycles > max)
+			max = cycles;
+	}
+
+	wait(child);
+	report("yield", total, min, max);
+}
+
+static void
+ipc_pingpong(void)
+{
+	uint64_t start, cycles, total = 0, min = ~0ULL, max = 0;
+	envid_t child, from;
+	uint32_t val;
+	int i;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		for (i = 0; i < ROUNDS; i++) {
+			val = ipc_recv(&from, 0, 0);
+			ipc_send(from, val + 1, 0, 0);
+		}
+		exit();
+	}
+
+	for (i = 0; i < ROUNDS; i++) {
+		start = read_tsc();
+		ipc_send(child, i, 0, 0);
+		val = ipc_recv(0, 0, 0);
+		cycles = read_tsc() - start;
+
+		if (val != i + 1)
+			panic("ipc_pingpong: got %d, expected %d", val, i + 1);
+
+		total += cycles;
+		if (cycles < min)
+			min = cycles;
+		if (cycles > max)
+			max = cycles;
+	}
+
+	wait(child);
+	report("ipc", total, min, max);
+}
+
+void
+umain(int argc, char **argv)
+{
+	yield_pingpong();
+	ipc_pingpong();
+}
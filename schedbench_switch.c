@@ -0,0 +1,78 @@
+// Scheduler benchmark: context switch cost as the number of runnable
+// envs grows.
+//
+// For 2, 4, 8, ... envs up to NENV, or as many as fork() gives us, every
+// env yields YIELDS times. The children wait for a go message, so that
+// they all start together, and the parent times its own yields. Each of
+// its yields lets every other env run once, so the time per switch is the
+// parent's time over YIELDS * envs. Prints a SCHEDBENCH line per step, in
+// the same key=value format as the kernel's report. Times are in TSC
+// cycles.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define YIELDS		1000
+
+static envid_t kids[NENV];
+
+static void
+child(void)
+{
+	int i;
+
+	ipc_recv(0, 0, 0);
+	for (i = 0; i < YIELDS; i++)
+		sys_yield();
+	exit();
+}
+
+// Run one step with 'n' envs. Returns 0, or the error fork() gave us.
+static int
+run(int n)
+{
+	uint64_t start, cycles;
+	int i, nkids, r = 0;
+
+	for (nkids = 0; nkids < n - 1; nkids++) {
+		if ((r = fork()) < 0)
+			break;
+		if (r == 0)
+			child();
+		kids[nkids] = r;
+	}
+
+	if (r < 0) {
+		for (i = 0; i < nkids; i++)
+			sys_env_destroy(kids[i]);
+		return r;
+	}
+
+	for (i = 0; i < nkids; i++)
+		ipc_send(kids[i], 0, 0, 0);
+
+	start = read_tsc();
+	for (i = 0; i < YIELDS; i++)
+		sys_yield();
+	cycles = read_tsc() - start;
+
+	for (i = 0; i < nkids; i++)
+		wait(kids[i]);
+
+	cprintf("SCHEDBENCH switch envs=%d yields=%d cycles_per_switch=%llu\n",
+		n, YIELDS, cycles / ((uint64_t)YIELDS * n));
+	return 0;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int n, r;
+
+	for (n = 2; n <= NENV; n *= 2) {
+		if ((r = run(n)) < 0) {
+			cprintf("SCHEDBENCH switch envs=%d stopped=%e\n", n, r);
+			break;
+		}
+	}
+}
@@ -0,0 +1,211 @@
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/tasklet.h>
+
+//
+// Deferred work for interrupt handlers. A handler does what can't wait,
+// e.g. acknowledging the device, queues a tasklet for the rest, and
+// returns. trap() runs the queued tasklets through sched_irq_exit(), right
+// before it returns to the interrupted env.
+//
+// Tasklets run with interrupts disabled, unless the kernel is built with
+// TASKLET_IRQS, which lets other devices in meanwhile. That takes a trap()
+// that returns from an interrupt taken in the kernel straight to the
+// kernel, with iret. Stock JOS trap() calls env_run(curenv) or
+// sched_yield() instead, which would abandon the tasklet's frame. Even
+// then an interrupt that comes in while tasklets run must not switch envs,
+// see sched_irq_exit(), and on a CPU that was halted there is no env to go
+// back to, so there the tasklets run with interrupts disabled anyway.
+//
+// Each CPU has its own queue, so queueing only races with interrupts on
+// the same CPU, and tasklets don't need a lock. Newly queued tasklets are
+// pushed on tc_head with cmpxchg. tasklet_run() takes the whole list at
+// once with xchg, turns it around so that tasklets run in the order they
+// were queued, and runs at most TASKLET_BUDGET of them. What is left runs
+// on the next interrupt exit; the timer makes sure there is one soon.
+//
+
+#ifdef TASKLET_IRQS
+#define TASKLET_IRQS_ON		1
+#else
+#define TASKLET_IRQS_ON		0
+#endif
+
+// Tasklet queues, one per CPU
+static struct Tasklet_cpu tasklet_cpus[SCHED_NCPU];
+
+static inline uint32_t
+tasklet_xchg (volatile uint32_t *addr, uint32_t newval)
+{
+    uint32_t result;
+
+    asm volatile("lock; xchgl %0, %1" :
+		 "+m" (*addr), "=a" (result) :
+		 "1" (newval) :
+		 "cc");
+    return result;
+}
+
+static inline uint32_t
+tasklet_cmpxchg (volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+    uint32_t result;
+
+    asm volatile("lock; cmpxchgl %2, %1" :
+		 "=a" (result), "+m" (*addr) :
+		 "r" (newval), "0" (oldval) :
+		 "cc");
+    return result;
+}
+
+// Set and clear bits of a tasklet's state in one go
+static uint32_t
+tasklet_change_state (struct Tasklet *t, uint32_t set, uint32_t clear)
+{
+    uint32_t state;
+
+    do {
+	state = t->t_state;
+    } while (tasklet_cmpxchg(&t->t_state, state,
+			     (state | set) & ~clear) != state);
+
+    return state;
+}
+
+// Put a tasklet on this CPU's queue
+static void
+tasklet_push (struct Tasklet_cpu *tc, struct Tasklet *t)
+{
+    struct Tasklet *head;
+
+    do {
+	head = tc->tc_head;
+	t->t_next = head;
+    } while (tasklet_cmpxchg((volatile uint32_t *)&tc->tc_head,
+			     (uint32_t)head, (uint32_t)t) != (uint32_t)head);
+}
+
+void
+tasklet_init (struct Tasklet *t, void (*func)(uint32_t), uint32_t arg)
+{
+    t->t_func = func;
+    t->t_arg = arg;
+    t->t_state = 0;
+    t->t_next = NULL;
+}
+
+//
+// Queue a tasklet to run on this CPU. Returns 1 if it was queued, or 0 if
+// it was queued already or has been killed. Safe to call from interrupt
+// handlers, and from tasklets.
+//
+int
+tasklet_schedule (struct Tasklet *t)
+{
+    uint32_t state;
+
+    do {
+	state = t->t_state;
+	if (state & (TASKLET_SCHED | TASKLET_DEAD)) {
+	    return 0;
+	}
+    } while (tasklet_cmpxchg(&t->t_state, state, state | TASKLET_SCHED) != state);
+
+    tasklet_push(&tasklet_cpus[sched_cpunum()], t);
+
+    return 1;
+}
+
+//
+// Run the tasklets queued on this CPU, up to TASKLET_BUDGET of them. Called
+// with interrupts disabled; with TASKLET_IRQS the tasklets themselves run
+// with interrupts enabled, unless the CPU was halted. An interrupt that
+// comes in meanwhile finds us in here and does not run tasklets itself.
+//
+void
+tasklet_run (void)
+{
+    struct Tasklet_cpu *tc = &tasklet_cpus[sched_cpunum()];
+    struct Tasklet *t, *next, *list;
+    int budget, irqs = TASKLET_IRQS_ON && curenv != NULL;
+
+    if (tc->tc_running || (tc->tc_head == NULL && tc->tc_list == NULL)) {
+	return;
+    }
+    tc->tc_running = 1;
+
+    for (budget = TASKLET_BUDGET; budget > 0; budget--) {
+	if (tc->tc_list == NULL) {
+	    // Take what was queued, oldest first
+	    t = (struct Tasklet *)tasklet_xchg((volatile uint32_t *)&tc->tc_head,
+					       0);
+	    for (list = NULL; t != NULL; t = next) {
+		next = t->t_next;
+		t->t_next = list;
+		list = t;
+	    }
+
+	    if ((tc->tc_list = list) == NULL) {
+		break;
+	    }
+	}
+
+	t = tc->tc_list;
+	tc->tc_list = t->t_next;
+
+	//
+	// It can be queued again from here on, even by itself. If it is
+	// still running on another CPU, it has to wait for the next round.
+	//
+	if (tasklet_change_state(t, TASKLET_RUN, 0) & TASKLET_RUN) {
+	    tasklet_push(tc, t);
+	    continue;
+	}
+	tasklet_change_state(t, 0, TASKLET_SCHED);
+
+	if (irqs) {
+	    asm volatile("sti");
+	}
+	t->t_func(t->t_arg);
+	if (irqs) {
+	    asm volatile("cli");
+	}
+
+	tasklet_change_state(t, 0, TASKLET_RUN);
+	tc->tc_ran++;
+    }
+
+    if (budget == 0 && (tc->tc_list != NULL || tc->tc_head != NULL)) {
+	tc->tc_over_budget++;
+    }
+
+    tc->tc_running = 0;
+}
+
+//
+// Make sure a tasklet does not run any more, e.g. before the module it is
+// in goes away. Waits for it to run if it is queued. Must not be called
+// from a tasklet.
+//
+void
+tasklet_kill (struct Tasklet *t)
+{
+    tasklet_change_state(t, TASKLET_DEAD, 0);
+
+    while (t->t_state & (TASKLET_SCHED | TASKLET_RUN)) {
+	// It may be queued on this CPU
+	tasklet_run();
+	asm volatile("pause");
+    }
+}
+
+// Are we running tasklets on this CPU?
+int
+tasklet_active (void)
+{
+    return tasklet_cpus[sched_cpunum()].tc_running;
+}
+
+// End of File
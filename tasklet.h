@@ -0,0 +1,47 @@
+#ifndef JOS_KERN_TASKLET_H
+#define JOS_KERN_TASKLET_H
+
+#include <inc/types.h>
+
+// Defines
+
+// Tasklets run at most this many at a time, per CPU
+#define TASKLET_BUDGET		16
+
+// Tasklet states
+#define TASKLET_SCHED		0x1	// Queued to run
+#define TASKLET_RUN		0x2	// Running right now
+#define TASKLET_DEAD		0x4	// Killed, can't be queued any more
+
+// Data Structures
+
+//
+// Work an interrupt handler leaves for later. A tasklet is queued at most
+// once at a time; queueing it again before it ran does nothing. It runs on
+// the CPU that queued it. t_state and t_next belong to tasklet.c.
+//
+struct Tasklet {
+    void		(*t_func)(uint32_t arg);
+    uint32_t		t_arg;
+    volatile uint32_t	t_state;
+    struct Tasklet	*t_next;
+};
+
+// Per CPU tasklet queue
+struct Tasklet_cpu {
+    struct Tasklet * volatile tc_head;	// Newly queued ones, newest first
+    struct Tasklet	*tc_list;	// Taken off tc_head, oldest first
+    volatile int	tc_running;	// Inside tasklet_run()
+    uint32_t		tc_ran;		// Tasklets run so far
+    uint32_t		tc_over_budget;	// Runs that left work behind
+};
+
+// Function Prototypes
+
+void tasklet_init (struct Tasklet *t, void (*func)(uint32_t), uint32_t arg);
+int tasklet_schedule (struct Tasklet *t);
+void tasklet_kill (struct Tasklet *t);
+void tasklet_run (void);
+int tasklet_active (void);
+
+#endif // !JOS_KERN_TASKLET_H
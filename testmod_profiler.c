@@ -0,0 +1,240 @@
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+#include <inc/memlayout.h>
+#include <kern/env.h>
+#include <kern/kdebug.h>
+#include <kern/sched.h>
+#include <kern/module.h>
+#include <kern/ksym.h>
+
+//
+// Sampling profiler, as a loadable module. It hooks the timer interrupt
+// and records where the CPU was every prof_interval ticks: the env that
+// was running, the EIP, and whether it was in user mode. Samples go into a
+// buffer that is part of the module image, so nothing is allocated while
+// sampling, and a sample costs the same whatever has been recorded so far.
+// Once the buffer is full, samples are counted as dropped.
+//
+// All the symbol lookups are left for the report, which the "profile"
+// monitor command asks for through module_invoke_show_profile(). Kernel
+// addresses are looked up in the kernel's stabs, addresses in modules in
+// the exports of the kernel symbol table. User addresses are only counted
+// per env. The report starts a new profile.
+//
+
+// Defines
+
+#define PROF_MAX_SAMPLES	8192
+#define PROF_MAX_FUNCS		128
+#define PROF_REPORT_LINES	20
+
+// Data Structures
+
+struct Prof_sample {
+    envid_t	    ps_env;	// 0 if no env was running
+    uint32_t	    ps_eip;
+    uint32_t	    ps_user;	// Interrupted in user mode
+};
+
+// Samples that ended up in the same function, or in the same env
+struct Prof_func {
+    uint32_t	    pf_addr;	// Function address, or env id for user mode
+    uint32_t	    pf_user;
+    const char	    *pf_name;
+    int		    pf_namelen;
+    uint32_t	    pf_count;
+};
+
+// Global variables
+
+// Timer ticks between samples. SCHED_HZ / prof_interval samples a second.
+uint32_t prof_interval = 1;
+
+static struct Prof_sample prof_samples[PROF_MAX_SAMPLES];
+static struct Prof_func prof_funcs[PROF_MAX_FUNCS];
+static uint32_t prof_nsamples;
+static uint32_t prof_dropped;
+static uint32_t prof_ticks;
+
+// What sampling costs, in TSC cycles
+static uint64_t prof_cycles;
+static uint64_t prof_max_cycles;
+
+// Timer hook. Records a sample every prof_interval ticks.
+static int
+prof_timer_tick (struct Trapframe *tf)
+{
+    uint64_t start = read_tsc(), cycles;
+    struct Prof_sample *ps;
+
+    if (++prof_ticks < prof_interval) {
+	return 0;
+    }
+    prof_ticks = 0;
+
+    if (prof_nsamples == PROF_MAX_SAMPLES) {
+	prof_dropped++;
+	return 0;
+    }
+
+    ps = &prof_samples[prof_nsamples++];
+    ps->ps_env = curenv ? curenv->env_id : 0;
+    ps->ps_eip = tf->tf_eip;
+    ps->ps_user = (tf->tf_cs & 3) == 3;
+
+    cycles = read_tsc() - start;
+    prof_cycles += cycles;
+    if (cycles > prof_max_cycles) {
+	prof_max_cycles = cycles;
+    }
+
+    return 0;
+}
+
+// Set the sampling rate, in samples a second
+void
+prof_set_rate (uint32_t hz)
+{
+    if (hz == 0 || hz > SCHED_HZ) {
+	hz = SCHED_HZ;
+    }
+
+    prof_interval = SCHED_HZ / hz;
+}
+
+// Throw away what was recorded, and start over
+void
+prof_reset (void)
+{
+    prof_nsamples = 0;
+    prof_dropped = 0;
+    prof_cycles = 0;
+    prof_max_cycles = 0;
+}
+
+//
+// Find the function a sample was in. User mode samples are counted per
+// env, everything else per function.
+//
+static void
+prof_symbolize (struct Prof_sample *ps, struct Prof_func *pf)
+{
+    struct Eipdebuginfo info;
+    uint32_t addr;
+
+    memset(pf, 0, sizeof(*pf));
+    pf->pf_user = ps->ps_user;
+
+    if (ps->ps_user) {
+	pf->pf_addr = ps->ps_env;
+	return;
+    }
+
+    if (ps->ps_eip >= MODULE_DATA && ps->ps_eip < MODULE_DATA + MODULE_DATA_SIZE) {
+	if ((pf->pf_name = ksym_addr_name(ps->ps_eip, &addr)) != NULL) {
+	    pf->pf_addr = addr;
+	    pf->pf_namelen = strlen(pf->pf_name);
+	    return;
+	}
+    } else if (debuginfo_eip(ps->ps_eip, &info) == 0) {
+	pf->pf_addr = info.eip_fn_addr;
+	pf->pf_name = info.eip_fn_name;
+	pf->pf_namelen = info.eip_fn_namelen;
+	return;
+    }
+
+    // Don't know, so every address counts on its own
+    pf->pf_addr = ps->ps_eip;
+}
+
+// Print the flat profile, busiest function first
+static int
+prof_show_profile (void)
+{
+    struct Prof_func pf, tmp;
+    uint32_t i, j, nfuncs = 0, other = 0;
+
+    cprintf("Profile: %d samples, %d dropped, every %d ticks\n",
+	    prof_nsamples, prof_dropped, prof_interval);
+
+    if (prof_nsamples == 0) {
+	return 0;
+    }
+
+    cprintf("Sampling cost: %d cycles average, %d max\n",
+	    (uint32_t)(prof_cycles / prof_nsamples), (uint32_t)prof_max_cycles);
+
+    // Count the samples per function
+    for (i = 0; i < prof_nsamples; i++) {
+	prof_symbolize(&prof_samples[i], &pf);
+
+	for (j = 0; j < nfuncs; j++) {
+	    if (prof_funcs[j].pf_addr == pf.pf_addr &&
+		prof_funcs[j].pf_user == pf.pf_user) {
+		break;
+	    }
+	}
+
+	if (j == nfuncs) {
+	    if (nfuncs == PROF_MAX_FUNCS) {
+		other++;
+		continue;
+	    }
+	    prof_funcs[nfuncs++] = pf;
+	}
+	prof_funcs[j].pf_count++;
+    }
+
+    // Busiest first. There are few enough of them for an insertion sort.
+    for (i = 1; i < nfuncs; i++) {
+	tmp = prof_funcs[i];
+	for (j = i; j > 0 && prof_funcs[j - 1].pf_count < tmp.pf_count; j--) {
+	    prof_funcs[j] = prof_funcs[j - 1];
+	}
+	prof_funcs[j] = tmp;
+    }
+
+    cprintf("  %%     samples  function\n");
+    for (i = 0; i < nfuncs && i < PROF_REPORT_LINES; i++) {
+	cprintf("%3d  %10d  ", prof_funcs[i].pf_count * 100 / prof_nsamples,
+		prof_funcs[i].pf_count);
+
+	if (prof_funcs[i].pf_user) {
+	    cprintf("[user] env %08x\n", prof_funcs[i].pf_addr);
+	} else if (prof_funcs[i].pf_name) {
+	    cprintf("%.*s\n", prof_funcs[i].pf_namelen, prof_funcs[i].pf_name);
+	} else {
+	    cprintf("0x%08x\n", prof_funcs[i].pf_addr);
+	}
+    }
+
+    if (other) {
+	cprintf("%d samples in other functions\n", other);
+    }
+
+    prof_reset();
+
+    return 0;
+}
+
+int
+init_module (uint32_t mod_index)
+{
+    prof_reset();
+
+    module_register(mod_index, MODULE_TIMER_TICK, prof_timer_tick);
+    module_register(mod_index, MODULE_SHOW_PROFILE, prof_show_profile);
+
+    return 0;
+}
+
+int
+cleanup_module (uint32_t mod_index)
+{
+    // module_cleanup() drops our hooks
+    return 0;
+}
+
+// End of File
@@ -0,0 +1,124 @@
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/tsc.h>
+#include <kern/trace.h>
+
+//
+// Tracepoints, for hot paths that can't afford cprintf. TRACE() writes a
+// small binary record: the event, the TSC, the env and up to three
+// arguments. Nothing is formatted until trace_dump() is asked for the
+// records, by the "trace" monitor command.
+//
+// Each CPU writes to a ring of its own. The only other writers to it are
+// interrupt handlers on the same CPU, so claiming a slot is a single xadd,
+// without a lock prefix. When the ring is full the oldest records are
+// overwritten.
+//
+
+// Categories of tracepoints that are enabled
+volatile uint32_t trace_mask = TRACE_CAT_ALL;
+
+static struct Trace_ring trace_rings[SCHED_NCPU];
+
+// How to print the events
+static const struct {
+    const char	    *te_name;
+    const char	    *te_fmt;	// Format of the arguments
+} trace_events[TRACE_NEVENTS] = {
+    [TRACE_E100_TX_FULL]	= { "e100_tx_full",	"head %u tail %u" },
+    [TRACE_E100_RX_DROP]	= { "e100_rx_drop",	"rfd %u len %u" },
+    [TRACE_SCHED_RUN]		= { "sched_run",	"env %08x cpu %u" },
+    [TRACE_SCHED_WAKE_HINT]	= { "sched_wake_hint",	"env %08x latency %d" },
+    [TRACE_MODULE_LOAD]		= { "module_load",	"index %u base 0x%x pages %u" },
+    [TRACE_MODULE_REGISTER]	= { "module_register",	"index %u type %u vector 0x%x" },
+    [TRACE_MODULE_REAP]		= { "module_reap",	"index %u cleanup %u cycles" },
+};
+
+// Write a trace record. Use TRACE() rather than calling this directly.
+void
+trace_record (uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+    struct Trace_ring *tr = &trace_rings[sched_cpunum()];
+    struct Trace_rec *rec;
+    uint32_t pos = 1;
+
+    asm volatile("xaddl %0, %1" : "+r" (pos), "+m" (tr->trr_head) : : "cc");
+
+    rec = &tr->trr_recs[pos & (TRACE_RING_SIZE - 1)];
+    rec->tr_seq = 0;
+    asm volatile("" : : : "memory");
+
+    rec->tr_tsc = read_tsc();
+    rec->tr_event = event;
+    rec->tr_env = curenv ? curenv->env_id : 0;
+    rec->tr_args[0] = a0;
+    rec->tr_args[1] = a1;
+    rec->tr_args[2] = a2;
+
+    asm volatile("" : : : "memory");
+    rec->tr_seq = pos + 1;
+}
+
+// Choose the categories of tracepoints to record
+void
+trace_set_mask (uint32_t mask)
+{
+    trace_mask = mask;
+}
+
+//
+// Print the records in the trace rings, oldest first. Times are in
+// microseconds since the oldest record of the same CPU.
+//
+int
+trace_dump (void)
+{
+    struct Trace_ring *tr;
+    struct Trace_rec *rec;
+    uint32_t head, pos, lost;
+    uint64_t base, us;
+    int cpu;
+
+    cprintf("\nTrace mask: 0x%x\n", trace_mask);
+
+    for (cpu = 0; cpu < SCHED_NCPU; cpu++) {
+	tr = &trace_rings[cpu];
+	head = tr->trr_head;
+	if (head == 0) {
+	    continue;
+	}
+
+	pos = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+	base = tr->trr_recs[pos & (TRACE_RING_SIZE - 1)].tr_tsc;
+	lost = 0;
+
+	cprintf("\nCPU %d: %u records\n", cpu, head);
+
+	for (; pos != head; pos++) {
+	    rec = &tr->trr_recs[pos & (TRACE_RING_SIZE - 1)];
+
+	    // Overwritten, or being written, while we got here
+	    if (rec->tr_seq != pos + 1 || rec->tr_event >= TRACE_NEVENTS) {
+		lost++;
+		continue;
+	    }
+
+	    us = tsc_cycles2ns(rec->tr_tsc - base) / 1000;
+	    cprintf("%10u us  %08x  %-16s ", (uint32_t)us, rec->tr_env,
+		    trace_events[rec->tr_event].te_name);
+	    cprintf(trace_events[rec->tr_event].te_fmt, rec->tr_args[0],
+		    rec->tr_args[1], rec->tr_args[2]);
+	    cprintf("\n");
+	}
+
+	if (lost) {
+	    cprintf("%u records changed while they were printed\n", lost);
+	}
+    }
+
+    return 0;
+}
+
+// End of File
@@ -0,0 +1,68 @@
+#ifndef JOS_KERN_TRACE_H
+#define JOS_KERN_TRACE_H
+
+#include <inc/types.h>
+
+// Defines
+
+// Records kept per CPU. Must be a power of 2.
+#define TRACE_RING_SIZE		1024
+
+// Categories of tracepoints, enabled and disabled together
+#define TRACE_CAT_NET		0x0001
+#define TRACE_CAT_SCHED		0x0002
+#define TRACE_CAT_MODULE	0x0004
+#define TRACE_CAT_ALL		0xffffffff
+
+// Events. trace.c knows how to print each of them.
+#define TRACE_E100_TX_FULL	0	// head, tail
+#define TRACE_E100_RX_DROP	1	// RFD, length
+#define TRACE_SCHED_RUN		2	// env, cpu
+#define TRACE_SCHED_WAKE_HINT	3	// env, latency
+#define TRACE_MODULE_LOAD	4	// index, base, pages
+#define TRACE_MODULE_REGISTER	5	// index, type, vector
+#define TRACE_MODULE_REAP	6	// index, cleanup cycles
+#define TRACE_NEVENTS		7
+
+//
+// Record an event if its category is enabled. When it is not, all this
+// costs is a load and a test.
+//
+#define TRACE(cat, event, a0, a1, a2)					\
+	do {								\
+		if (trace_mask & (cat))					\
+			trace_record((event), (uint32_t)(a0),		\
+				     (uint32_t)(a1), (uint32_t)(a2));	\
+	} while (0)
+
+// Data Structures
+
+//
+// A trace record. tr_seq is written last, and is the record's position
+// in the ring plus one, so a reader can tell a record that is complete
+// from one that is being written or is left over from a lap before.
+//
+struct Trace_rec {
+    uint64_t		tr_tsc;
+    uint16_t		tr_event;
+    uint16_t		tr_pad;
+    int32_t		tr_env;		// Env running, or 0
+    uint32_t		tr_args[3];
+    volatile uint32_t	tr_seq;
+};
+
+// Per CPU trace ring
+struct Trace_ring {
+    volatile uint32_t	trr_head;	// Records written so far
+    struct Trace_rec	trr_recs[TRACE_RING_SIZE];
+};
+
+extern volatile uint32_t trace_mask;
+
+// Function Prototypes
+
+void trace_record (uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2);
+void trace_set_mask (uint32_t mask);
+int trace_dump (void);
+
+#endif // !JOS_KERN_TRACE_H
@@ -0,0 +1,203 @@
+#include <inc/stdio.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kclock.h>
+#include <kern/tsc.h>
+
+//
+// The kernel's clock. The TSC is calibrated against the PIT once at boot,
+// and from then on time is the TSC scaled to nanoseconds. Everything that
+// measures time uses the TSC, so the cycle counts the scheduler and the
+// module cost accounting keep can be converted with tsc_cycles2ns() and
+// compared with each other and with tsc_ns().
+//
+// The clock lives in a page of its own that every env has mapped read
+// only at UTIMEPAGE, so user code can read the time with
+// tsc_timepage_ns() without a system call. tsc_tick() moves the base of
+// the clock forward once a second's worth of cycles went by since the
+// last time, so that the scaled deltas never get anywhere near
+// overflowing. It goes by the TSC rather than by sched_ticks, which jump
+// when CPU 0 wakes up from a tickless idle.
+//
+
+// PIT channel 2, whose gate and output are in the keyboard controller
+#define TSC_PIT_CNTR2		(IO_TIMER1 + 2)
+#define TSC_PIT_SEL2		0x80
+#define TSC_PIT_INTTC		0x00	// mode 0, out goes high at terminal count
+#define TSC_PIT_16BIT		0x30
+#define TSC_PORT_B		0x61
+#define TSC_PORT_B_GATE2	0x01
+#define TSC_PORT_B_SPEAKER	0x02
+#define TSC_PORT_B_OUT2		0x20
+
+// Calibration runs; the shortest one wins
+#define TSC_CALIBRATE_RUNS	3
+
+// Give up on a PIT that never counts down after this many polls
+#define TSC_CALIBRATE_SPINS	10000000
+
+// How often the base of the clock is moved forward
+#define TSC_REBASE_MS		1000
+
+struct Tsc_timepage *tsc_timepage;
+
+// TSC_REBASE_MS in cycles
+static uint64_t tsc_rebase_cycles;
+
+//
+// Count TSC cycles while PIT channel 2 counts down TSC_CALIBRATE_MS
+// milliseconds. Returns 0 if the PIT doesn't seem to be there.
+//
+static uint64_t
+tsc_calibrate_once (void)
+{
+    uint32_t count = TIMER_FREQ / 1000 * TSC_CALIBRATE_MS, spins;
+    uint64_t start, end;
+    uint8_t port_b;
+
+    // Gate on, speaker off
+    port_b = inb(TSC_PORT_B);
+    outb(TSC_PORT_B, (port_b & ~TSC_PORT_B_SPEAKER) | TSC_PORT_B_GATE2);
+
+    outb(TIMER_MODE, TSC_PIT_SEL2 | TSC_PIT_INTTC | TSC_PIT_16BIT);
+    outb(TSC_PIT_CNTR2, count % 256);
+    outb(TSC_PIT_CNTR2, count / 256);
+
+    start = read_tsc();
+    for (spins = 0; !(inb(TSC_PORT_B) & TSC_PORT_B_OUT2); spins++) {
+	if (spins == TSC_CALIBRATE_SPINS) {
+	    outb(TSC_PORT_B, port_b);
+	    return 0;
+	}
+    }
+    end = read_tsc();
+
+    outb(TSC_PORT_B, port_b);
+
+    return end - start;
+}
+
+// Move the base of the clock to now
+static void
+tsc_rebase (void)
+{
+    struct Tsc_timepage *tp = tsc_timepage;
+    uint64_t tsc = read_tsc();
+
+    tp->tp_seq++;
+    asm volatile("" : : : "memory");
+
+    tp->tp_ns_base += ((tsc - tp->tp_tsc_base) * tp->tp_mult) >> tp->tp_shift;
+    tp->tp_tsc_base = tsc;
+
+    asm volatile("" : : : "memory");
+    tp->tp_seq++;
+}
+
+//
+// Calibrate the TSC and set up the time page. Called once at boot, with
+// interrupts disabled, before the first env is created.
+//
+void
+tsc_init (void)
+{
+    struct Page *pp;
+    uint64_t cycles, best = 0;
+    uint32_t khz;
+    int i;
+
+    // The envs array has to leave room for the time page
+    assert(UENVS + NENV * sizeof(struct Env) <= UTIMEPAGE);
+
+    for (i = 0; i < TSC_CALIBRATE_RUNS; i++) {
+	cycles = tsc_calibrate_once();
+	if (cycles && (best == 0 || cycles < best)) {
+	    best = cycles;
+	}
+    }
+
+    if (best == 0) {
+	panic("tsc_init: can't calibrate the TSC against the PIT");
+    }
+    khz = best / TSC_CALIBRATE_MS;
+
+    if (page_alloc(&pp) < 0) {
+	panic("tsc_init: out of memory for the time page");
+    }
+    pp->pp_ref++;
+    memset(page2kva(pp), 0, PGSIZE);
+
+    tsc_timepage = page2kva(pp);
+    tsc_timepage->tp_khz = khz;
+    tsc_timepage->tp_shift = TSC_SHIFT;
+    tsc_timepage->tp_mult = ((uint64_t)1000000 << TSC_SHIFT) / khz;
+    tsc_timepage->tp_tsc_base = read_tsc();
+    tsc_timepage->tp_ns_base = 0;
+    tsc_rebase_cycles = (uint64_t)khz * TSC_REBASE_MS;
+
+    // Envs get it through the page table they share with the kernel
+    tsc_map_timepage(boot_pgdir);
+
+    cprintf("TSC: %u.%03u MHz\n", khz / 1000, khz % 1000);
+}
+
+//
+// Called on every timer tick on CPU 0, and when CPU 0 leaves idle. Moves
+// the base of the clock once it is TSC_REBASE_MS old.
+//
+void
+tsc_tick (void)
+{
+    if (tsc_timepage &&
+	read_tsc() - tsc_timepage->tp_tsc_base >= tsc_rebase_cycles) {
+	tsc_rebase();
+    }
+}
+
+// Nanoseconds since boot
+uint64_t
+tsc_ns (void)
+{
+    if (tsc_timepage == NULL) {
+	return 0;
+    }
+
+    return tsc_timepage_ns(tsc_timepage);
+}
+
+//
+// Convert a number of TSC cycles to nanoseconds. The result is only good
+// for up to 2^40 ns, about 18 minutes, which is plenty for measurements.
+//
+uint64_t
+tsc_cycles2ns (uint64_t cycles)
+{
+    if (tsc_timepage == NULL) {
+	return 0;
+    }
+
+    return (cycles * tsc_timepage->tp_mult) >> tsc_timepage->tp_shift;
+}
+
+//
+// Map the time page read only at UTIMEPAGE. The page table behind it is
+// shared by the kernel and every env, so mapping it in boot_pgdir once
+// makes it show up everywhere.
+//
+int
+tsc_map_timepage (pde_t *pgdir)
+{
+    if (tsc_timepage == NULL) {
+	return -E_INVAL;
+    }
+
+    return page_insert(pgdir, pa2page(PADDR(tsc_timepage)),
+		       (void *)UTIMEPAGE, PTE_U | PTE_P);
+}
+
+// End of File
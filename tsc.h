@@ -0,0 +1,76 @@
+#ifndef JOS_KERN_TSC_H
+#define JOS_KERN_TSC_H
+
+#include <inc/types.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+
+// Defines
+
+//
+// Where the time page is mapped in every env, read only. It is the last
+// page of the UENVS window, which has room to spare after the envs array.
+//
+#ifndef UTIMEPAGE
+#define UTIMEPAGE		(UPAGES - PGSIZE)
+#endif
+
+// ns = cycles * mult >> TSC_SHIFT. Good for deltas of up to 2^40 ns.
+#define TSC_SHIFT		24
+
+// How long the TSC is calibrated against the PIT for, in milliseconds
+#define TSC_CALIBRATE_MS	10
+
+// Data Structures
+
+//
+// The clock, as kept in the time page. The time is tp_ns_base at TSC
+// value tp_tsc_base, plus whatever the TSC counted since, converted with
+// tp_mult and tp_shift. The kernel moves the base forward now and then.
+// tp_seq is odd while it does; readers retry if tp_seq was odd or changed
+// while they read.
+//
+struct Tsc_timepage {
+    volatile uint32_t	tp_seq;
+    uint32_t		tp_mult;
+    uint32_t		tp_shift;
+    uint32_t		tp_khz;		// TSC frequency
+    uint64_t		tp_tsc_base;
+    uint64_t		tp_ns_base;
+};
+
+//
+// Nanoseconds since boot, from a time page. This needs nothing but the
+// page and rdtsc, so user code can call it on the page at UTIMEPAGE.
+//
+static __inline uint64_t
+tsc_timepage_ns (const volatile struct Tsc_timepage *tp)
+{
+    uint32_t seq, mult, shift;
+    uint64_t tsc_base, ns_base, tsc;
+
+    do {
+	seq = tp->tp_seq;
+	__asm __volatile("" : : : "memory");
+	mult = tp->tp_mult;
+	shift = tp->tp_shift;
+	tsc_base = tp->tp_tsc_base;
+	ns_base = tp->tp_ns_base;
+	tsc = read_tsc();
+	__asm __volatile("" : : : "memory");
+    } while ((seq & 1) || tp->tp_seq != seq);
+
+    return ns_base + (((tsc - tsc_base) * mult) >> shift);
+}
+
+extern struct Tsc_timepage *tsc_timepage;
+
+// Function Prototypes
+
+void tsc_init (void);
+void tsc_tick (void);
+uint64_t tsc_ns (void);
+uint64_t tsc_cycles2ns (uint64_t cycles);
+int tsc_map_timepage (pde_t *pgdir);
+
+#endif // !JOS_KERN_TSC_H